@@ -0,0 +1,1159 @@
+#include "artifact.h"
+#include "compiler.h"
+#include "memory.h"
+#include "utils.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define ATOMIC_INCREMENT(count) _InterlockedIncrement(count)
+#define ATOMIC_DECREMENT(count) _InterlockedDecrement(count)
+#define ATOMIC_LOAD_POINTER(slot) _InterlockedCompareExchangePointer((void* volatile*)(slot), NULL, NULL)
+#define ATOMIC_PUBLISH_POINTER(slot, value) \
+	(_InterlockedCompareExchangePointer((void* volatile*)(slot), (value), NULL) == NULL)
+#else
+#define ATOMIC_INCREMENT(count) __atomic_add_fetch(count, 1, __ATOMIC_RELAXED)
+#define ATOMIC_DECREMENT(count) __atomic_sub_fetch(count, 1, __ATOMIC_ACQ_REL)
+#define ATOMIC_LOAD_POINTER(slot) __atomic_load_n(slot, __ATOMIC_ACQUIRE)
+#define ATOMIC_PUBLISH_POINTER(slot, value) __extension__({ \
+	__typeof__(*(slot)) expected = NULL; \
+	__atomic_compare_exchange_n(slot, &expected, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#endif
+
+static void* allocate_frozen(size_t size)
+{
+	void* memory = calloc(1, size > 0 ? size : 1);
+	if (memory == NULL) {
+		exit(1);
+	}
+	return memory;
+}
+
+static FrozenString freeze_string(const char* chars, int length)
+{
+	FrozenString string;
+	string.chars = (char*)allocate_frozen(length + 1);
+	memcpy(string.chars, chars, length);
+	string.length = length;
+	return string;
+}
+
+// Frees [function] and everything it owns. When [mapped] is true, its code
+// and strings live in a loaded image and are left alone.
+static void free_frozen_function(FrozenFunction* function, bool mapped)
+{
+	if (function == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < function->constant_count; i++)
+	{
+		FrozenConstant* constant = &function->constants[i];
+		if (constant->type == FROZEN_STRING && !mapped) {
+			free(constant->as.string.chars);
+		} else if (constant->type == FROZEN_FUNCTION) {
+			free_frozen_function(constant->as.function, mapped);
+		}
+	}
+
+	if (!mapped)
+	{
+		free(function->name.chars);
+		free(function->code);
+	}
+	free(function->lines);
+	free(function->constants);
+	free(function);
+}
+
+static FrozenFunction* freeze_function(ObjFunction* function)
+{
+	if (function->lazy_source != NULL && !compile_lazy(function)) {
+		return NULL;
+	}
+
+	FrozenFunction* frozen = (FrozenFunction*)allocate_frozen(sizeof(FrozenFunction));
+	if (function->name != NULL) {
+		frozen->name = freeze_string(function->name->chars, function->name->length);
+	}
+	frozen->arity = function->arity;
+	frozen->upvalue_count = function->upvalue_count;
+	frozen->max_slots = function->max_slots;
+	frozen->cache_count = function->chunk.cache_count;
+
+	Chunk* chunk = &function->chunk;
+	frozen->code_count = chunk->count;
+	frozen->code = (uint8_t*)allocate_frozen(chunk->count);
+	memcpy(frozen->code, chunk->code, chunk->count);
+	frozen->lines = (int*)allocate_frozen(sizeof(int) * chunk->count);
+	memcpy(frozen->lines, chunk->lines, sizeof(int) * chunk->count);
+
+	frozen->constants = (FrozenConstant*)allocate_frozen(sizeof(FrozenConstant) * chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count; i++)
+	{
+		Value value = chunk->constants.values[i];
+		FrozenConstant* constant = &frozen->constants[i];
+		if (IS_NUMBER(value)) {
+			constant->type = FROZEN_NUMBER;
+			constant->as.number = AS_NUMBER(value);
+		} else if (IS_STRING(value)) {
+			constant->type = FROZEN_STRING;
+			constant->as.string = freeze_string(AS_STRING(value)->chars, AS_STRING(value)->length);
+		} else if (IS_FUNCTION(value)) {
+			constant->type = FROZEN_FUNCTION;
+			constant->as.function = freeze_function(AS_FUNCTION(value));
+			if (constant->as.function == NULL) {
+				free_frozen_function(frozen, false);
+				return NULL;
+			}
+		} else {
+			free_frozen_function(frozen, false);
+			return NULL;
+		}
+		frozen->constant_count++;
+	}
+
+	return frozen;
+}
+
+// Returns the size of the instruction at [offset], operands included.
+static int instruction_length(FrozenFunction* function, int offset)
+{
+	switch ((OpCode)function->code[offset])
+	{
+	case OP_CALL:
+		return 2;
+
+	case OP_CONSTANT:
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_GLOBAL:
+	case OP_DEFINE_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_GET_SUPER:
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_LESS_EQUAL_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE:
+	case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+	case OP_LOOP:
+	case OP_FOREIGN_CLASS:
+	case OP_METHOD:
+	case OP_METHOD_STATIC:
+	case OP_LOAD_MODULE_VAR:
+	case OP_STORE_MODULE_VAR:
+	case OP_LOAD_CORE_VAR:
+	case OP_IMPORT_MODULE:
+	case OP_IMPORT_VARIABLE:
+		return 3;
+
+	case OP_CLASS:
+		return 4;
+
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_FIELD_CACHED:
+	case OP_SET_FIELD_CACHED:
+	case OP_GET_LOCAL_2:
+	case OP_ADD_LOCAL_CONST:
+	case OP_INCREMENT_LOCAL:
+	case OP_CALL_0:
+	case OP_CALL_1:
+	case OP_CALL_2:
+	case OP_CALL_3:
+	case OP_CALL_4:
+	case OP_CALL_5:
+	case OP_CALL_6:
+	case OP_CALL_7:
+	case OP_CALL_8:
+	case OP_CALL_9:
+	case OP_CALL_10:
+	case OP_CALL_11:
+	case OP_CALL_12:
+	case OP_CALL_13:
+	case OP_CALL_14:
+	case OP_CALL_15:
+	case OP_CALL_16:
+		return 5;
+
+	case OP_SUPER_INVOKE:
+		return 6;
+
+	case OP_INVOKE:
+		return 8;
+
+	case OP_CLOSURE:
+	{
+		int constant = (function->code[offset + 1] << 8) | function->code[offset + 2];
+		return 3 + 3 * function->constants[constant].as.function->upvalue_count;
+	}
+
+	default:
+		return 1;
+	}
+}
+
+// Returns the offset of the method symbol operand of the instruction at
+// [offset], or -1 if it has none.
+static int symbol_operand(uint8_t instruction)
+{
+	if (instruction >= OP_CALL_0 && instruction <= OP_CALL_16) {
+		return 1;
+	}
+
+	switch (instruction)
+	{
+	case OP_METHOD:
+	case OP_METHOD_STATIC:
+		return 1;
+	case OP_INVOKE:
+	case OP_SUPER_INVOKE:
+		return 4;
+	default:
+		return -1;
+	}
+}
+
+static void collect_symbols(FrozenFunction* function, bool* used)
+{
+	for (int offset = 0; offset < function->code_count;
+		offset += instruction_length(function, offset))
+	{
+		int operand = symbol_operand(function->code[offset]);
+		if (operand != -1) {
+			uint8_t* code = &function->code[offset + operand];
+			used[(code[0] << 8) | code[1]] = true;
+		}
+	}
+
+	for (int i = 0; i < function->constant_count; i++) {
+		if (function->constants[i].type == FROZEN_FUNCTION) {
+			collect_symbols(function->constants[i].as.function, used);
+		}
+	}
+}
+
+VesselArtifact* freeze_module(ObjModule* module, ObjClosure* closure)
+{
+	FrozenFunction* function = freeze_function(closure->function);
+	if (function == NULL) {
+		return NULL;
+	}
+
+	VesselArtifact* artifact = (VesselArtifact*)allocate_frozen(sizeof(VesselArtifact));
+	artifact->ref_count = 1;
+	artifact->module = freeze_string(module->name->chars, module->name->length);
+	artifact->function = function;
+
+	artifact->variable_count = module->variable_names.count;
+	artifact->variables = (FrozenString*)allocate_frozen(sizeof(FrozenString) * artifact->variable_count);
+	for (int i = 0; i < artifact->variable_count; i++) {
+		ObjString* name = AS_STRING(module->variable_names.values[i]);
+		artifact->variables[i] = freeze_string(name->chars, name->length);
+	}
+
+	if (module != vm.core_module) {
+		artifact->core_variable_count = vm.core_module->variables.count;
+	}
+
+	bool* used = (bool*)allocate_frozen(sizeof(bool) * vm.method_names.count);
+	collect_symbols(function, used);
+	for (int i = 0; i < vm.method_names.count; i++) {
+		if (used[i]) {
+			artifact->symbol_count++;
+		}
+	}
+
+	artifact->symbols = (FrozenSymbol*)allocate_frozen(sizeof(FrozenSymbol) * artifact->symbol_count);
+	int count = 0;
+	for (int i = 0; i < vm.method_names.count; i++)
+	{
+		if (!used[i]) {
+			continue;
+		}
+
+		ObjString* signature = AS_STRING(vm.method_names.values[i]);
+		artifact->symbols[count].symbol = i;
+		artifact->symbols[count].signature = freeze_string(signature->chars, signature->length);
+		count++;
+	}
+	free(used);
+
+	return artifact;
+}
+
+// Replaces every method symbol operand in [code] using [symbols], a map from
+// the compiling VM's symbols to the current VM's.
+static void remap_symbols(FrozenFunction* function, uint8_t* code, int* symbols)
+{
+	for (int offset = 0; offset < function->code_count;
+		offset += instruction_length(function, offset))
+	{
+		int operand = symbol_operand(code[offset]);
+		if (operand != -1)
+		{
+			uint8_t* symbol = &code[offset + operand];
+			int remapped = symbols[(symbol[0] << 8) | symbol[1]];
+			symbol[0] = (remapped >> 8) & 0xff;
+			symbol[1] = remapped & 0xff;
+		}
+	}
+}
+
+static ObjFunction* thaw_function(VesselArtifact* artifact, FrozenFunction* frozen,
+	ObjModule* module, int* symbols)
+{
+	ObjFunction* function = new_function(module);
+	push(OBJ_VAL(function));
+
+	function->arity = frozen->arity;
+	function->upvalue_count = frozen->upvalue_count;
+	function->max_slots = frozen->max_slots;
+	if (frozen->name.chars != NULL) {
+		function->name = copy_string(frozen->name.chars, frozen->name.length);
+		write_barrier((Obj*)function, OBJ_VAL(function->name));
+	}
+
+	Chunk* chunk = &function->chunk;
+	for (int i = 0; i < frozen->constant_count; i++)
+	{
+		FrozenConstant* constant = &frozen->constants[i];
+		Value value = NIL_VAL;
+		switch (constant->type)
+		{
+		case FROZEN_NUMBER:
+			value = NUMBER_VAL(constant->as.number);
+			break;
+		case FROZEN_STRING:
+			value = OBJ_VAL(copy_string(constant->as.string.chars, constant->as.string.length));
+			break;
+		case FROZEN_FUNCTION:
+			value = OBJ_VAL(thaw_function(artifact, constant->as.function, module, symbols));
+			break;
+		}
+
+		push(value);
+		write_value_array(&chunk->constants, value);
+		write_barrier((Obj*)function, value);
+		pop();
+	}
+
+	for (int i = 0; i < frozen->cache_count; i++) {
+		add_inline_cache(chunk);
+	}
+
+	if (symbols == NULL)
+	{
+		chunk->code = frozen->code;
+		chunk->lines = frozen->lines;
+		chunk->count = frozen->code_count;
+		chunk->artifact = artifact;
+		ves_retain_artifact(artifact);
+	}
+	else
+	{
+		// The symbols differ from the compiling VM's, so this VM needs its own
+		// copy of the code to patch.
+		chunk->code = GROW_ARRAY(uint8_t, NULL, 0, frozen->code_count);
+		chunk->lines = GROW_ARRAY(int, NULL, 0, frozen->code_count);
+		memcpy(chunk->code, frozen->code, frozen->code_count);
+		memcpy(chunk->lines, frozen->lines, sizeof(int) * frozen->code_count);
+		chunk->count = frozen->code_count;
+		chunk->capacity = frozen->code_count;
+		remap_symbols(frozen, chunk->code, symbols);
+	}
+
+	pop(); // function.
+	return function;
+}
+
+ObjClosure* thaw_module(VesselArtifact* artifact)
+{
+	// Core's variables are only ever appended to, so a Core with at least as
+	// many has every slot the code refers to.
+	if (vm.core_module->variables.count < artifact->core_variable_count) {
+		return NULL;
+	}
+
+	ObjModule* module = prepare_module(artifact->module.chars);
+
+	// The code addresses module variables by slot, so the module must start
+	// out with the same variables it was compiled against.
+	if (module->variable_names.count > artifact->variable_count) {
+		return NULL;
+	}
+	for (int i = 0; i < artifact->variable_count; i++)
+	{
+		FrozenString* name = &artifact->variables[i];
+		if (i < module->variable_names.count)
+		{
+			ObjString* existing = AS_STRING(module->variable_names.values[i]);
+			if (existing->length != name->length ||
+				memcmp(existing->chars, name->chars, name->length) != 0) {
+				return NULL;
+			}
+			continue;
+		}
+
+		add_module_variable(module, name->chars, name->length);
+	}
+
+	// The code can be shared as long as each symbol means the same method
+	// here as in the VM that compiled it.
+	int* symbols = NULL;
+	int max_symbol = 0;
+	for (int i = 0; i < artifact->symbol_count; i++) {
+		if (artifact->symbols[i].symbol > max_symbol) {
+			max_symbol = artifact->symbols[i].symbol;
+		}
+	}
+	for (int i = 0; i < artifact->symbol_count; i++)
+	{
+		FrozenSymbol* frozen = &artifact->symbols[i];
+		int symbol = method_symbol_ensure(frozen->signature.chars, frozen->signature.length);
+		if (symbol == frozen->symbol) {
+			continue;
+		}
+
+		if (symbols == NULL)
+		{
+			symbols = (int*)allocate_frozen(sizeof(int) * (max_symbol + 1));
+			for (int j = 0; j <= max_symbol; j++) {
+				symbols[j] = j;
+			}
+		}
+		symbols[frozen->symbol] = symbol;
+	}
+
+	ObjFunction* function = thaw_function(artifact, artifact->function, module, symbols);
+	free(symbols);
+
+	push(OBJ_VAL(function));
+	ObjClosure* closure = new_closure(function);
+	pop();
+
+	return closure;
+}
+
+// Compiled files.
+//
+// ves_save_compiled() writes an artifact out as:
+//
+//     header    "VESC", format version, opcode count
+//     string    module name
+//     u32       variable count, then each variable name
+//     u32       Core variable count
+//     u32       symbol count, then each symbol and its signature
+//     function  module body
+//
+// A function is its name (or none), arity, upvalue count, stack slot count,
+// inline cache count, its code, its line table as (line, run length) pairs,
+// then its constants. Each constant is a tag byte followed by a double, a
+// string or a nested function. Integers are little-endian u32s and strings are
+// a length followed by the bytes and a terminating NUL, so a loaded image can
+// be used in place.
+
+#define COMPILED_MAGIC "VESC"
+#define COMPILED_VERSION 3
+
+// Stands in for a missing function name.
+#define COMPILED_NO_NAME 0xffffffffu
+
+// Files made by a build with a different instruction set must be rejected.
+static const uint32_t compiled_opcode_count = 0
+#define OPCODE(name, _) + 1
+#include "opcodes.h"
+#undef OPCODE
+	;
+
+static void write_u32(FILE* file, uint32_t value)
+{
+	uint8_t bytes[4] = {
+		value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >> 24) & 0xff
+	};
+	fwrite(bytes, 1, 4, file);
+}
+
+static void write_string(FILE* file, FrozenString* string)
+{
+	write_u32(file, (uint32_t)string->length);
+	fwrite(string->chars, 1, string->length, file);
+	fputc('\0', file);
+}
+
+static void write_function(FILE* file, FrozenFunction* function)
+{
+	if (function->name.chars != NULL) {
+		write_string(file, &function->name);
+	} else {
+		write_u32(file, COMPILED_NO_NAME);
+	}
+	write_u32(file, (uint32_t)function->arity);
+	write_u32(file, (uint32_t)function->upvalue_count);
+	write_u32(file, (uint32_t)function->max_slots);
+	write_u32(file, (uint32_t)function->cache_count);
+
+	write_u32(file, (uint32_t)function->code_count);
+	fwrite(function->code, 1, function->code_count, file);
+
+	uint32_t runs = 0;
+	for (int i = 0; i < function->code_count; i++) {
+		if (i == 0 || function->lines[i] != function->lines[i - 1]) {
+			runs++;
+		}
+	}
+	write_u32(file, runs);
+	for (int start = 0; start < function->code_count;)
+	{
+		int end = start + 1;
+		while (end < function->code_count && function->lines[end] == function->lines[start]) {
+			end++;
+		}
+		write_u32(file, (uint32_t)function->lines[start]);
+		write_u32(file, (uint32_t)(end - start));
+		start = end;
+	}
+
+	write_u32(file, (uint32_t)function->constant_count);
+	for (int i = 0; i < function->constant_count; i++)
+	{
+		FrozenConstant* constant = &function->constants[i];
+		fputc((int)constant->type, file);
+		switch (constant->type)
+		{
+		case FROZEN_NUMBER:
+		{
+			uint64_t bits;
+			memcpy(&bits, &constant->as.number, sizeof(bits));
+			write_u32(file, (uint32_t)bits);
+			write_u32(file, (uint32_t)(bits >> 32));
+			break;
+		}
+		case FROZEN_STRING:
+			write_string(file, &constant->as.string);
+			break;
+		case FROZEN_FUNCTION:
+			write_function(file, constant->as.function);
+			break;
+		}
+	}
+}
+
+// Reads a compiled file back from its image. Any read past the end of the
+// image or of an invalid value sets [failed], after which reads return zeros.
+typedef struct
+{
+	const uint8_t* data;
+	size_t size;
+	size_t position;
+	bool failed;
+} ImageReader;
+
+static const uint8_t* read_bytes(ImageReader* reader, size_t count)
+{
+	if (reader->failed || count > reader->size - reader->position) {
+		reader->failed = true;
+		return NULL;
+	}
+
+	const uint8_t* bytes = reader->data + reader->position;
+	reader->position += count;
+	return bytes;
+}
+
+static uint32_t read_u32(ImageReader* reader)
+{
+	const uint8_t* bytes = read_bytes(reader, 4);
+	if (bytes == NULL) {
+		return 0;
+	}
+	return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) |
+		((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+// Reads a u32 that must fit in an int.
+static int read_count(ImageReader* reader)
+{
+	uint32_t value = read_u32(reader);
+	if (value > INT32_MAX) {
+		reader->failed = true;
+		return 0;
+	}
+	return (int)value;
+}
+
+static FrozenString read_string_body(ImageReader* reader, uint32_t length)
+{
+	FrozenString string = { NULL, 0 };
+	if (length > INT32_MAX) {
+		reader->failed = true;
+		return string;
+	}
+
+	const uint8_t* chars = read_bytes(reader, (size_t)length + 1);
+	if (chars == NULL || chars[length] != '\0') {
+		reader->failed = true;
+		return string;
+	}
+
+	string.chars = (char*)chars;
+	string.length = (int)length;
+	return string;
+}
+
+static FrozenString read_string(ImageReader* reader)
+{
+	return read_string_body(reader, read_u32(reader));
+}
+
+// Returns NULL if the image is malformed. The result borrows its code and
+// strings from the image.
+static FrozenFunction* read_function(ImageReader* reader)
+{
+	FrozenFunction* function = (FrozenFunction*)allocate_frozen(sizeof(FrozenFunction));
+
+	uint32_t name_length = read_u32(reader);
+	if (name_length != COMPILED_NO_NAME) {
+		function->name = read_string_body(reader, name_length);
+	}
+	function->arity = read_count(reader);
+	function->upvalue_count = read_count(reader);
+	function->max_slots = read_count(reader);
+	function->cache_count = read_count(reader);
+
+	function->code_count = read_count(reader);
+	function->code = (uint8_t*)read_bytes(reader, function->code_count);
+
+	// The VM allocates by these counts, so they are held to what the code
+	// could use.
+	int runs = read_count(reader);
+	if (reader->failed || runs > function->code_count ||
+		function->arity >= UINT8_COUNT || function->upvalue_count > UINT8_COUNT ||
+		function->max_slots < function->arity + 1 ||
+		function->max_slots > function->arity + 1 + function->code_count ||
+		function->cache_count > function->code_count)
+	{
+		free(function);
+		return NULL;
+	}
+	function->lines = (int*)allocate_frozen(sizeof(int) * function->code_count);
+	int offset = 0;
+	for (int i = 0; i < runs; i++)
+	{
+		int line = read_count(reader);
+		int length = read_count(reader);
+		if (reader->failed || length > function->code_count - offset) {
+			reader->failed = true;
+			break;
+		}
+		for (int j = 0; j < length; j++) {
+			function->lines[offset++] = line;
+		}
+	}
+	if (offset != function->code_count) {
+		reader->failed = true;
+	}
+
+	int constant_count = read_count(reader);
+	if (reader->failed || constant_count > (int)(reader->size - reader->position)) {
+		reader->failed = true;
+		free_frozen_function(function, true);
+		return NULL;
+	}
+
+	function->constants = (FrozenConstant*)allocate_frozen(sizeof(FrozenConstant) * constant_count);
+	for (int i = 0; i < constant_count && !reader->failed; i++)
+	{
+		FrozenConstant* constant = &function->constants[i];
+		const uint8_t* type = read_bytes(reader, 1);
+		if (type == NULL) {
+			break;
+		}
+
+		switch (*type)
+		{
+		case FROZEN_NUMBER:
+		{
+			uint64_t bits = read_u32(reader);
+			bits |= (uint64_t)read_u32(reader) << 32;
+			constant->type = FROZEN_NUMBER;
+			memcpy(&constant->as.number, &bits, sizeof(bits));
+			break;
+		}
+		case FROZEN_STRING:
+			constant->type = FROZEN_STRING;
+			constant->as.string = read_string(reader);
+			break;
+		case FROZEN_FUNCTION:
+			constant->type = FROZEN_FUNCTION;
+			constant->as.function = read_function(reader);
+			if (constant->as.function == NULL) {
+				reader->failed = true;
+				continue;
+			}
+			break;
+		default:
+			reader->failed = true;
+			continue;
+		}
+		function->constant_count++;
+	}
+
+	if (reader->failed) {
+		free_frozen_function(function, true);
+		return NULL;
+	}
+	return function;
+}
+
+static int read_operand(const uint8_t* code)
+{
+	return (code[0] << 8) | code[1];
+}
+
+static bool is_constant(FrozenFunction* function, int constant, FrozenConstantType type)
+{
+	return constant < function->constant_count && function->constants[constant].type == type;
+}
+
+// Returns false if an instruction of [function], or of a function among its
+// constants, is malformed or refers past a table it indexes, which the VM
+// doesn't check as it runs. [symbols] has [symbol_count] flags, set for each
+// method symbol the artifact lists.
+static bool verify_function(VesselArtifact* artifact, FrozenFunction* function,
+	const bool* symbols, int symbol_count)
+{
+	for (int i = 0; i < function->constant_count; i++)
+	{
+		FrozenConstant* constant = &function->constants[i];
+		if (constant->type == FROZEN_FUNCTION &&
+			!verify_function(artifact, constant->as.function, symbols, symbol_count)) {
+			return false;
+		}
+	}
+
+	uint8_t* code = function->code;
+	int count = function->code_count;
+	bool* starts = (bool*)allocate_frozen(sizeof(bool) * count);
+	bool valid = count > 0;
+	int last = 0;
+	for (int offset = 0; valid && offset < count; offset += instruction_length(function, offset))
+	{
+		uint8_t* ip = &code[offset];
+		starts[offset] = true;
+		last = offset;
+
+		// The length of a closure depends on its function, so check that first.
+		if (ip[0] >= compiled_opcode_count ||
+			(ip[0] == OP_CLOSURE && (count - offset < 3 ||
+				!is_constant(function, read_operand(ip + 1), FROZEN_FUNCTION))) ||
+			instruction_length(function, offset) > count - offset)
+		{
+			valid = false;
+			break;
+		}
+
+		int symbol = symbol_operand(ip[0]);
+		if (symbol != -1)
+		{
+			symbol = read_operand(ip + symbol);
+			valid = symbol < symbol_count && symbols[symbol];
+		}
+
+		switch ((OpCode)ip[0])
+		{
+		case OP_CONSTANT:
+			valid = valid && read_operand(ip + 1) < function->constant_count;
+			break;
+
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_SUPER:
+		case OP_CLASS:
+		case OP_FOREIGN_CLASS:
+		case OP_IMPORT_MODULE:
+		case OP_IMPORT_VARIABLE:
+		case OP_SUPER_INVOKE:
+			valid = valid && is_constant(function, read_operand(ip + 1), FROZEN_STRING);
+			break;
+
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_FIELD_CACHED:
+		case OP_SET_FIELD_CACHED:
+			valid = valid && is_constant(function, read_operand(ip + 1), FROZEN_STRING) &&
+				read_operand(ip + 3) < function->cache_count;
+			break;
+
+		case OP_INVOKE:
+			valid = valid && is_constant(function, read_operand(ip + 1), FROZEN_STRING) &&
+				read_operand(ip + 6) < function->cache_count;
+			break;
+
+		case OP_CALL_0:
+		case OP_CALL_1:
+		case OP_CALL_2:
+		case OP_CALL_3:
+		case OP_CALL_4:
+		case OP_CALL_5:
+		case OP_CALL_6:
+		case OP_CALL_7:
+		case OP_CALL_8:
+		case OP_CALL_9:
+		case OP_CALL_10:
+		case OP_CALL_11:
+		case OP_CALL_12:
+		case OP_CALL_13:
+		case OP_CALL_14:
+		case OP_CALL_15:
+		case OP_CALL_16:
+			valid = valid && read_operand(ip + 3) < function->cache_count;
+			break;
+
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+			valid = valid && read_operand(ip + 1) < function->max_slots;
+			break;
+
+		case OP_GET_LOCAL_2:
+			valid = valid && read_operand(ip + 1) < function->max_slots &&
+				read_operand(ip + 3) < function->max_slots;
+			break;
+
+		case OP_ADD_LOCAL_CONST:
+		case OP_INCREMENT_LOCAL:
+			valid = valid && read_operand(ip + 1) < function->max_slots &&
+				is_constant(function, read_operand(ip + 3), FROZEN_NUMBER);
+			break;
+
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+			valid = valid && read_operand(ip + 1) < function->upvalue_count;
+			break;
+
+		case OP_DEFINE_GLOBAL:
+		case OP_LOAD_MODULE_VAR:
+		case OP_STORE_MODULE_VAR:
+			valid = valid && read_operand(ip + 1) < artifact->variable_count;
+			break;
+
+		case OP_LOAD_CORE_VAR:
+			valid = valid && read_operand(ip + 1) < artifact->core_variable_count;
+			break;
+
+		case OP_CLOSURE:
+		{
+			FrozenFunction* closure = function->constants[read_operand(ip + 1)].as.function;
+			for (int i = 0; valid && i < closure->upvalue_count; i++)
+			{
+				uint8_t* upvalue = ip + 3 + 3 * i;
+				int index = read_operand(upvalue + 1);
+				valid = upvalue[0] == 1 ? index < function->max_slots :
+					upvalue[0] == 0 && index < function->upvalue_count;
+			}
+			break;
+		}
+
+		default:
+			break;
+		}
+	}
+
+	// Nothing may run off the end of the code or jump into the middle of an
+	// instruction.
+	valid = valid && code[last] == OP_RETURN;
+	for (int offset = 0; valid && offset < count; offset += instruction_length(function, offset))
+	{
+		int target = -1;
+		switch ((OpCode)code[offset])
+		{
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_LESS_JUMP_IF_FALSE:
+		case OP_LESS_EQUAL_JUMP_IF_FALSE:
+		case OP_GREATER_JUMP_IF_FALSE:
+		case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+			target = offset + 3 + read_operand(&code[offset + 1]);
+			break;
+		case OP_LOOP:
+			target = offset + 3 - read_operand(&code[offset + 1]);
+			break;
+		default:
+			continue;
+		}
+		valid = target >= 0 && target < count && starts[target];
+	}
+
+	free(starts);
+	return valid;
+}
+
+// Maps the file at [path] read-only into memory, or reads it into a buffer
+// where mmap is not available. Returns NULL if it can't be read or is empty.
+static void* map_image(const char* path, size_t* size)
+{
+#if defined(_WIN32)
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		return NULL;
+	}
+
+	void* image = NULL;
+	long length = 0;
+	if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 0 &&
+		fseek(file, 0, SEEK_SET) == 0)
+	{
+		image = allocate_frozen((size_t)length);
+		if (fread(image, 1, (size_t)length, file) != (size_t)length) {
+			free(image);
+			image = NULL;
+		}
+	}
+	fclose(file);
+
+	*size = (size_t)length;
+	return image;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat info;
+	void* image = NULL;
+	if (fstat(fd, &info) == 0 && info.st_size > 0)
+	{
+		image = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image == MAP_FAILED) {
+			image = NULL;
+		}
+	}
+	// The mapping stays valid after the descriptor is closed.
+	close(fd);
+
+	*size = (size_t)info.st_size;
+	return image;
+#endif
+}
+
+static void unmap_image(void* image, size_t size)
+{
+#if defined(_WIN32)
+	(void)size;
+	free(image);
+#else
+	munmap(image, size);
+#endif
+}
+
+VesselArtifact* ves_compile_artifact(const char* module, const char* source)
+{
+	ObjClosure* closure = compile(module, source);
+	if (closure == NULL) {
+		return NULL;
+	}
+
+	push(OBJ_VAL(closure));
+	ObjString* name = copy_string(module, strlen(module));
+	Value v_module;
+	table_get(&vm.modules, name, &v_module);
+	VesselArtifact* artifact = freeze_module(AS_MODULE(v_module), closure);
+	pop();
+
+	return artifact;
+}
+
+void ves_retain_artifact(VesselArtifact* artifact)
+{
+	ATOMIC_INCREMENT(&artifact->ref_count);
+}
+
+void ves_release_artifact(VesselArtifact* artifact)
+{
+	if (ATOMIC_DECREMENT(&artifact->ref_count) != 0) {
+		return;
+	}
+
+	bool mapped = artifact->image != NULL;
+	free_frozen_function(artifact->function, mapped);
+	if (!mapped)
+	{
+		for (int i = 0; i < artifact->variable_count; i++) {
+			free(artifact->variables[i].chars);
+		}
+		for (int i = 0; i < artifact->symbol_count; i++) {
+			free(artifact->symbols[i].signature.chars);
+		}
+		free(artifact->module.chars);
+	}
+	free(artifact->variables);
+	free(artifact->symbols);
+	if (mapped) {
+		unmap_image(artifact->image, artifact->image_size);
+	}
+	free(artifact);
+}
+
+VesselArtifact* cached_artifact(VesselArtifact** slot, const char* module, const char* source)
+{
+	VesselArtifact* artifact = (VesselArtifact*)ATOMIC_LOAD_POINTER(slot);
+	if (artifact != NULL) {
+		return artifact;
+	}
+
+	artifact = ves_compile_artifact(module, source);
+	if (artifact == NULL) {
+		return NULL;
+	}
+
+	// Another thread may have compiled the module at the same time. Its copy
+	// wins and ours is dropped.
+	if (!ATOMIC_PUBLISH_POINTER(slot, artifact))
+	{
+		ves_release_artifact(artifact);
+		artifact = (VesselArtifact*)ATOMIC_LOAD_POINTER(slot);
+	}
+	return artifact;
+}
+
+VesselInterpretResult ves_run_artifact(VesselArtifact* artifact)
+{
+	int prev_begin = vm.frame_count_begin;
+	vm.frame_count_begin = vm.frame_count;
+	VesselInterpretResult ret = ves_run(thaw_module(artifact));
+	vm.frame_count_begin = prev_begin;
+	return ret;
+}
+
+bool ves_save_compiled(VesselArtifact* artifact, const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		return false;
+	}
+
+	fwrite(COMPILED_MAGIC, 1, 4, file);
+	write_u32(file, COMPILED_VERSION);
+	write_u32(file, compiled_opcode_count);
+
+	write_string(file, &artifact->module);
+	write_u32(file, (uint32_t)artifact->variable_count);
+	for (int i = 0; i < artifact->variable_count; i++) {
+		write_string(file, &artifact->variables[i]);
+	}
+	write_u32(file, (uint32_t)artifact->core_variable_count);
+	write_u32(file, (uint32_t)artifact->symbol_count);
+	for (int i = 0; i < artifact->symbol_count; i++) {
+		write_u32(file, (uint32_t)artifact->symbols[i].symbol);
+		write_string(file, &artifact->symbols[i].signature);
+	}
+	write_function(file, artifact->function);
+
+	bool failed = ferror(file) != 0;
+	if (fclose(file) != 0) {
+		failed = true;
+	}
+	return !failed;
+}
+
+VesselArtifact* ves_load_compiled(const char* path)
+{
+	size_t size = 0;
+	void* image = map_image(path, &size);
+	if (image == NULL) {
+		return NULL;
+	}
+
+	ImageReader reader = { (const uint8_t*)image, size, 0, false };
+	const uint8_t* magic = read_bytes(&reader, 4);
+	if (magic == NULL || memcmp(magic, COMPILED_MAGIC, 4) != 0 ||
+		read_u32(&reader) != COMPILED_VERSION ||
+		read_u32(&reader) != compiled_opcode_count)
+	{
+		unmap_image(image, size);
+		return NULL;
+	}
+
+	VesselArtifact* artifact = (VesselArtifact*)allocate_frozen(sizeof(VesselArtifact));
+	artifact->ref_count = 1;
+	artifact->image = image;
+	artifact->image_size = size;
+	artifact->module = read_string(&reader);
+
+	// Every entry takes at least five bytes, which bounds the counts before
+	// anything is allocated for them.
+	int variable_count = read_count(&reader);
+	if (!reader.failed && (size_t)variable_count <= (size - reader.position) / 5)
+	{
+		artifact->variables = (FrozenString*)allocate_frozen(sizeof(FrozenString) * variable_count);
+		for (; artifact->variable_count < variable_count && !reader.failed; artifact->variable_count++) {
+			artifact->variables[artifact->variable_count] = read_string(&reader);
+		}
+	}
+	else {
+		reader.failed = true;
+	}
+
+	artifact->core_variable_count = reader.failed ? 0 : read_count(&reader);
+	int symbol_count = reader.failed ? 0 : read_count(&reader);
+	if (!reader.failed && (size_t)symbol_count <= (size - reader.position) / 5)
+	{
+		artifact->symbols = (FrozenSymbol*)allocate_frozen(sizeof(FrozenSymbol) * symbol_count);
+		for (; artifact->symbol_count < symbol_count && !reader.failed; artifact->symbol_count++)
+		{
+			FrozenSymbol* symbol = &artifact->symbols[artifact->symbol_count];
+			symbol->symbol = read_count(&reader);
+			symbol->signature = read_string(&reader);
+			// Symbols are encoded in two-byte operands.
+			if (symbol->symbol > UINT16_MAX) {
+				reader.failed = true;
+			}
+		}
+	}
+	else {
+		reader.failed = true;
+	}
+
+	if (!reader.failed) {
+		artifact->function = read_function(&reader);
+	}
+	if (artifact->function == NULL || reader.position != size) {
+		ves_release_artifact(artifact);
+		return NULL;
+	}
+
+	int max_symbol = -1;
+	for (int i = 0; i < artifact->symbol_count; i++) {
+		if (artifact->symbols[i].symbol > max_symbol) {
+			max_symbol = artifact->symbols[i].symbol;
+		}
+	}
+	bool* symbols = (bool*)allocate_frozen(sizeof(bool) * (max_symbol + 1));
+	for (int i = 0; i < artifact->symbol_count; i++) {
+		symbols[artifact->symbols[i].symbol] = true;
+	}
+	bool valid = verify_function(artifact, artifact->function, symbols, max_symbol + 1);
+	free(symbols);
+	if (!valid) {
+		ves_release_artifact(artifact);
+		return NULL;
+	}
+
+	return artifact;
+}
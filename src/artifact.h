@@ -0,0 +1,105 @@
+#ifndef vessel_artifact_h
+#define vessel_artifact_h
+
+#include "common.h"
+#include "object.h"
+#include "vessel.h"
+
+// A compiled module frozen out of the VM heap, so that any number of VMs can
+// run it without recompiling or copying its bytecode.
+//
+// Everything in it is plain malloc'ed memory that no VM traces or frees: code
+// and line tables are shared as-is, while the constants are kept in a portable
+// form and turned into Values of whichever VM runs the artifact. Module
+// variables, inline caches and every other piece of mutable state stay per VM.
+
+typedef struct
+{
+	char* chars;
+	int length;
+} FrozenString;
+
+typedef enum
+{
+	FROZEN_NUMBER,
+	FROZEN_STRING,
+	FROZEN_FUNCTION
+} FrozenConstantType;
+
+typedef struct
+{
+	FrozenConstantType type;
+	union
+	{
+		double number;
+		FrozenString string;
+		struct FrozenFunction* function;
+	} as;
+} FrozenConstant;
+
+typedef struct FrozenFunction
+{
+	// NULL for the module body.
+	FrozenString name;
+	int arity;
+	int upvalue_count;
+	int max_slots;
+
+	int code_count;
+	uint8_t* code;
+	int* lines;
+
+	int constant_count;
+	FrozenConstant* constants;
+
+	int cache_count;
+} FrozenFunction;
+
+// A method symbol the artifact's code refers to, along with the signature it
+// stood for in the VM that compiled it.
+typedef struct
+{
+	int symbol;
+	FrozenString signature;
+} FrozenSymbol;
+
+struct VesselArtifact
+{
+	long ref_count;
+
+	FrozenString module;
+	FrozenFunction* function;
+
+	// The module's variables at the time it was compiled, by slot.
+	int variable_count;
+	FrozenString* variables;
+
+	// How many of Core's variables existed when it was compiled. The code may
+	// address any of them by slot.
+	int core_variable_count;
+
+	int symbol_count;
+	FrozenSymbol* symbols;
+
+	// The compiled file the artifact was loaded from, or NULL. Its code and
+	// strings point into the image rather than owning their memory.
+	void* image;
+	size_t image_size;
+};
+
+// Freezes the module body [closure] that was just compiled for [module].
+// Returns NULL if it holds a constant that can't be frozen.
+VesselArtifact* freeze_module(ObjModule* module, ObjClosure* closure);
+
+// Creates a fresh instance of the artifact's module on the current VM and
+// returns the closure that runs its body, or NULL if the artifact was frozen
+// against a different Core.
+ObjClosure* thaw_module(VesselArtifact* artifact);
+
+// Returns the artifact for a built-in module, compiling [source] on the first
+// call and keeping the result in [slot] for every VM in the process. Returns
+// NULL if it fails to compile. The slot owns the artifact, which is never
+// released.
+VesselArtifact* cached_artifact(VesselArtifact** slot, const char* module, const char* source);
+
+#endif // vessel_artifact_h
@@ -12,13 +12,24 @@ void init_chunk(Chunk* chunk)
     chunk->lines = NULL;
 
     init_value_array(&chunk->constants);
+
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->caches = NULL;
+
+    chunk->artifact = NULL;
 }
 
 void free_chunk(Chunk* chunk) 
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (chunk->artifact != NULL) {
+        ves_release_artifact(chunk->artifact);
+    } else {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
     free_value_array(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity);
     init_chunk(chunk);
 }
 
@@ -44,3 +55,21 @@ int add_constant(Chunk* chunk, Value value)
     pop();
     return chunk->constants.count - 1;
 }
+
+int add_inline_cache(Chunk* chunk)
+{
+    if (chunk->cache_capacity < chunk->cache_count + 1)
+    {
+        int old_cap = chunk->cache_capacity;
+        chunk->cache_capacity = GROW_CAPACITY(old_cap);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, old_cap, chunk->cache_capacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cache_count];
+    cache->epoch = 0;
+    cache->count = 0;
+    cache->deopts = 0;
+    cache->field_slot = 0;
+    cache->shape = NULL;
+    return chunk->cache_count++;
+}
@@ -6,6 +6,38 @@
 
 #include <stdint.h>
 
+// Number of receiver classes remembered by each call site before it stops
+// caching new ones.
+#define INLINE_CACHE_WAYS 4
+
+// How often a quickened field access may fall back to the generic opcode
+// before its site stays generic for good.
+#define QUICKEN_MAX_DEOPTS 4
+
+struct ObjClass;
+struct ObjMethod;
+struct ObjShape;
+struct VesselArtifact;
+
+// Per-call-site method cache used by OP_CALL_N, OP_INVOKE and OP_GET_PROPERTY.
+// An entry is only valid while [epoch] matches vm.method_epoch, which is bumped
+// whenever any class's method table changes.
+//
+// Property sites that were quickened to OP_GET_FIELD_CACHED or
+// OP_SET_FIELD_CACHED also keep the receiver [shape] they specialized for and
+// the field's [field_slot] in it.
+typedef struct
+{
+	struct ObjClass* classes[INLINE_CACHE_WAYS];
+	struct ObjMethod* methods[INLINE_CACHE_WAYS];
+	uint32_t epoch;
+	uint8_t count;
+
+	uint8_t deopts;
+	uint16_t field_slot;
+	struct ObjShape* shape;
+} InlineCache;
+
 typedef struct
 {
 	int count;
@@ -13,11 +45,21 @@ typedef struct
 	uint8_t* code;
 	int* lines;
 	ValueArray constants;
+
+	int cache_count;
+	int cache_capacity;
+	InlineCache* caches;
+
+	// The frozen artifact [code] and [lines] belong to when they are shared
+	// with other VMs, or NULL if the chunk owns them. Shared code is never
+	// rewritten at runtime.
+	struct VesselArtifact* artifact;
 } Chunk;
 
 void init_chunk(Chunk* chunk);
 void free_chunk(Chunk* chunk);
 void write_chunk(Chunk* chunk, uint8_t byte, int line);
 int add_constant(Chunk* chunk, Value value);
+int add_inline_cache(Chunk* chunk);
 
 #endif // vessel_chunk_h
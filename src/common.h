@@ -11,6 +11,35 @@
     #define OPT_IO 1
 #endif
 
+// If true, the interpreter loop dispatches with computed gotos ("labels as
+// values") instead of a switch. Each opcode then ends in its own indirect jump,
+// which the branch predictor handles far better. MSVC does not support it.
+#ifndef VES_COMPUTED_GOTO
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #define VES_COMPUTED_GOTO 0
+    #else
+        #define VES_COMPUTED_GOTO 1
+    #endif
+#endif
+
+// Storage class for state that each thread keeps for itself, such as the VM it
+// is currently running.
+#if defined(_MSC_VER) && !defined(__clang__)
+    #define VES_THREAD_LOCAL __declspec(thread)
+#else
+    #define VES_THREAD_LOCAL __thread
+#endif
+
+// If true, full collections can mark on helper threads as well as on the VM's
+// own, see VesselConfiguration.gc_threads. It needs POSIX threads.
+#ifndef VES_PARALLEL_GC
+    #if defined(_WIN32)
+        #define VES_PARALLEL_GC 0
+    #else
+        #define VES_PARALLEL_GC 1
+    #endif
+#endif
+
 #define NAN_BOXING
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
@@ -25,6 +54,17 @@
 #define MAX_MODULE_VARS 65536
 
 #define MAX_PARAMETERS 16
+
+// The most fields the compiler reserves inline storage for in each instance
+// of a class. Any further fields live in the instance's overflow array.
+#define MAX_INLINE_FIELDS 64
+
+// The most fields a shape describes, and the most shapes one transitions to.
+// An instance that would take the shape tree past either keeps its fields in
+// a hash table of its own instead, so dynamic field names can't grow the tree
+// without bound.
+#define MAX_SHAPE_FIELDS MAX_INLINE_FIELDS
+#define MAX_SHAPE_TRANSITIONS 64
 #define MAX_METHOD_NAME 64
 #define MAX_METHOD_SIGNATURE (MAX_METHOD_NAME + (MAX_PARAMETERS * 2) + 6)
 
@@ -10,10 +10,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+// How many of the most recently emitted instructions the peephole pass can
+// look back at when fusing them into a superinstruction.
+#define PEEPHOLE_WINDOW 2
+
 typedef struct
 {
     ObjModule* module;
 
+    // The text being compiled, and the module source kept for compiling
+    // skimmed bodies later. [source] is only set in lazy mode.
+    const char* source_start;
+    ObjString* source;
+    bool lazy;
+
     Token current;
     Token previous;
     bool had_error;
@@ -83,10 +97,18 @@ typedef struct Compiler
 
     Local locals[UINT8_COUNT];
     int local_count;
+    // Stack slots in use at the current point of the code, locals included.
+    int num_slots;
     Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
 
     Loop* loop;
+
+    // Start offsets of the newest instructions, oldest first, and the latest
+    // offset any jump lands on. Code before that offset is never fused.
+    int recent_ops[PEEPHOLE_WINDOW];
+    int recent_count;
+    int jump_target;
 } Compiler;
 
 typedef struct ClassCompiler
@@ -95,13 +117,22 @@ typedef struct ClassCompiler
     Token name;
     bool has_superclass;
     bool is_foreign;
+
+    // Distinct fields assigned through `this` anywhere in the class body.
+    Token fields[MAX_INLINE_FIELDS];
+    int num_fields;
+
+    // Set by `this` when it is immediately followed by a '.'.
+    bool receiver_is_this;
 } ClassCompiler;
 
-Parser parser;
+// Compiler state is per thread, so VMs on different threads can compile at
+// the same time.
+static VES_THREAD_LOCAL Parser parser;
 
-Compiler* current = NULL;
+static VES_THREAD_LOCAL Compiler* current = NULL;
 
-ClassCompiler* current_class = NULL;
+static VES_THREAD_LOCAL ClassCompiler* current_class = NULL;
 
 static Chunk* current_chunk()
 {
@@ -200,24 +231,47 @@ static void emit_byte(uint8_t byte)
     write_chunk(current_chunk(), byte, parser.previous.line);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2)
-{
-    emit_byte(byte1);
-    emit_byte(byte2);
-}
-
 static void emit_short(int arg)
 {
     emit_byte((arg >> 8) & 0xff);
     emit_byte(arg & 0xff);
 }
 
+static void record_op()
+{
+    if (current->recent_count == PEEPHOLE_WINDOW)
+    {
+        for (int i = 1; i < PEEPHOLE_WINDOW; i++) {
+            current->recent_ops[i - 1] = current->recent_ops[i];
+        }
+        current->recent_count--;
+    }
+
+    current->recent_ops[current->recent_count++] = current_chunk()->count;
+}
+
+static const int stack_effects[] = {
+#define OPCODE(_, effect) effect,
+#include "opcodes.h"
+#undef OPCODE
+};
+
+// Records that the code emitted next leaves [effect] more values on the stack,
+// or fewer if negative.
+static void adjust_slots(int effect)
+{
+    current->num_slots += effect;
+    if (current->num_slots > current->function->max_slots) {
+        current->function->max_slots = current->num_slots;
+    }
+}
+
 static void emit_op(OpCode instruction)
 {
 #ifdef DEBUG_PRINT_OPCODE
 #define FUNCTION_NAME(name) #name
     const char* OP_NAMES[255] = {
-#define OPCODE(name) FUNCTION_NAME(OP_##name),
+#define OPCODE(name, _) FUNCTION_NAME(OP_##name),
     #include "opcodes.h"
 #undef OPCODE
 };
@@ -225,7 +279,43 @@ static void emit_op(OpCode instruction)
     printf("emit %s\n", OP_NAMES[instruction]);
 #endif // DEBUG_PRINT_OPCODE
 
+    record_op();
     emit_byte(instruction);
+    adjust_slots(stack_effects[instruction]);
+}
+
+// Returns the instruction emitted [distance] instructions ago, 0 being the
+// newest, or NULL if it is out of reach. An instruction is out of reach once a
+// jump lands on or after it, since fusing would move the jump's destination.
+static uint8_t* fusable_op(int distance)
+{
+    if (distance >= current->recent_count) {
+        return NULL;
+    }
+
+    int offset = current->recent_ops[current->recent_count - 1 - distance];
+    if (offset < current->jump_target) {
+        return NULL;
+    }
+
+    return &current_chunk()->code[offset];
+}
+
+// Drops the newest [count] instructions, starting with [first], and emits
+// [instruction] in their place. Read their operands before calling this.
+static void replace_ops(uint8_t* first, int count, OpCode instruction)
+{
+    for (int i = current->recent_count - count; i < current->recent_count; i++) {
+        current->num_slots -= stack_effects[current_chunk()->code[current->recent_ops[i]]];
+    }
+    current_chunk()->count = (int)(first - current_chunk()->code);
+    current->recent_count -= count;
+    emit_op(instruction);
+}
+
+static int read_operand(uint8_t* code)
+{
+    return (code[0] << 8) | code[1];
 }
 
 static void emit_byte_arg(OpCode instruction, int arg)
@@ -240,6 +330,62 @@ static void emit_short_arg(OpCode instruction, int arg)
     emit_short(arg);
 }
 
+static void emit_get_local(int slot)
+{
+    uint8_t* previous = fusable_op(0);
+    if (previous != NULL && *previous == OP_GET_LOCAL)
+    {
+        int first = read_operand(previous + 1);
+        replace_ops(previous, 1, OP_GET_LOCAL_2);
+        emit_short(first);
+        emit_short(slot);
+        return;
+    }
+
+    emit_short_arg(OP_GET_LOCAL, slot);
+}
+
+static void emit_add()
+{
+    // `local + number`.
+    uint8_t* constant = fusable_op(0);
+    uint8_t* local = fusable_op(1);
+    if (local != NULL && *local == OP_GET_LOCAL && *constant == OP_CONSTANT)
+    {
+        int slot = read_operand(local + 1);
+        int index = read_operand(constant + 1);
+        if (IS_NUMBER(current_chunk()->constants.values[index]))
+        {
+            replace_ops(local, 2, OP_ADD_LOCAL_CONST);
+            emit_short(slot);
+            emit_short(index);
+            return;
+        }
+    }
+
+    emit_op(OP_ADD);
+}
+
+// Emits the pop that discards an expression statement's value.
+static void emit_discard()
+{
+    // `local = local + number`.
+    uint8_t* store = fusable_op(0);
+    uint8_t* add = fusable_op(1);
+    if (add != NULL && *add == OP_ADD_LOCAL_CONST && *store == OP_SET_LOCAL &&
+        read_operand(add + 1) == read_operand(store + 1))
+    {
+        int slot = read_operand(add + 1);
+        int index = read_operand(add + 3);
+        replace_ops(add, 2, OP_INCREMENT_LOCAL);
+        emit_short(slot);
+        emit_short(index);
+        return;
+    }
+
+    emit_op(OP_POP);
+}
+
 static void emit_loop(int loop_start)
 {
     emit_op(OP_LOOP);
@@ -261,6 +407,43 @@ static int emit_jump(uint8_t instruction)
     return current_chunk()->count - 2;
 }
 
+// Emits the jump over a statement's body when its condition is false. The
+// jump pops the condition on both paths, and absorbs a comparison right
+// before it.
+static int emit_condition_jump()
+{
+    OpCode instruction = OP_POP_JUMP_IF_FALSE;
+
+    uint8_t* previous = fusable_op(0);
+    if (previous != NULL)
+    {
+        switch (*previous)
+        {
+            case OP_LESS:          instruction = OP_LESS_JUMP_IF_FALSE; break;
+            case OP_LESS_EQUAL:    instruction = OP_LESS_EQUAL_JUMP_IF_FALSE; break;
+            case OP_GREATER:       instruction = OP_GREATER_JUMP_IF_FALSE; break;
+            case OP_GREATER_EQUAL: instruction = OP_GREATER_EQUAL_JUMP_IF_FALSE; break;
+            default: break;
+        }
+
+        if (instruction != OP_POP_JUMP_IF_FALSE) {
+            current->num_slots -= stack_effects[*previous];
+            current_chunk()->count--;
+            current->recent_count--;
+        }
+    }
+
+    return emit_jump(instruction);
+}
+
+// Marks the current offset as the destination of a backward jump and returns
+// it.
+static int mark_loop_target()
+{
+    current->jump_target = current_chunk()->count;
+    return current->jump_target;
+}
+
 static void emit_return()
 {
     if (current->type == TYPE_INITIALIZER) {
@@ -275,6 +458,7 @@ static void emit_return()
 static uint16_t make_constant(Value value)
 {
     int constant = add_constant(current_chunk(), value);
+    write_barrier((Obj*)current->function, value);
     if (constant > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -288,6 +472,16 @@ static void emit_constant(Value value)
     emit_short_arg(OP_CONSTANT, make_constant(value));
 }
 
+static void emit_inline_cache()
+{
+    int cache = add_inline_cache(current_chunk());
+    if (cache > UINT16_MAX) {
+        error("Too many call sites in one chunk.");
+    }
+
+    emit_short(cache);
+}
+
 static void patch_jump(int offset)
 {
     // -2 to adjust for the bytecode for the jump offset itself.
@@ -299,21 +493,29 @@ static void patch_jump(int offset)
 
     current_chunk()->code[offset] = (jump >> 8) & 0xff;
     current_chunk()->code[offset + 1] = jump & 0xff;
+
+    current->jump_target = current_chunk()->count;
 }
 
-static void init_compiler(Compiler* compiler, FunctionType type)
+// Starts compiling a function of [type] into [function], or into a new one
+// named after the previous token if it is NULL.
+static void init_compiler(Compiler* compiler, FunctionType type, ObjFunction* function)
 {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->local_count = 0;
+    compiler->num_slots = 0;
     compiler->scope_depth = 0;
     compiler->loop = NULL;
-    compiler->function = new_function(parser.module);
+    compiler->recent_count = 0;
+    compiler->jump_target = 0;
+    compiler->function = function != NULL ? function : new_function(parser.module);
     current = compiler;
 
-    if (type != TYPE_SCRIPT) {
+    if (function == NULL && type != TYPE_SCRIPT) {
         current->function->name = copy_string(parser.previous.start, parser.previous.length);
+        write_barrier((Obj*)current->function, OBJ_VAL(current->function->name));
     }
 
     Local* local = &current->locals[current->local_count++];
@@ -326,6 +528,7 @@ static void init_compiler(Compiler* compiler, FunctionType type)
         local->name.start = "";
         local->name.length = 0;
     }
+    adjust_slots(1);
 }
 
 static ObjFunction* end_compiler()
@@ -335,7 +538,7 @@ static ObjFunction* end_compiler()
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error) {
-        disassembleChunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+        disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
 
@@ -498,6 +701,34 @@ static void mark_initialized()
     current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
+// Reserves the slot for the top-level variable [name] in the module being
+// compiled, so every access compiled after this point can address it
+// directly.
+static int declare_module_variable(const char* name, int length)
+{
+    int symbol = symbol_table_find(&parser.module->variable_names, name, length);
+    if (symbol >= 0) {
+        return symbol;
+    }
+
+    if (parser.module->variables.count == MAX_MODULE_VARS) {
+        error("Too many module variables.");
+        return 0;
+    }
+
+    return add_module_variable(parser.module, name, length);
+}
+
+// Returns Core's slot for [name], or -1 if it isn't one of Core's variables or
+// Core itself is being compiled.
+static int core_variable(const char* name, int length)
+{
+    if (vm.core_module == NULL || parser.module == vm.core_module) {
+        return -1;
+    }
+    return symbol_table_find(&vm.core_module->variable_names, name, length);
+}
+
 static void define_variable(uint16_t global)
 {
     if (current->scope_depth > 0) {
@@ -505,7 +736,9 @@ static void define_variable(uint16_t global)
         return;
     }
 
-    emit_short_arg(OP_DEFINE_GLOBAL, global);
+    ObjString* name = AS_STRING(current_chunk()->constants.values[global]);
+    int symbol = declare_module_variable(name->chars, name->length);
+    emit_short_arg(OP_DEFINE_GLOBAL, symbol);
 }
 
 static uint8_t argument_list(TokenType token_right)
@@ -545,13 +778,26 @@ static int signature_symbol(Signature* signature)
     int length;
     signature_to_string(signature, name, &length);
 
-    return symbol_table_ensure(&vm.method_names, name, length);
+    return method_symbol_ensure(name, length);
+}
+
+// Emits the method symbol an invoke-style instruction dispatches on, so the VM
+// never has to build the "name(_,_)" signature itself.
+static void emit_signature_symbol(Token* name, uint8_t arg_count)
+{
+    if (arg_count > MAX_PARAMETERS) {
+        error("Methods cannot have more than 16 arguments.");
+    }
+
+    Signature signature = { name->start, name->length, SIG_METHOD, arg_count };
+    emit_short(signature_symbol(&signature));
 }
 
 static void call_signature(Signature* signature)
 {
     int symbol = signature_symbol(signature);
     emit_short_arg((OpCode)(OP_CALL_0 + signature->arity), symbol);
+    emit_inline_cache();
 }
 
 static void binary(bool can_assign)
@@ -563,13 +809,13 @@ static void binary(bool can_assign)
 
     switch (operator_type)
     {
-        case TOKEN_BANG_EQUAL:    emit_bytes(OP_EQUAL, OP_NOT); break;
+        case TOKEN_BANG_EQUAL:    emit_op(OP_NOT_EQUAL); break;
         case TOKEN_EQUAL_EQUAL:   emit_op(OP_EQUAL); break;
         case TOKEN_GREATER:       emit_op(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emit_bytes(OP_LESS, OP_NOT); break;
+        case TOKEN_GREATER_EQUAL: emit_op(OP_GREATER_EQUAL); break;
         case TOKEN_LESS:          emit_op(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emit_bytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emit_op(OP_ADD); break;
+        case TOKEN_LESS_EQUAL:    emit_op(OP_LESS_EQUAL); break;
+        case TOKEN_PLUS:          emit_add(); break;
         case TOKEN_MINUS:         emit_op(OP_SUBTRACT); break;
         case TOKEN_STAR:          emit_op(OP_MULTIPLY); break;
         case TOKEN_SLASH:         emit_op(OP_DIVIDE); break;
@@ -588,36 +834,73 @@ static void call(bool can_assign)
 {
     uint8_t arg_count = argument_list(TOKEN_RIGHT_PAREN);
     emit_byte_arg(OP_CALL, arg_count);
+    adjust_slots(-arg_count);
+}
+
+// Records a field the enclosing class assigns through `this`, so its
+// instances can be allocated with an inline slot for it.
+static void declare_field(Token* name)
+{
+    for (int i = 0; i < current_class->num_fields; i++) {
+        if (identifiers_equal(name, &current_class->fields[i])) {
+            return;
+        }
+    }
+
+    if (current_class->num_fields < MAX_INLINE_FIELDS) {
+        current_class->fields[current_class->num_fields++] = *name;
+    }
 }
 
 static void dot(bool can_assign)
 {
+    bool receiver_is_this = current_class != NULL && current_class->receiver_is_this;
+    if (current_class != NULL) {
+        current_class->receiver_is_this = false;
+    }
+
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    Token name_token = parser.previous;
     uint16_t name = identifier_constant(&parser.previous);
 
     if (can_assign && match(TOKEN_EQUAL)) {
+        if (receiver_is_this) {
+            declare_field(&name_token);
+        }
         expression();
         emit_short_arg(OP_SET_PROPERTY, name);
+        emit_inline_cache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_count = argument_list(TOKEN_RIGHT_PAREN);
         emit_short_arg(OP_INVOKE, name);
         emit_byte(arg_count);
+        emit_signature_symbol(&name_token, arg_count);
+        emit_inline_cache();
+        adjust_slots(-arg_count);
     } else {
         emit_short_arg(OP_GET_PROPERTY, name);
+        emit_inline_cache();
     }
 }
 
 static void load_core_variable(const char* name)
 {
-    int symbol = symbol_table_find(&parser.module->variable_names, name, strlen(name));
+    int symbol = core_variable(name, (int)strlen(name));
+    if (symbol != -1) {
+        emit_short_arg(OP_LOAD_CORE_VAR, symbol);
+        return;
+    }
+
+    symbol = symbol_table_find(&parser.module->variable_names, name, strlen(name));
     ASSERT(symbol != -1, "Should have already defined core name.");
     emit_short_arg(OP_LOAD_MODULE_VAR, symbol);
 }
 
 static void call_method(int num_args, const char* name, int length)
 {
-    int symbol = symbol_table_ensure(&vm.method_names, name, length);
+    int symbol = method_symbol_ensure(name, length);
     emit_short_arg((OpCode)(OP_CALL_0 + num_args), symbol);
+    emit_inline_cache();
 }
 
 static void range(bool can_assign)
@@ -868,7 +1151,7 @@ static void method_call(Signature* signature)
         called.arity++;
 
         Compiler fn_compiler;
-        init_compiler(&fn_compiler, TYPE_METHOD);
+        init_compiler(&fn_compiler, TYPE_METHOD, NULL);
 
         // Make a dummy signature to track the arity.
         Signature fn_signature = { "", 0, SIG_METHOD, 0 };
@@ -944,33 +1227,41 @@ static void named_variable(Token name, bool can_assign)
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(&name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
 
+    // Module variables that are already declared are addressed by slot, and so
+    // are Core's variables the module doesn't declare yet. Declaring or
+    // assigning one of Core's later shadows it, which OP_LOAD_CORE_VAR notices
+    // at run time. The rest are forward references, which OP_GET_GLOBAL /
+    // OP_SET_GLOBAL resolve by name once and then patch into the slot form.
+    if (get_op == OP_GET_GLOBAL)
+    {
+        int symbol = symbol_table_find(&parser.module->variable_names, name.start, name.length);
+        if (symbol >= 0) {
+            arg = symbol;
+            get_op = OP_LOAD_MODULE_VAR;
+            set_op = OP_STORE_MODULE_VAR;
+        } else if ((symbol = core_variable(name.start, name.length)) >= 0) {
+            arg = symbol;
+            get_op = OP_LOAD_CORE_VAR;
+            if (can_assign && check(TOKEN_EQUAL)) {
+                arg = declare_module_variable(name.start, name.length);
+            }
+            set_op = OP_STORE_MODULE_VAR;
+        } else {
+            arg = identifier_constant(&name);
+        }
+    }
+
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
         emit_short_arg(set_op, (uint16_t)arg);
+    } else if (get_op == OP_GET_LOCAL) {
+        emit_get_local(arg);
     } else {
-        if (get_op == OP_GET_GLOBAL)
-        {
-            int symbol = symbol_table_find(&parser.module->variable_names, name.start, name.length);
-            if (symbol >= 0) {
-                emit_short_arg(OP_LOAD_MODULE_VAR, symbol);
-            } else {
-                //if (current_class != NULL && check(TOKEN_LEFT_PAREN)) {
-                //    named_variable(synthetic_token("this"), false);
-                //    named_call(can_assign);
-                //} else {
-                    emit_short_arg(get_op, (uint16_t)arg);
-                //}
-            }
-        }
-        else
-        {
-            emit_short_arg(get_op, (uint16_t)arg);
-        }
+        emit_short_arg(get_op, (uint16_t)arg);
     }
 }
 
@@ -989,6 +1280,7 @@ static void super_(bool can_assign)
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+    Token name_token = parser.previous;
     uint16_t name = identifier_constant(&parser.previous);
 
     named_variable(synthetic_token("this"), false);
@@ -997,6 +1289,8 @@ static void super_(bool can_assign)
         named_variable(synthetic_token("super"), false);
         emit_short_arg(OP_SUPER_INVOKE, name);
         emit_byte(arg_count);
+        emit_signature_symbol(&name_token, arg_count);
+        adjust_slots(-arg_count);
     } else {
         named_variable(synthetic_token("super"), false);
         emit_short_arg(OP_GET_SUPER, name);
@@ -1010,6 +1304,7 @@ static void this_(bool can_assign)
         return;
     }
     variable(false);
+    current_class->receiver_is_this = check(TOKEN_DOT);
 }
 
 static void unary(bool can_assign)
@@ -1174,14 +1469,8 @@ static void expression()
     parse_precedence(PREC_ASSIGNMENT);
 }
 
-static void function(FunctionType type, bool is_foreign, int* arity)
+static void parameter_list(int* arity)
 {
-    Token func_name = parser.previous;
-
-    Compiler compiler;
-    init_compiler(&compiler, type);
-    begin_scope(); // [no-end-scope]
-
     //consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
     if (match(TOKEN_LEFT_PAREN))
     {
@@ -1198,10 +1487,103 @@ static void function(FunctionType type, bool is_foreign, int* arity)
 
                 uint16_t paramConstant = parse_variable("Expect parameter name.");
                 define_variable(paramConstant);
+                // The caller pushed the argument already.
+                adjust_slots(1);
             } while (match(TOKEN_COMMA));
         }
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
     }
+}
+
+// Returns true if [name] is a local of a function enclosing the one being
+// compiled, which a body referring to it would have to capture.
+static bool names_enclosing_local(Token* name)
+{
+    for (Compiler* compiler = current->enclosing; compiler != NULL; compiler = compiler->enclosing)
+    {
+        for (int i = compiler->local_count - 1; i >= 0; i--) {
+            if (identifiers_equal(name, &compiler->locals[i].name)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Skips over the body of a function of [type] from its '{', so it can be
+// compiled on its first call instead, and records the fields it assigns
+// through `this`. The body must compile on its own: if it may capture
+// anything from enclosing functions, or fails to scan, the parser is rewound
+// to the '{' and false is returned.
+static bool skim_body(FunctionType type)
+{
+    Scanner scanner = save_scanner();
+    Token start = parser.current;
+    skim_tokens(true);
+
+    // The last few tokens, newest last, to spot `this.name =`.
+    Token tokens[4] = { start, start, start, start };
+    int depth = 1;
+    bool can_skim = true;
+    while (can_skim && depth > 0)
+    {
+        memmove(&tokens[0], &tokens[1], sizeof(Token) * 3);
+        tokens[3] = scan_token();
+
+        switch (tokens[3].type)
+        {
+        case TOKEN_LEFT_BRACE:
+            depth++;
+            break;
+        case TOKEN_RIGHT_BRACE:
+            depth--;
+            break;
+        case TOKEN_SUPER:
+        case TOKEN_ERROR:
+        case TOKEN_EOF:
+            can_skim = false;
+            break;
+        case TOKEN_THIS:
+            can_skim = type != TYPE_FUNCTION;
+            break;
+        case TOKEN_IDENTIFIER:
+            can_skim = tokens[2].type == TOKEN_DOT || !names_enclosing_local(&tokens[3]);
+            break;
+        case TOKEN_EQUAL:
+            if (current_class != NULL && tokens[0].type == TOKEN_THIS &&
+                tokens[1].type == TOKEN_DOT && tokens[2].type == TOKEN_IDENTIFIER) {
+                declare_field(&tokens[2]);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    skim_tokens(false);
+
+    if (!can_skim)
+    {
+        restore_scanner(&scanner);
+        parser.current = start;
+        return false;
+    }
+
+    parser.current = tokens[3];
+    advance();
+    return true;
+}
+
+static void function(FunctionType type, bool is_foreign, int* arity)
+{
+    Token func_name = parser.previous;
+    int offset = (int)(parser.current.start - parser.source_start);
+    int line = parser.current.line;
+
+    Compiler compiler;
+    init_compiler(&compiler, type, NULL);
+    begin_scope(); // [no-end-scope]
+
+    parameter_list(arity);
 
     if (is_foreign)
     {
@@ -1219,6 +1601,21 @@ static void function(FunctionType type, bool is_foreign, int* arity)
     {
         ignore_new_lines();
 
+        if (parser.lazy && !parser.had_error && check(TOKEN_LEFT_BRACE) && skim_body(type))
+        {
+            ObjFunction* function = current->function;
+            function->lazy_source = parser.source;
+            write_barrier((Obj*)function, OBJ_VAL(parser.source));
+            function->lazy_offset = offset;
+            function->lazy_line = line;
+            function->lazy_type = (uint8_t)type;
+
+            // It captures nothing, so it needs no upvalue operands.
+            current = current->enclosing;
+            emit_short_arg(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+            return;
+        }
+
         consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
         block();
 
@@ -1235,12 +1632,14 @@ static void function(FunctionType type, bool is_foreign, int* arity)
 static void create_constructor(int arity, int init_symbol, bool is_class_foreign)
 {
     Compiler method_compiler;
-    init_compiler(&method_compiler, TYPE_INITIALIZER);
+    init_compiler(&method_compiler, TYPE_INITIALIZER, NULL);
+    adjust_slots(arity);
 
     emit_op(is_class_foreign ? OP_FOREIGN_CONSTRUCT : OP_CONSTRUCT);
 
     // Run its initializer.
     emit_short_arg((OpCode)(OP_CALL_0 + arity), init_symbol);
+    emit_inline_cache();
 
     // Return the instance.
     emit_op(OP_RETURN);
@@ -1268,27 +1667,22 @@ static void method(bool is_class_foreign, Token class_name)
     function(type, is_foreign, &arity);
     signature.arity = arity;
 
-    char name[MAX_METHOD_SIGNATURE];
-    int length;
-    signature_to_string(&signature, name, &length);
-    Token method_name = synthetic_token(name);
-    uint16_t constant = identifier_constant(&method_name);
+    int symbol = signature_symbol(&signature);
 
     named_variable(class_name, false);
     if (is_static) {
-        emit_short_arg(OP_METHOD_STATIC, constant);
+        emit_short_arg(OP_METHOD_STATIC, symbol);
     } else {
-        emit_short_arg(OP_METHOD, constant);
+        emit_short_arg(OP_METHOD, symbol);
     }
 
     // define the ctor to meta class
     if (type == TYPE_INITIALIZER)
     {
-        int init_symbol = symbol_table_ensure(&vm.method_names, method_name.start, method_name.length);
-        create_constructor(arity, init_symbol, is_class_foreign);
+        create_constructor(arity, symbol, is_class_foreign);
 
         named_variable(class_name, false);
-        emit_short_arg(OP_METHOD_STATIC, constant);
+        emit_short_arg(OP_METHOD_STATIC, symbol);
     }
 }
 
@@ -1300,10 +1694,14 @@ static void class_declaration(bool is_foreign)
     uint16_t name_constant = identifier_constant(&parser.previous);
     declare_variable();
 
+    // The number of fields is patched in once the class body has been seen.
+    int num_fields_offset = -1;
     if (is_foreign) {
         emit_short_arg(OP_FOREIGN_CLASS, name_constant);
     } else {
         emit_short_arg(OP_CLASS, name_constant);
+        emit_byte(0);
+        num_fields_offset = current_chunk()->count - 1;
     }
     define_variable(name_constant);
 
@@ -1311,6 +1709,8 @@ static void class_declaration(bool is_foreign)
     class_compiler.name = parser.previous;
     class_compiler.has_superclass = false;
     class_compiler.is_foreign = is_foreign;
+    class_compiler.num_fields = 0;
+    class_compiler.receiver_is_this = false;
     class_compiler.enclosing = current_class;
     current_class = &class_compiler;
 
@@ -1336,11 +1736,7 @@ static void class_declaration(bool is_foreign)
 
     if (current->scope_depth == 0 || (class_compiler.has_superclass && current->scope_depth == 1))
     {
-        int symbol = symbol_table_find(&parser.module->variable_names, class_name.start, class_name.length);
-        if (symbol < 0) {
-            symbol = symbol_table_ensure(&parser.module->variable_names, class_name.start, class_name.length);
-            write_value_array(&parser.module->variables, NIL_VAL);
-        }
+        int symbol = declare_module_variable(class_name.start, class_name.length);
         emit_short_arg(OP_STORE_MODULE_VAR, symbol);
     }
 
@@ -1354,6 +1750,10 @@ static void class_declaration(bool is_foreign)
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
     emit_op(OP_POP);
 
+    if (num_fields_offset != -1) {
+        current_chunk()->code[num_fields_offset] = (uint8_t)class_compiler.num_fields;
+    }
+
     if (class_compiler.has_superclass) {
         end_scope();
     }
@@ -1388,11 +1788,13 @@ static void var_declaration()
 static void expression_statement()
 {
     expression();
-    emit_op(OP_POP);
+    emit_discard();
 }
 
 static void discard_locals(int depth)
 {
+    // The code after the jump that follows still has the locals in scope.
+    int num_slots = current->num_slots;
     for (int i = current->local_count - 1;
          i >= 0 && current->locals[i].depth > depth; i--)
     {
@@ -1402,6 +1804,7 @@ static void discard_locals(int depth)
             emit_op(OP_POP);
         }
     }
+    current->num_slots = num_slots;
 }
 
 static void break_statement()
@@ -1464,20 +1867,19 @@ static void for_statement()
             emit_op(OP_NIL);
             emit_short_arg(OP_SET_LOCAL, (uint16_t)resolve_local(current, &token_iter));
 
-            int loop_start = current_chunk()->count;
+            int loop_start = mark_loop_target();
             loop.start = loop_start;
             loop.body = loop_start;
 
-            emit_short_arg(OP_GET_LOCAL, (uint16_t)resolve_local(current, &token_seq));
-            emit_short_arg(OP_GET_LOCAL, (uint16_t)resolve_local(current, &token_iter));
+            emit_get_local(resolve_local(current, &token_seq));
+            emit_get_local(resolve_local(current, &token_iter));
             call_method(1, "iterate(_)", 10);
             emit_short_arg(OP_SET_LOCAL, (uint16_t)resolve_local(current, &token_iter));
 
-            int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-            emit_op(OP_POP); // Condition.
+            int exit_jump = emit_condition_jump();
 
-            emit_short_arg(OP_GET_LOCAL, (uint16_t)resolve_local(current, &token_seq));
-            emit_short_arg(OP_GET_LOCAL, (uint16_t)resolve_local(current, &token_iter));
+            emit_get_local(resolve_local(current, &token_seq));
+            emit_get_local(resolve_local(current, &token_iter));
             call_method(1, "iteratorValue(_)", 16);
             emit_short_arg(OP_SET_LOCAL, (uint16_t)resolve_local(current, &token_var));
             emit_op(OP_POP);
@@ -1487,7 +1889,6 @@ static void for_statement()
             emit_loop(loop_start);
 
             patch_jump(exit_jump);
-            emit_op(OP_POP); // Condition.
 
             if (loop.exit_jump != -1) {
                 patch_jump(loop.exit_jump);
@@ -1507,7 +1908,7 @@ static void for_statement()
         consume(TOKEN_SEMICOLON, "Expect ';' after loop init.");
     }
 
-    int loop_start = current_chunk()->count;
+    int loop_start = mark_loop_target();
     loop.start = loop_start;
     loop.body = loop_start;
 
@@ -1518,8 +1919,7 @@ static void for_statement()
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_op(OP_POP); // Condition.
+        exit_jump = emit_condition_jump();
     }
 
     // for-increment
@@ -1527,9 +1927,9 @@ static void for_statement()
     {
         int body_jump = emit_jump(OP_JUMP);
 
-        int increment_start = current_chunk()->count;
+        int increment_start = mark_loop_target();
         expression();
-        emit_op(OP_POP);
+        emit_discard();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emit_loop(loop_start);
@@ -1542,10 +1942,8 @@ static void for_statement()
 
     emit_loop(loop_start);
 
-    if (exit_jump != -1)
-    {
+    if (exit_jump != -1) {
         patch_jump(exit_jump);
-        emit_op(OP_POP); // Condition.
     }
 
     if (loop.exit_jump != -1) {
@@ -1562,14 +1960,12 @@ static void if_statement()
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); // [paren]
 
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_op(OP_POP);
+    int then_jump = emit_condition_jump();
     statement();
 
     int else_jump = emit_jump(OP_JUMP);
 
     patch_jump(then_jump);
-    emit_op(OP_POP);
 
     if (match(TOKEN_ELSE)) {
         statement();
@@ -1599,7 +1995,7 @@ static void while_statement()
 {
     Loop loop;
     loop.enclosing = current->loop;
-    loop.start = current_chunk()->count;
+    loop.start = mark_loop_target();
     loop.body = loop.start;
     loop.scope_depth = current->scope_depth;
     loop.exit_jump = -1;
@@ -1609,15 +2005,12 @@ static void while_statement()
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-
-    emit_op(OP_POP);
+    int exit_jump = emit_condition_jump();
     statement();
 
     emit_loop(loop.start);
 
     patch_jump(exit_jump);
-    emit_op(OP_POP);
 
     if (loop.exit_jump != -1) {
         patch_jump(loop.exit_jump);
@@ -1816,16 +2209,34 @@ static void statement()
     ignore_new_lines();
 }
 
+// Drops the parser's references into the heap once it is done, since the
+// parser outlives the VM it last compiled for.
+static void end_parse()
+{
+    parser.module = NULL;
+    parser.source = NULL;
+    parser.current.value = NIL_VAL;
+    parser.previous.value = NIL_VAL;
+}
+
 static ObjFunction* compile_impl(ObjModule* module, const char* source)
 {
     parser.module = module;
+    parser.source_start = source;
+    parser.source = NULL;
+    parser.lazy = vm.config.lazy_compile;
     parser.had_error = false;
     parser.panic_mode = false;
 
+    // Skimmed bodies outlive the host's copy of the source.
+    if (parser.lazy) {
+        parser.source = copy_string(source, (int)strlen(source));
+    }
+
     init_scanner(source);
 
     Compiler compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
+    init_compiler(&compiler, TYPE_SCRIPT, NULL);
 
     advance();
 
@@ -1836,9 +2247,66 @@ static ObjFunction* compile_impl(ObjModule* module, const char* source)
     emit_op(OP_END_MODULE);
 
     ObjFunction* function = end_compiler();
+    end_parse();
     return parser.had_error ? NULL : function;
 }
 
+bool compile_lazy(ObjFunction* function)
+{
+    ASSERT(current == NULL, "Can't compile a body while compiling.");
+
+    ObjString* source = function->lazy_source;
+    parser.module = function->module;
+    parser.source_start = source->chars;
+    parser.source = source;
+    parser.lazy = true;
+    parser.had_error = false;
+    parser.panic_mode = false;
+
+    init_scanner_at(source->chars + function->lazy_offset, function->lazy_line);
+    advance();
+
+    // Bodies that use `super` are never skimmed, so a method only needs its
+    // class for `this` and the fields it assigns.
+    ClassCompiler class_compiler;
+    class_compiler.enclosing = NULL;
+    class_compiler.has_superclass = false;
+    class_compiler.is_foreign = false;
+    class_compiler.num_fields = 0;
+    class_compiler.receiver_is_this = false;
+    FunctionType type = (FunctionType)function->lazy_type;
+    if (type != TYPE_FUNCTION) {
+        current_class = &class_compiler;
+    }
+
+    int arity = function->arity;
+    function->arity = 0;
+    Compiler compiler;
+    init_compiler(&compiler, type, function);
+    begin_scope(); // [no-end-scope]
+
+    parameter_list(NULL);
+    ignore_new_lines();
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block();
+    end_compiler();
+
+    current_class = NULL;
+    end_parse();
+
+    if (parser.had_error)
+    {
+        free_chunk(&function->chunk);
+        init_chunk(&function->chunk);
+        function->arity = arity;
+        return false;
+    }
+
+    ASSERT(function->upvalue_count == 0, "A skimmed body can't capture anything.");
+    function->lazy_source = NULL;
+    return true;
+}
+
 static ObjModule* get_module(Value name)
 {
     Value module;
@@ -1849,7 +2317,7 @@ static ObjModule* get_module(Value name)
     }
 }
 
-ObjClosure* compile(const char* module, const char* source)
+ObjModule* prepare_module(const char* module)
 {
     const bool is_core = strcmp(module, "Core") == 0;
 
@@ -1864,36 +2332,30 @@ ObjClosure* compile(const char* module, const char* source)
 
     if (obj_module == NULL)
     {
+        push(OBJ_VAL(module_str));
         obj_module = new_module(module_str);
 
         push(OBJ_VAL(obj_module));
         table_set(&vm.modules, module_str, OBJ_VAL(obj_module));
         pop();
+        pop();
     }
-    else
+    else if (!is_core)
     {
-        if (!is_core) {
-            free_value_array(&obj_module->variables);
-            free_value_array(&obj_module->variable_names);
-        }
+        // Compiling the module again redefines its variables, but code from
+        // the earlier compile, such as a parked fiber's, still addresses them
+        // by slot. So the slots are kept and reused for the same names.
+        reset_module_variables(obj_module);
     }
 
-    // import Core's vars
-    if (!is_core)
-    {
-        Value v_core_module;
-        if (!table_get(&vm.modules, copy_string("Core", 4), &v_core_module)) {
-            error("Core module should be loaded.");
-        }
-
-        ObjModule* core_module = AS_MODULE(v_core_module);
-        for (int i = 0; i < core_module->variables.count; ++i)
-        {
-            ObjString* name = AS_STRING(core_module->variable_names.values[i]);
-            DefineVariable(obj_module, name->chars, name->length, core_module->variables.values[i], NULL);
-        }
-    }
+    // Core's variables are not copied in. Names the module doesn't declare
+    // itself resolve to Core's slots, see core_variable().
+    return obj_module;
+}
 
+ObjClosure* compile(const char* module, const char* source)
+{
+    ObjModule* obj_module = prepare_module(module);
     ObjFunction* func = compile_impl(obj_module, source);
     if (func == NULL) {
         return NULL;
@@ -1974,6 +2436,7 @@ void signature_to_string(Signature* signature, char name[MAX_METHOD_SIGNATURE],
 void mark_gray_compiler()
 {
     mark_object((Obj*)parser.module);
+    mark_object((Obj*)parser.source);
     mark_value(parser.current.value);
     mark_value(parser.previous.value);
 }
\ No newline at end of file
@@ -4,7 +4,16 @@
 #include "common.h"
 #include "object.h"
 
+// Looks up or creates the module named [module] and clears the variables of
+// an existing one, which is the state its code is compiled against. Core's
+// variables are not copied in; the compiler resolves them through Core.
+ObjModule* prepare_module(const char* module);
+
 ObjClosure* compile(const char* module, const char* source);
+
+// Compiles the body of [function], which was only skimmed when its module was
+// compiled. Returns false, leaving it uncompiled, on a compile error.
+bool compile_lazy(ObjFunction* function);
 void mark_compiler_roots();
 
 typedef enum
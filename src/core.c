@@ -1,4 +1,5 @@
 #include "core.h"
+#include "artifact.h"
 #include "object.h"
 #include "vm.h"
 #include "primitive.h"
@@ -10,6 +11,7 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
 DEF_PRIMITIVE(w_Object_is)
@@ -62,8 +64,8 @@ DEF_PRIMITIVE(w_Object_has_method)
 {
 	ObjClass* klass = get_class(args[0]);
 	ObjString* method = AS_STRING(args[1]);
-	Value v;
-	RETURN_BOOL(table_get(&klass->methods, method, &v));
+	int symbol = method_symbol_find(method->chars, method->length);
+	RETURN_BOOL(find_method(klass, symbol) != NULL);
 }
 
 DEF_PRIMITIVE(w_Object_subscript)
@@ -73,7 +75,7 @@ DEF_PRIMITIVE(w_Object_subscript)
 		ObjInstance* instance = AS_INSTANCE(args[0]);
 		ObjString* name = AS_STRING(args[1]);
 		Value value;
-		if (table_get(&instance->fields, name, &value)) {
+		if (instance_get_field(instance, name, &value)) {
 			RETURN_VAL(value);
 		}
 	}
@@ -87,7 +89,7 @@ DEF_PRIMITIVE(w_Object_subscriptSetter)
 	{
 		ObjInstance* instance = AS_INSTANCE(args[0]);
 		ObjString* name = AS_STRING(args[1]);
-		if (table_set(&instance->fields, name, args[2])) {
+		if (instance_set_field(instance, name, args[2])) {
 			RETURN_VAL(args[2]);
 		}
 	}
@@ -366,18 +368,21 @@ DEF_PRIMITIVE(w_List_subscriptSetter)
 	}
 
 	list->elements.values[index] = args[2];
+	write_barrier((Obj*)list, args[2]);
 	RETURN_VAL(args[2]);
 }
 
 DEF_PRIMITIVE(w_List_add)
 {
 	write_value_array(&AS_LIST(args[0])->elements, args[1]);
+	write_barrier(AS_OBJ(args[0]), args[1]);
 	RETURN_VAL(args[1]);
 }
 
 DEF_PRIMITIVE(w_List_addCore)
 {
 	write_value_array(&AS_LIST(args[0])->elements, args[1]);
+	write_barrier(AS_OBJ(args[0]), args[1]);
 
 	// Return the list.
 	RETURN_VAL(args[0]);
@@ -499,6 +504,8 @@ DEF_PRIMITIVE(w_Map_subscriptSetter)
 	}
 
 	table_set(&AS_MAP(args[0])->entries, AS_STRING(args[1]), args[2]);
+	write_barrier(AS_OBJ(args[0]), args[1]);
+	write_barrier(AS_OBJ(args[0]), args[2]);
 	RETURN_VAL(args[2]);
 }
 
@@ -515,6 +522,8 @@ DEF_PRIMITIVE(w_Map_addCore)
 	}
 
 	table_set(&AS_MAP(args[0])->entries, AS_STRING(args[1]), args[2]);
+	write_barrier(AS_OBJ(args[0]), args[1]);
+	write_barrier(AS_OBJ(args[0]), args[2]);
 
 	// Return the map itself.
 	RETURN_VAL(args[0]);
@@ -667,6 +676,7 @@ DEF_PRIMITIVE(w_Set_add)
 	}
 
 	write_value_array(&set->elements, args[1]);
+	write_barrier((Obj*)set, args[1]);
 	RETURN_VAL(args[1]);
 }
 
@@ -850,6 +860,52 @@ DEF_PRIMITIVE(w_System_clock)
 	RETURN_NUM((double)clock() / CLOCKS_PER_SEC);
 }
 
+// Sets [name] in [map] to [value], which the caller keeps rooted.
+static void set_stat(ObjMap* map, const char* name, Value value)
+{
+	ObjString* key = copy_string(name, (int)strlen(name));
+	push_root((Obj*)key);
+	table_set(&map->entries, key, value);
+	write_barrier((Obj*)map, OBJ_VAL(key));
+	write_barrier((Obj*)map, value);
+	pop_root();
+}
+
+DEF_PRIMITIVE(w_System_gcStats)
+{
+	VesselGCStats stats;
+	ves_gc_stats(&stats);
+
+	ObjMap* result = new_map();
+	push_root((Obj*)result);
+	set_stat(result, "youngCollections", NUMBER_VAL((double)stats.young_collections));
+	set_stat(result, "fullCollections", NUMBER_VAL((double)stats.full_collections));
+	set_stat(result, "pauses", NUMBER_VAL((double)stats.pauses));
+	set_stat(result, "pauseTotalUs", NUMBER_VAL((double)stats.pause_total_us));
+	set_stat(result, "pauseMaxUs", NUMBER_VAL((double)stats.pause_max_us));
+	set_stat(result, "bytesAllocated", NUMBER_VAL((double)stats.bytes_allocated));
+	set_stat(result, "bytesFreed", NUMBER_VAL((double)stats.bytes_freed));
+	set_stat(result, "bytesLive", NUMBER_VAL((double)stats.bytes_live));
+	set_stat(result, "nextGC", NUMBER_VAL((double)stats.next_gc));
+
+	ObjMap* types = new_map();
+	push_root((Obj*)types);
+	for (int i = 0; i < VES_GC_OBJECT_TYPES; i++)
+	{
+		ObjMap* type = new_map();
+		push_root((Obj*)type);
+		set_stat(type, "count", NUMBER_VAL((double)stats.types[i].count));
+		set_stat(type, "bytes", NUMBER_VAL((double)stats.types[i].bytes));
+		set_stat(types, ves_gc_type_name(i), OBJ_VAL(type));
+		pop_root();
+	}
+	set_stat(result, "types", OBJ_VAL(types));
+	pop_root();
+	pop_root();
+
+	RETURN_OBJ(result);
+}
+
 DEF_PRIMITIVE(w_System_traceback)
 {
 	ves_traceback();
@@ -874,6 +930,122 @@ DEF_PRIMITIVE(w_Basic_loadstring)
 	return true;
 }
 
+DEF_PRIMITIVE(w_Fiber_new)
+{
+	if (!IS_CLOSURE(args[1])) {
+		RETURN_ERROR("Argument must be a function.");
+	}
+	if (AS_CLOSURE(args[1])->function->arity > 1) {
+		RETURN_ERROR("Function cannot take more than one parameter.");
+	}
+	RETURN_OBJ(new_fiber(AS_CLOSURE(args[1])));
+}
+
+DEF_PRIMITIVE(w_Fiber_current)
+{
+	RETURN_OBJ(vm.fiber);
+}
+
+DEF_PRIMITIVE(w_Fiber_isDone)
+{
+	RETURN_BOOL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+// Asks the interpreter to switch to [fiber] once the primitive returns. NULL
+// parks the running fiber and returns to the host instead.
+static void request_switch(ObjFiber* fiber, Value value)
+{
+	vm.fiber_switch = true;
+	vm.next_fiber = fiber;
+	vm.fiber_value = value;
+}
+
+// Resumes [fiber] with [value]. A call makes the running fiber wait for it to
+// yield or return, while a transfer leaves the running fiber suspended.
+static bool run_fiber(ObjFiber* fiber, Value value, bool is_call, const char* verb)
+{
+	if (!can_switch_fiber()) {
+		RETURN_ERROR("Cannot switch fibers from inside a foreign call.");
+	}
+	if (fiber->state == FIBER_DONE) {
+		RETURN_ERROR_FMT("Cannot $ a finished fiber.", verb);
+	}
+	if (fiber->state == FIBER_ACTIVE) {
+		RETURN_ERROR_FMT("Cannot $ a fiber that is already running.", verb);
+	}
+
+	if (is_call) {
+		fiber->caller = vm.fiber;
+		write_barrier((Obj*)fiber, OBJ_VAL(vm.fiber));
+	} else if (vm.fiber != vm.main_fiber) {
+		vm.fiber->state = FIBER_SUSPENDED;
+	}
+	request_switch(fiber, value);
+	return true;
+}
+
+DEF_PRIMITIVE(w_Fiber_call)
+{
+	return run_fiber(AS_FIBER(args[0]), NIL_VAL, true, "call");
+}
+
+DEF_PRIMITIVE(w_Fiber_call1)
+{
+	return run_fiber(AS_FIBER(args[0]), args[1], true, "call");
+}
+
+DEF_PRIMITIVE(w_Fiber_transfer)
+{
+	return run_fiber(AS_FIBER(args[0]), NIL_VAL, false, "transfer to");
+}
+
+DEF_PRIMITIVE(w_Fiber_transfer1)
+{
+	return run_fiber(AS_FIBER(args[0]), args[1], false, "transfer to");
+}
+
+// Suspends the running fiber and resumes its caller with [value], or parks it
+// for the host if nothing called it.
+static bool yield_fiber(Value value)
+{
+	if (vm.fiber == vm.main_fiber) {
+		RETURN_ERROR("The main fiber cannot yield.");
+	}
+	if (!can_switch_fiber()) {
+		RETURN_ERROR("Cannot switch fibers from inside a foreign call.");
+	}
+
+	ObjFiber* caller = vm.fiber->caller;
+	vm.fiber->caller = NULL;
+	vm.fiber->state = FIBER_SUSPENDED;
+	request_switch(caller, value);
+	return true;
+}
+
+DEF_PRIMITIVE(w_Fiber_yield)
+{
+	return yield_fiber(NIL_VAL);
+}
+
+DEF_PRIMITIVE(w_Fiber_yield1)
+{
+	return yield_fiber(args[1]);
+}
+
+DEF_PRIMITIVE(w_Fiber_suspend)
+{
+	if (vm.fiber == vm.main_fiber) {
+		RETURN_ERROR("The main fiber cannot be suspended.");
+	}
+	if (!can_switch_fiber()) {
+		RETURN_ERROR("Cannot switch fibers from inside a foreign call.");
+	}
+
+	vm.fiber->state = FIBER_SUSPENDED;
+	request_switch(NULL, NIL_VAL);
+	return true;
+}
+
 static ObjClass* define_class(ObjModule* module, const char* name)
 {
 	ObjString* name_string = copy_string(name, strlen(name));
@@ -896,11 +1068,16 @@ static Value find_variable(ObjModule* module, const char* name)
 	return module->variables.values[symbol];
 }
 
+// Core's bytecode, compiled by the first VM in the process and shared by the
+// rest.
+static VesselArtifact* core_artifact = NULL;
+
 void initialize_core()
 {
 	ObjString* core_name = copy_string("Core", 4);
 
 	ObjModule* core_module = new_module(core_name);
+	vm.core_module = core_module;
 
 	push(OBJ_VAL(core_module));
 	table_set(&vm.modules, core_name, OBJ_VAL(core_module));
@@ -924,7 +1101,10 @@ void initialize_core()
 	//PRIMITIVE(vm.class_class, "[_]", w_Class_subscript);
 	bind_superclass(vm.class_class, vm.object_class);
 
-	ves_interpret("Core", coreModuleSource);
+	VesselArtifact* artifact = cached_artifact(&core_artifact, "Core", coreModuleSource);
+	if (artifact != NULL) {
+		ves_run_artifact(artifact);
+	}
 
 	vm.bool_class = AS_CLASS(find_variable(core_module, "Bool"));
 	PRIMITIVE(vm.bool_class, "toString()", w_Bool_toString);
@@ -1003,10 +1183,24 @@ void initialize_core()
 	DefineVariable(core_module, "System", 6, OBJ_VAL(vm.system_class), NULL);
 	PRIMITIVE(vm.system_class->obj.class_obj, "writeString(_)", w_System_writeString);
 	PRIMITIVE(vm.system_class->obj.class_obj, "clock()", w_System_clock);
+	PRIMITIVE(vm.system_class->obj.class_obj, "gcStats()", w_System_gcStats);
 	PRIMITIVE(vm.system_class->obj.class_obj, "traceback()", w_System_traceback);
 	PRIMITIVE(vm.system_class->obj.class_obj, "profile()", w_System_profile);
 
 	vm.basic_class = AS_CLASS(find_variable(core_module, "Basic"));
 	DefineVariable(core_module, "Basic", 5, OBJ_VAL(vm.basic_class), NULL);
 	PRIMITIVE(vm.basic_class->obj.class_obj, "loadstring(_,_)", w_Basic_loadstring);
+
+	vm.fiber_class = AS_CLASS(find_variable(core_module, "Fiber"));
+	vm.main_fiber->obj.class_obj = vm.fiber_class;
+	PRIMITIVE(vm.fiber_class->obj.class_obj, "new(_)", w_Fiber_new);
+	PRIMITIVE(vm.fiber_class->obj.class_obj, "current", w_Fiber_current);
+	PRIMITIVE(vm.fiber_class->obj.class_obj, "yield()", w_Fiber_yield);
+	PRIMITIVE(vm.fiber_class->obj.class_obj, "yield(_)", w_Fiber_yield1);
+	PRIMITIVE(vm.fiber_class->obj.class_obj, "suspend()", w_Fiber_suspend);
+	PRIMITIVE(vm.fiber_class, "call()", w_Fiber_call);
+	PRIMITIVE(vm.fiber_class, "call(_)", w_Fiber_call1);
+	PRIMITIVE(vm.fiber_class, "transfer()", w_Fiber_transfer);
+	PRIMITIVE(vm.fiber_class, "transfer(_)", w_Fiber_transfer1);
+	PRIMITIVE(vm.fiber_class, "isDone", w_Fiber_isDone);
 }
\ No newline at end of file
@@ -9,7 +9,7 @@
 
 
 #define BUF_SIZE 1024 * 8
-static char OUT_BUF[BUF_SIZE];
+static VES_THREAD_LOCAL char OUT_BUF[BUF_SIZE];
 
 static void print(bool to_console, const char* format, ...)
 {
@@ -105,6 +105,12 @@ static void dump_object(Value value, bool to_console)
 		print(to_console, "range(%.14g, %.14g)", range->from, range->to);
 	}
 		break;
+	case OBJ_SHAPE:
+		print(to_console, "shape");
+		break;
+	case OBJ_FIBER:
+		print(to_console, "fiber");
+		break;
 	}
 }
 
@@ -140,4 +146,205 @@ void dump_value(Value value, bool to_console)
 		break;
 	}
 #endif // NAN_BOXING
-}
\ No newline at end of file
+}
+
+static const char* OP_NAMES[] = {
+#define OPCODE(name, _) "OP_" #name,
+#include "opcodes.h"
+#undef OPCODE
+};
+
+static int read_short(Chunk* chunk, int offset)
+{
+	return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int simple_instruction(const char* name, int offset)
+{
+	printf("%s\n", name);
+	return offset + 1;
+}
+
+static int short_instruction(const char* name, Chunk* chunk, int offset)
+{
+	printf("%-28s %5d\n", name, read_short(chunk, offset + 1));
+	return offset + 3;
+}
+
+static int constant_instruction(const char* name, Chunk* chunk, int offset)
+{
+	int constant = read_short(chunk, offset + 1);
+	printf("%-28s %5d '", name, constant);
+	dump_value(chunk->constants.values[constant], true);
+	printf("'\n");
+	return offset + 3;
+}
+
+static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset)
+{
+	int jump = read_short(chunk, offset + 1);
+	printf("%-28s %5d -> %d\n", name, offset, offset + 3 + sign * jump);
+	return offset + 3;
+}
+
+static int property_instruction(const char* name, Chunk* chunk, int offset)
+{
+	int constant = read_short(chunk, offset + 1);
+	printf("%-28s %5d '", name, constant);
+	dump_value(chunk->constants.values[constant], true);
+	printf("' cache %d\n", read_short(chunk, offset + 3));
+	return offset + 5;
+}
+
+static int invoke_instruction(const char* name, Chunk* chunk, int offset, bool cached)
+{
+	int constant = read_short(chunk, offset + 1);
+	printf("%-28s (%d args) %5d '", name, chunk->code[offset + 3], constant);
+	dump_value(chunk->constants.values[constant], true);
+	printf("' symbol %d", read_short(chunk, offset + 4));
+	if (cached) {
+		printf(" cache %d", read_short(chunk, offset + 6));
+	}
+	printf("\n");
+	return offset + (cached ? 8 : 6);
+}
+
+void disassemble_chunk(Chunk* chunk, const char* name)
+{
+	printf("== %s ==\n", name);
+
+	for (int offset = 0; offset < chunk->count;) {
+		offset = disassemble_instruction(chunk, offset);
+	}
+}
+
+int disassemble_instruction(Chunk* chunk, int offset)
+{
+	printf("%04d ", offset);
+	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+		printf("   | ");
+	} else {
+		printf("%4d ", chunk->lines[offset]);
+	}
+
+	uint8_t instruction = chunk->code[offset];
+	const char* name = OP_NAMES[instruction];
+	switch (instruction)
+	{
+	case OP_CONSTANT:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_GET_SUPER:
+	case OP_FOREIGN_CLASS:
+	case OP_IMPORT_MODULE:
+	case OP_IMPORT_VARIABLE:
+		return constant_instruction(name, chunk, offset);
+
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+	case OP_GET_UPVALUE:
+	case OP_SET_UPVALUE:
+	case OP_DEFINE_GLOBAL:
+	case OP_LOAD_MODULE_VAR:
+	case OP_STORE_MODULE_VAR:
+	case OP_LOAD_CORE_VAR:
+	case OP_METHOD:
+	case OP_METHOD_STATIC:
+		return short_instruction(name, chunk, offset);
+
+	case OP_GET_LOCAL_2:
+		printf("%-28s %5d %5d\n", name, read_short(chunk, offset + 1), read_short(chunk, offset + 3));
+		return offset + 5;
+
+	case OP_ADD_LOCAL_CONST:
+	case OP_INCREMENT_LOCAL:
+	{
+		int constant = read_short(chunk, offset + 3);
+		printf("%-28s %5d %5d '", name, read_short(chunk, offset + 1), constant);
+		dump_value(chunk->constants.values[constant], true);
+		printf("'\n");
+		return offset + 5;
+	}
+
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_FIELD_CACHED:
+	case OP_SET_FIELD_CACHED:
+		return property_instruction(name, chunk, offset);
+
+	case OP_CLASS:
+	{
+		int constant = read_short(chunk, offset + 1);
+		printf("%-28s %5d '", name, constant);
+		dump_value(chunk->constants.values[constant], true);
+		printf("' (%d fields)\n", chunk->code[offset + 3]);
+		return offset + 4;
+	}
+
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_LESS_EQUAL_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE:
+	case OP_GREATER_EQUAL_JUMP_IF_FALSE:
+		return jump_instruction(name, 1, chunk, offset);
+	case OP_LOOP:
+		return jump_instruction(name, -1, chunk, offset);
+
+	case OP_CALL:
+		printf("%-28s (%d args)\n", name, chunk->code[offset + 1]);
+		return offset + 2;
+
+	case OP_CALL_0:
+	case OP_CALL_1:
+	case OP_CALL_2:
+	case OP_CALL_3:
+	case OP_CALL_4:
+	case OP_CALL_5:
+	case OP_CALL_6:
+	case OP_CALL_7:
+	case OP_CALL_8:
+	case OP_CALL_9:
+	case OP_CALL_10:
+	case OP_CALL_11:
+	case OP_CALL_12:
+	case OP_CALL_13:
+	case OP_CALL_14:
+	case OP_CALL_15:
+	case OP_CALL_16:
+	{
+		int symbol = read_short(chunk, offset + 1);
+		printf("%-28s %5d '", name, symbol);
+		dump_value(vm.method_names.values[symbol], true);
+		printf("' cache %d\n", read_short(chunk, offset + 3));
+		return offset + 5;
+	}
+
+	case OP_INVOKE:
+		return invoke_instruction(name, chunk, offset, true);
+	case OP_SUPER_INVOKE:
+		return invoke_instruction(name, chunk, offset, false);
+
+	case OP_CLOSURE:
+	{
+		int constant = read_short(chunk, offset + 1);
+		printf("%-28s %5d ", name, constant);
+		dump_value(chunk->constants.values[constant], true);
+		printf("\n");
+		offset += 3;
+
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+		for (int i = 0; i < function->upvalue_count; i++) {
+			int is_local = chunk->code[offset];
+			printf("%04d    |                     %s %d\n",
+				offset, is_local ? "local" : "upvalue", read_short(chunk, offset + 1));
+			offset += 3;
+		}
+		return offset;
+	}
+
+	default:
+		return simple_instruction(name, offset);
+	}
+}
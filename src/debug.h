@@ -1,8 +1,12 @@
 #ifndef vessel_debug_h
 #define vessel_debug_h
 
+#include "chunk.h"
 #include "value.h"
 
 void dump_value(Value value, bool to_console);
 
+void disassemble_chunk(Chunk* chunk, const char* name);
+int disassemble_instruction(Chunk* chunk, int offset);
+
 #endif // vessel_debug_h
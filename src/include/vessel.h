@@ -17,14 +17,20 @@ extern "C"
 struct VesselLoadModuleResult;
 typedef void (*VesselLoadModuleCompleteFn)(const char* name, struct VesselLoadModuleResult result);
 
+// A module compiled ahead of time and frozen, see ves_compile_artifact().
+typedef struct VesselArtifact VesselArtifact;
+
 // The result of a load_module_fn call.
 // [source] is the source code for the module, or NULL if the module is not found.
 // [onComplete] an optional callback that will be called once Vessel is done with the result.
+// [artifact] is used instead of [source] when set. The VM takes its own
+// references, so the host may release it in [on_complete].
 typedef struct VesselLoadModuleResult
 {
 	const char* source;
 	VesselLoadModuleCompleteFn on_complete;
 	void* user_data;
+	VesselArtifact* artifact;
 } VesselLoadModuleResult;
 
 typedef void (*VesselForeignMethodFn)();
@@ -64,16 +70,72 @@ typedef VesselForeignClassMethods(*VesselBindForeignClassFn)(
 // Displays a string of text to the user.
 typedef void (*VesselWriteFn)(const char* text);
 
+// A generic allocation function that handles all explicit memory management
+// used by Vessel. It's used like so:
+//
+// - To allocate new memory, [memory] is NULL and [new_size] is the desired
+//   size. It should return the allocated memory or NULL on failure.
+//
+// - To attempt to grow an existing allocation, [memory] is the memory, and
+//   [new_size] is the desired size. It should return [memory] if it was able to
+//   grow it in place, or a new pointer if it had to move it.
+//
+// - To shrink memory, [memory] and [new_size] are the same as above but it will
+//   always return [memory].
+//
+// - To free memory, [memory] will be the memory to free and [new_size] will be
+//   zero. It should return NULL.
+typedef void* (*VesselReallocateFn)(void* memory, size_t new_size, void* user_data);
+
+// When the finalizers of dead foreign objects run. The collector queues the
+// objects as it finds them dead, and they are finalized in batches and then
+// freed.
+typedef enum
+{
+	// Right after the collection work that found them.
+	VES_FINALIZE_AFTER_GC,
+	// Only when the host calls ves_run_finalizers(), at a point of its choosing.
+	// Until then the objects keep their memory.
+	VES_FINALIZE_ON_REQUEST,
+	// On a background thread, so the VM never waits for them. The finalizers
+	// must be safe to call from another thread. Builds without VES_PARALLEL_GC
+	// run them as with VES_FINALIZE_AFTER_GC.
+	VES_FINALIZE_ON_THREAD
+} VesselFinalizeMode;
+
+typedef enum
+{
+	VES_GC_START,
+	VES_GC_END
+} VesselGCEvent;
+
+// Called as each collection pause starts and ends. [full] tells a full
+// collection, or a slice of an incremental one, from a young collection. It
+// must not call back into the VM.
+typedef void (*VesselGCEventFn)(VesselGCEvent event, bool full);
+
 typedef struct
 {
+  // The callback Vessel uses to allocate, grow, shrink and free all of the
+  // VM's memory, called with [reallocate_user_data]. If NULL, Vessel uses the
+  // C library's realloc() and free().
+  //
+  // Both are fixed when the VM is created, see ves_init_vm_with_config(), and
+  // ves_set_config() leaves them as they are. With gc_threads the helper
+  // threads call it too, so it must be safe to call from other threads then.
+  // Compiled artifacts outlive the VM that made them, so they always come from
+  // the C library.
+  VesselReallocateFn reallocate_fn;
+  void* reallocate_user_data;
+
   // The callback Vessel uses to load a module.
   //
   // Since Vessel does not talk directly to the file system, it relies on the
   // embedder to physically locate and read the source code for a module. The
   // first time an import appears, Vessel will call this and pass in the name of
   // the module being imported. The VM should return the soure code for that
-  // module. Memory for the source should be allocated using [reallocateFn] and
-  // Vessel will take ownership over it.
+  // module. The source stays the host's: Vessel calls the result's
+  // [on_complete] once it is done with it, which is where to free it.
   //
   // This will only be called once for any given module name. Vessel caches the
   // result internally so subsequent imports of the same module will use the
@@ -106,13 +168,70 @@ typedef struct
 
   VesselWriteFn write_fn;
 
+  // The maximum depth of nested calls before Vessel reports a stack overflow.
+  //
+  // The call stack starts small and grows as needed up to this limit.
+  int max_frames;
+
+  // If true, function and method bodies are only skimmed when a module is
+  // compiled, and each one is compiled the first time it is called. Modules
+  // with many functions that are rarely called load faster and use less
+  // memory. A syntax error in a body is then reported when it is first called
+  // rather than when the module is loaded. Bodies that capture variables of
+  // an enclosing function are always compiled up front.
+  bool lazy_compile;
+
+  // If true, full garbage collections are done incrementally. The heap is
+  // marked and swept in short slices between allocations rather than all in
+  // one pause, which trades some throughput for pauses that stay short however
+  // large the heap gets.
+  bool incremental_gc;
+
+  // The longest each incremental slice may run, in microseconds.
+  int gc_slice_budget_us;
+
+  // Helper threads that join in when a full collection marks the heap in one
+  // go, each tracing its own share of the objects. 0 marks on the calling
+  // thread alone. Builds without VES_PARALLEL_GC ignore it.
+  int gc_threads;
+
+  // When the finalizers of dead foreign objects run.
+  VesselFinalizeMode finalize_mode;
+
+  // If not NULL, told when the collector pauses the program and resumes it.
+  VesselGCEventFn gc_event_fn;
+
+  // The heap size in bytes at which the first full collection starts. Later
+  // ones never start below it either, so a small heap is not collected over
+  // and over.
+  size_t gc_initial_heap;
+
+  // After each full collection, the next one starts once the heap has grown
+  // by a factor in this range. Without a target time fraction the heap grows
+  // by gc_min_growth.
+  double gc_min_growth;
+  double gc_max_growth;
+
+  // If above 0, the share of the run time the collector should stay under,
+  // such as 0.05. The growth factor rises toward gc_max_growth while
+  // collections take more than that, and falls back toward gc_min_growth
+  // while they take less than half of it.
+  double gc_target_time_fraction;
+
+  // If not 0, the most bytes the heap may hold. Going past it forces a full
+  // collection, and if that does not free enough, the running script fails
+  // with an "Out of memory." runtime error at its next call or loop.
+  size_t gc_heap_limit;
+
 } VesselConfiguration;
 
 typedef enum
 {
 	VES_INTERPRET_OK,
 	VES_INTERPRET_COMPILE_ERROR,
-	VES_INTERPRET_RUNTIME_ERROR
+	VES_INTERPRET_RUNTIME_ERROR,
+	// A fiber parked itself to wait for the host, see ves_suspended_fiber().
+	VES_INTERPRET_SUSPENDED
 } VesselInterpretResult;
 
 VesselInterpretResult ves_interpret(const char* module, const char* source);
@@ -120,11 +239,118 @@ VesselInterpretResult ves_interpret(const char* module, const char* source);
 void* ves_compile(const char* module, const char* source);
 VesselInterpretResult ves_run(void* closure);
 
+// Compiles [source] as [module] on the current VM and freezes the result into
+// an immutable artifact. Any VM (on any thread) can then run or import the
+// module from it without compiling it again, sharing its bytecode instead of
+// copying it. Returns NULL on a compile error. The caller owns one reference.
+VesselArtifact* ves_compile_artifact(const char* module, const char* source);
+
+// Runs a fresh instance of the artifact's module on the current VM.
+VesselInterpretResult ves_run_artifact(VesselArtifact* artifact);
+
+// Artifacts are reference counted, and freed when the last reference is
+// released. Both are safe to call from any thread.
+void ves_retain_artifact(VesselArtifact* artifact);
+void ves_release_artifact(VesselArtifact* artifact);
+
+// Writes [artifact] to the file at [path] in a versioned binary format, so a
+// later run can load the module without compiling it. Returns false if the
+// file could not be written.
+bool ves_save_compiled(VesselArtifact* artifact, const char* path);
+
+// Loads an artifact written by ves_save_compiled(). The file is mapped into
+// memory and its bytecode is run from there without being copied or parsed
+// again. Returns NULL if the file can't be read, is malformed, or was written
+// by a build with a different format or instruction set. The bytecode is
+// checked to stay within the tables it indexes, but not for how it uses the
+// stack, so load only files you trust. The caller owns one reference.
+VesselArtifact* ves_load_compiled(const char* path);
+
+// A fiber parked for the host, by Fiber.suspend() or by yielding with no
+// caller to yield to.
+typedef struct VesselFiber VesselFiber;
+
+// Returns the fiber that parked itself when the last call returned
+// VES_INTERPRET_SUSPENDED. The VM keeps every parked fiber alive until the host
+// passes it to ves_resume_fiber() or ves_release_fiber().
+VesselFiber* ves_suspended_fiber();
+
+// Pops the value on top of the stack and resumes [fiber] with it as the result
+// of the call that parked it. Runs until the fiber returns, parks again or
+// fails. Must not be called from a foreign method that runs on a fiber.
+VesselInterpretResult ves_resume_fiber(VesselFiber* fiber);
+
+// Lets the VM collect a parked fiber the host will not resume.
+void ves_release_fiber(VesselFiber* fiber);
+
+// Runs the finalizers of the dead foreign objects queued so far and frees them.
+// Hosts using VES_FINALIZE_ON_REQUEST call it where finalizing suits them.
+void ves_run_finalizers();
+
+// One for each kind of heap object, see ves_gc_type_name().
+#define VES_GC_OBJECT_TYPES 17
+
+typedef struct
+{
+	// Objects allocated and not freed yet, and the bytes they take themselves,
+	// leaving out the strings and arrays they own.
+	size_t count;
+	size_t bytes;
+} VesselGCTypeStats;
+
+typedef struct
+{
+	uint64_t young_collections;
+	uint64_t full_collections;
+
+	// Pauses for collection work, incremental slices each counting as one, and
+	// the wall time they took in microseconds.
+	uint64_t pauses;
+	uint64_t pause_total_us;
+	uint64_t pause_max_us;
+
+	// Bytes ever allocated and freed, and those in use now.
+	uint64_t bytes_allocated;
+	uint64_t bytes_freed;
+	size_t bytes_live;
+	// The heap size at which the next full collection starts.
+	size_t next_gc;
+
+	VesselGCTypeStats types[VES_GC_OBJECT_TYPES];
+} VesselGCStats;
+
+// Fills [stats] in for the current VM.
+void ves_gc_stats(VesselGCStats* stats);
+
+// The name of the kind of object counted in VesselGCStats.types[type].
+const char* ves_gc_type_name(int type);
+
+// Initializes [cfg] with all of its default values.
+//
+// Call this before setting the particular fields you care about.
+void ves_init_configuration(VesselConfiguration* cfg);
 void ves_set_config(VesselConfiguration* cfg);
 
-void ves_init_vm();
+// An interpreter instance. Each one owns its heap, modules and stacks, so
+// several can run in one process, one per thread at a time.
+typedef struct VesselVM VesselVM;
+
+// Creates a new VM and makes it the calling thread's current VM. Every other
+// ves_* function operates on the calling thread's current VM.
+VesselVM* ves_init_vm();
+
+// Like ves_init_vm(), but configured with [cfg] from the start, which is the
+// only way to give the VM its own reallocate_fn.
+VesselVM* ves_init_vm_with_config(VesselConfiguration* cfg);
+
+// Frees the calling thread's current VM. Afterwards the thread has none.
 void ves_free_vm();
 
+// Makes [vm] the calling thread's current VM, or clears it if NULL. A VM must
+// not be current on two threads at once.
+void ves_set_vm(VesselVM* vm);
+VesselVM* ves_get_vm();
+
 int ves_gettop();
 int ves_argnum();
 
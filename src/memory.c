@@ -9,8 +9,88 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-#define GC_HEAP_GROW_FACTOR 2
+#if VES_PARALLEL_GC
+#include <pthread.h>
+#endif
+
+// Bytes allocated between two young collections. Most objects are garbage by
+// the time it runs out, so a young collection only has to trace the few that
+// are still reachable.
+#define GC_NURSERY_SIZE (256 * 1024)
+
+// Bytes allocated between two slices of an incremental collection.
+#define GC_SLICE_BYTES (64 * 1024)
+
+// How much the growth factor changes by when adapting to the target time
+// fraction, see adapt_growth().
+#define GC_GROWTH_STEP 1.5
+
+// Objects an incremental slice gets through between looking at the clock.
+#define GC_CLOCK_INTERVAL 256
+
+// Stands in for the epoch of a page whose marks a marking thread is clearing,
+// so the pool's own epoch skips it.
+#define EPOCH_CLEARING UINT32_MAX
+
+static void collect_young();
+static void gc_step(clock_t deadline);
+static void sweep_unswept(PoolPage* page);
+static void settle_finalizers();
+static void collect_everything();
+
+// Young collections take every marked object for old, which is not so once a
+// collection has started marking afresh, so they wait until it is done.
+static inline bool can_collect_young()
+{
+	return vm.gc_state != GC_MARKING;
+}
+
+// Takes a block from the pool. The pages the last collection marked are swept
+// only now, when their size class has run out of free blocks.
+static void* allocate_block(size_t size)
+{
+	int size_class = pool_size_class(size);
+	while (vm.pool.available[size_class] == NULL && vm.pool.unswept[size_class] != NULL) {
+		sweep_unswept(vm.pool.unswept[size_class]);
+	}
+	settle_finalizers();
+	return pool_alloc(&vm.pool, size);
+}
+
+// Moves [pointer] to a block of [new_size], returning NULL and leaving it as
+// it is if there is no memory for that.
+static void* resize_block(void* pointer, size_t old_size, size_t new_size)
+{
+	if (!pool_fits(old_size) && !pool_fits(new_size)) {
+		return reallocate_untracked(pointer, new_size);
+	}
+
+	// A pooled block can stay where it is while the size stays in its class.
+	// Otherwise it moves, between the pool and the allocator if need be.
+	if (pointer != NULL && pool_fits(old_size) && pool_fits(new_size) &&
+		pool_size_class(old_size) == pool_size_class(new_size)) {
+		return pointer;
+	}
+
+	void* result = pool_fits(new_size) ? allocate_block(new_size) : reallocate_untracked(NULL, new_size);
+	if (result == NULL) {
+		return NULL;
+	}
+
+	if (pointer != NULL)
+	{
+		memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+		if (pool_fits(old_size)) {
+			pool_free(&vm.pool, pointer, old_size);
+		} else {
+			reallocate_untracked(pointer, 0);
+		}
+	}
+	return result;
+}
 
 void* reallocate(void* pointer, size_t old_size, size_t new_size)
 {
@@ -18,32 +98,221 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size)
 
 	if (new_size > old_size)
 	{
+		vm.nursery_bytes += new_size - old_size;
+		vm.gc_stats.bytes_allocated += new_size - old_size;
+
 #ifdef DEBUG_STRESS_GC
-		collect_garbage();
+		if (can_collect_young()) {
+			collect_young();
+		}
 #endif
-		if (vm.bytes_allocated > vm.next_gc) {
-			collect_garbage();
+		if (vm.gc_state != GC_IDLE)
+		{
+			vm.gc_debt += new_size - old_size;
+			if (vm.gc_debt > GC_SLICE_BYTES)
+			{
+				vm.gc_debt = 0;
+				// Finish at once rather than let the heap grow without bound
+				// if allocation keeps outrunning the slices.
+				if (vm.bytes_allocated > vm.next_gc * vm.gc_growth) {
+					gc_step(0);
+				} else {
+					gc_step(clock() + (clock_t)vm.config.gc_slice_budget_us * CLOCKS_PER_SEC / 1000000);
+				}
+			}
+		}
+		else if (vm.bytes_allocated > vm.next_gc)
+		{
+			vm.gc_state = GC_SWEEPING;
+			vm.gc_debt = 0;
+			if (!vm.config.incremental_gc) {
+				gc_step(0);
+			}
 		}
+
+		if (can_collect_young() && vm.nursery_bytes > GC_NURSERY_SIZE) {
+			collect_young();
+		}
+
+		// Past the limit, every last bit of garbage is freed. If that is not
+		// enough, the error is left for the interpreter to raise, since the
+		// caller has no way to fail.
+		if (vm.config.gc_heap_limit != 0 && vm.bytes_allocated > vm.config.gc_heap_limit &&
+			!vm.out_of_memory)
+		{
+			collect_everything();
+			vm.out_of_memory = vm.bytes_allocated > vm.config.gc_heap_limit;
+		}
+		settle_finalizers();
+	}
+	else
+	{
+		vm.gc_stats.bytes_freed += old_size - new_size;
 	}
 
-	if (new_size == 0) {
-		free(pointer);
+	if (new_size == 0)
+	{
+		if (pointer != NULL && pool_fits(old_size)) {
+			pool_free(&vm.pool, pointer, old_size);
+		} else if (pointer != NULL) {
+			reallocate_untracked(pointer, 0);
+		}
 		return NULL;
 	}
 
-	void* result = realloc(pointer, new_size);
+	void* result = resize_block(pointer, old_size, new_size);
+	if (result == NULL && new_size > old_size)
+	{
+		// The system is out of memory, but there may be garbage to give back.
+		collect_everything();
+		result = resize_block(pointer, old_size, new_size);
+	}
 	if (result == NULL) {
 		exit(1);
 	}
 	return result;
 }
 
+void register_object(Obj* object, size_t size)
+{
+	vm.gc_stats.types[object->type].count++;
+	vm.gc_stats.types[object->type].bytes += size;
+
+	if (!pool_fits(size))
+	{
+		object->is_large = true;
+		object->next = vm.large_objects;
+		vm.large_objects = object;
+		return;
+	}
+
+	object->is_large = false;
+	PoolPage* page = pool_page_of(object);
+	pool_set_bit(page->objects, pool_granule_of(page, object));
+	if (page->young) {
+		return;
+	}
+
+	if (vm.young_page_capacity < vm.young_page_count + 1)
+	{
+		vm.young_page_capacity = GROW_CAPACITY(vm.young_page_capacity);
+		vm.young_pages = reallocate_untracked(vm.young_pages, sizeof(PoolPage*) * vm.young_page_capacity);
+
+		if (vm.young_pages == NULL) {
+			exit(1);
+		}
+	}
+
+	page->young = true;
+	vm.young_pages[vm.young_page_count++] = page;
+}
+
+#if VES_PARALLEL_GC
+// The gray stack of a helper thread. The VM's own thread marks onto vm.gray.
+static VES_THREAD_LOCAL GrayStack* helper_gray = NULL;
+
+// Marks [page] as in the current epoch, clearing its stale marks first. Only
+// one of the threads that find it stale gets to clear them, and the others
+// wait until it has.
+static void claim_page(PoolPage* page)
+{
+	uint32_t epoch = __atomic_load_n(&page->mark_epoch, __ATOMIC_ACQUIRE);
+	while (epoch != vm.pool.mark_epoch)
+	{
+		if (epoch != EPOCH_CLEARING &&
+			__atomic_compare_exchange_n(&page->mark_epoch, &epoch, EPOCH_CLEARING,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			memset(page->marks, 0, sizeof(page->marks));
+			__atomic_store_n(&page->mark_epoch, vm.pool.mark_epoch, __ATOMIC_RELEASE);
+			return;
+		}
+		epoch = __atomic_load_n(&page->mark_epoch, __ATOMIC_ACQUIRE);
+	}
+}
+
+// set_mark() for when several threads are marking.
+static bool set_mark_atomic(Obj* object)
+{
+	if (object->is_large) {
+		return !__atomic_exchange_n(&object->is_marked, true, __ATOMIC_RELAXED);
+	}
+
+	PoolPage* page = pool_page_of(object);
+	claim_page(page);
+
+	int index = pool_granule_of(page, object);
+	uint64_t bit = (uint64_t)1 << (index % 64);
+	return (__atomic_fetch_or(&page->marks[index / 64], bit, __ATOMIC_RELAXED) & bit) == 0;
+}
+#endif
+
+// Marks [object], returning false if it already was. A page whose bitmap is
+// left from an earlier collection starts over with a clear one.
+static inline bool set_mark(Obj* object)
+{
+#if VES_PARALLEL_GC
+	if (vm.parallel_marking) {
+		return set_mark_atomic(object);
+	}
+#endif
+
+	if (object->is_large)
+	{
+		if (object->is_marked) {
+			return false;
+		}
+		object->is_marked = true;
+		return true;
+	}
+
+	PoolPage* page = pool_page_of(object);
+	if (page->mark_epoch != vm.pool.mark_epoch)
+	{
+		memset(page->marks, 0, sizeof(page->marks));
+		page->mark_epoch = vm.pool.mark_epoch;
+	}
+
+	int index = pool_granule_of(page, object);
+	if (pool_bit(page->marks, index)) {
+		return false;
+	}
+	pool_set_bit(page->marks, index);
+	return true;
+}
+
+static void push_gray(GrayStack* stack, Obj* object)
+{
+	if (stack->capacity < stack->count + 1)
+	{
+		stack->capacity = GROW_CAPACITY(stack->capacity);
+		stack->objects = reallocate_untracked(stack->objects, sizeof(Obj*) * stack->capacity);
+
+		if (stack->objects == NULL) {
+			exit(1);
+		}
+	}
+
+	stack->objects[stack->count++] = object;
+}
+
+static void gray_object(Obj* object)
+{
+#if VES_PARALLEL_GC
+	if (helper_gray != NULL) {
+		push_gray(helper_gray, object);
+		return;
+	}
+#endif
+	push_gray(&vm.gray, object);
+}
+
 void mark_object(Obj* object)
 {
 	if (object == NULL) {
 		return;
 	}
-	if (object->is_marked) {
+	if (!set_mark(object)) {
 		return;
 	}
 
@@ -53,19 +322,39 @@ void mark_object(Obj* object)
 	printf("\n");
 #endif
 
-	object->is_marked = true;
+	gray_object(object);
+}
+
+static void remember_object(Obj* object)
+{
+	if (object->is_remembered) {
+		return;
+	}
+	object->is_remembered = true;
 
-	if (vm.gray_capacity < vm.gray_count + 1)
+	if (vm.remembered_capacity < vm.remembered_count + 1)
 	{
-		vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-		vm.gray_stack = realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+		vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+		vm.remembered = reallocate_untracked(vm.remembered, sizeof(Obj*) * vm.remembered_capacity);
 
-		if (vm.gray_stack == NULL) {
+		if (vm.remembered == NULL) {
 			exit(1);
 		}
 	}
 
-	vm.gray_stack[vm.gray_count++] = object;
+	vm.remembered[vm.remembered_count++] = object;
+}
+
+void write_barrier_slow(Obj* object, Obj* value)
+{
+	if (vm.gc_state != GC_MARKING) {
+		remember_object(object);
+	} else if (value != NULL) {
+		mark_object(value);
+	} else {
+		// Trace it again along with whatever it now refers to.
+		gray_object(object);
+	}
 }
 
 void mark_value(Value value)
@@ -106,7 +395,9 @@ static void blacken_object(Obj* object)
 		mark_object((Obj*)klass->obj.class_obj);
 		mark_object((Obj*)klass->superclass);
 		mark_object((Obj*)klass->name);
-		mark_table(&klass->methods);
+		for (int i = 0; i < klass->methods.count; i++) {
+			mark_object((Obj*)klass->methods.data[i]);
+		}
 		break;
 	}
 	case OBJ_CLOSURE:
@@ -130,7 +421,18 @@ static void blacken_object(Obj* object)
 	{
 		ObjFunction* function = (ObjFunction*)object;
 		mark_object((Obj*)function->name);
+		mark_object((Obj*)function->lazy_source);
 		mark_array(&function->chunk.constants);
+		// Cached receivers stay alive with the call site so a freed class can
+		// never alias a new one at the same address.
+		for (int i = 0; i < function->chunk.cache_count; i++)
+		{
+			InlineCache* cache = &function->chunk.caches[i];
+			for (int j = 0; j < cache->count; j++) {
+				mark_object((Obj*)cache->classes[j]);
+				mark_object((Obj*)cache->methods[j]);
+			}
+		}
 		break;
 	}
 	case OBJ_FOREIGN:
@@ -139,7 +441,13 @@ static void blacken_object(Obj* object)
 	{
 		ObjInstance* instance = (ObjInstance*)object;
 		mark_object((Obj*)instance->klass);
-		mark_table(&instance->fields);
+		mark_object((Obj*)instance->shape);
+		for (int i = 0; i < instance->shape->num_fields; i++) {
+			mark_value(*instance_field(instance, i));
+		}
+		if (instance->dictionary != NULL) {
+			mark_table(instance->dictionary);
+		}
 		break;
 	}
 	case OBJ_NATIVE:
@@ -147,8 +455,15 @@ static void blacken_object(Obj* object)
 	case OBJ_STRING:
 		break;
 	case OBJ_UPVALUE:
-		mark_value(((ObjUpvalue*)object)->closed);
+	{
+		ObjUpvalue* upvalue = (ObjUpvalue*)object;
+		mark_value(upvalue->closed);
+		// An open upvalue points into its fiber's stack, which must outlive it.
+		if (upvalue->location != &upvalue->closed) {
+			mark_object((Obj*)upvalue->fiber);
+		}
 		break;
+	}
 	case OBJ_MODULE:
 	{
 		ObjModule* module = (ObjModule*)object;
@@ -177,17 +492,77 @@ static void blacken_object(Obj* object)
 		break;
 	case OBJ_RANGE:
 		break;
+	case OBJ_SHAPE:
+	{
+		ObjShape* shape = (ObjShape*)object;
+		mark_object((Obj*)shape->parent);
+		if (shape->num_fields > 0) {
+			mark_object((Obj*)shape->names[shape->num_fields - 1]);
+		}
+		mark_table(&shape->transitions);
+	}
+		break;
+	case OBJ_FIBER:
+	{
+		ObjFiber* fiber = (ObjFiber*)object;
+		mark_object((Obj*)fiber->closure);
+		mark_object((Obj*)fiber->caller);
+
+		// The running fiber's stacks are loaded into the VM and marked as roots.
+		if (fiber == vm.fiber) {
+			break;
+		}
+		for (Value* slot = fiber->stack; slot < fiber->stack_top; slot++) {
+			mark_value(*slot);
+		}
+		for (int i = 0; i < fiber->frame_count; i++) {
+			mark_object((Obj*)fiber->frames[i].closure);
+		}
+		for (ObjUpvalue* upvalue = fiber->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+			mark_object((Obj*)upvalue);
+		}
+	}
+		break;
 	default:
 		ASSERT(0, "unknown obj type.");
 	}
 }
 
+// The bytes [object] takes itself, as register_object() was told.
+static size_t object_size(Obj* object)
+{
+	switch (object->type)
+	{
+	case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+	case OBJ_CLASS: return sizeof(ObjClass);
+	case OBJ_CLOSURE: return sizeof(ObjClosure);
+	case OBJ_METHOD: return sizeof(ObjMethod);
+	case OBJ_FUNCTION: return sizeof(ObjFunction);
+	case OBJ_FOREIGN: return sizeof(ObjForeign) + ((ObjForeign*)object)->size;
+	case OBJ_INSTANCE: return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)object)->num_inline;
+	case OBJ_NATIVE: return sizeof(ObjNative);
+	case OBJ_STRING: return sizeof(ObjString);
+	case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+	case OBJ_MODULE: return sizeof(ObjModule);
+	case OBJ_LIST: return sizeof(ObjList);
+	case OBJ_MAP: return sizeof(ObjMap);
+	case OBJ_SET: return sizeof(ObjSet);
+	case OBJ_RANGE: return sizeof(ObjRange);
+	case OBJ_SHAPE: return sizeof(ObjShape);
+	case OBJ_FIBER: return sizeof(ObjFiber);
+	}
+	return 0;
+}
+
 static void free_object(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
+	vm.gc_stats.types[object->type].count--;
+	vm.gc_stats.types[object->type].bytes -= object_size(object);
+
 	switch (object->type)
 	{
 	case OBJ_BOUND_METHOD:
@@ -196,7 +571,7 @@ static void free_object(Obj* object)
 	case OBJ_CLASS:
 	{
 		ObjClass* klass = (ObjClass*)object;
-		free_table(&klass->methods);
+		MethodBufferClear(&klass->methods);
 		FREE(ObjClass, object);
 		break;
 	}
@@ -219,15 +594,20 @@ static void free_object(Obj* object)
 	}
 	case OBJ_FOREIGN:
 	{
-		int size = FinalizeForeign((ObjForeign*)object);
-		reallocate(object, sizeof(ObjForeign) + size, 0);
+		// Finalized already, see discard_object().
+		ObjForeign* foreign = (ObjForeign*)object;
+		reallocate(object, sizeof(ObjForeign) + foreign->size, 0);
 	}
 		break;
 	case OBJ_INSTANCE:
 	{
 		ObjInstance* instance = (ObjInstance*)object;
-		free_table(&instance->fields);
-		FREE(ObjInstance, object);
+		FREE_ARRAY(Value, instance->overflow, instance->overflow_capacity);
+		if (instance->dictionary != NULL) {
+			free_table(instance->dictionary);
+			FREE(Table, instance->dictionary);
+		}
+		reallocate(object, sizeof(ObjInstance) + sizeof(Value) * instance->num_inline, 0);
 		break;
 	}
 	case OBJ_NATIVE:
@@ -275,6 +655,22 @@ static void free_object(Obj* object)
 	case OBJ_RANGE:
 		FREE(ObjRange, object);
 		break;
+	case OBJ_SHAPE:
+	{
+		ObjShape* shape = (ObjShape*)object;
+		FREE_ARRAY(ObjString*, shape->names, shape->num_fields);
+		free_table(&shape->transitions);
+		FREE(ObjShape, object);
+		break;
+	}
+	case OBJ_FIBER:
+	{
+		ObjFiber* fiber = (ObjFiber*)object;
+		reallocate_untracked(fiber->frames, 0);
+		reallocate_untracked(fiber->stack, 0);
+		FREE(ObjFiber, object);
+		break;
+	}
 	default:
 		ASSERT(0, "unknown obj type.");
 	}
@@ -304,66 +700,817 @@ static void mark_roots()
 	}
 
 	mark_table(&vm.modules);
+	mark_object((Obj*)vm.fiber);
+	mark_object((Obj*)vm.main_fiber);
+	mark_object((Obj*)vm.next_fiber);
+	mark_value(vm.fiber_value);
+	mark_array(&vm.held_fibers);
 	mark_compiler_roots();
 	mark_object((Obj*)vm.init_str);
 	mark_object((Obj*)vm.allocate_str);
 	mark_object((Obj*)vm.finalize_str);
 	mark_array(&vm.method_names);
+	mark_table(&vm.method_symbols);
+	mark_object((Obj*)vm.empty_shape);
 }
 
 static void trace_references()
 {
-	while (vm.gray_count > 0) {
-		Obj* object = vm.gray_stack[--vm.gray_count];
+	while (vm.gray.count > 0) {
+		Obj* object = vm.gray.objects[--vm.gray.count];
 		blacken_object(object);
 	}
 }
 
-static void sweep()
+#if VES_PARALLEL_GC
+
+// Objects a marking thread traces between looking for idle ones to share with.
+#define SHARE_INTERVAL 64
+
+// The most shared objects an idle thread takes at a time.
+#define SHARE_BATCH 256
+
+struct GCHelpers
 {
-	Obj* previous = NULL;
-	Obj* object = vm.objects;
-	while (object != NULL)
+	VM* owner;
+	pthread_t* threads;
+	// Threads started, and asked for, which differ if starting some failed.
+	int count;
+	int requested;
+
+	pthread_mutex_t lock;
+	// Signalled when a marking starts or the helpers are to stop.
+	pthread_cond_t start;
+	// Signalled when objects are shared or the marking is done.
+	pthread_cond_t work;
+	// Signalled when a helper is done with a marking.
+	pthread_cond_t finished;
+
+	// Counts the markings, so a woken helper can tell a new one started.
+	unsigned int marking;
+	bool stopping;
+
+	// Gray objects busy threads handed over for idle ones to take.
+	GrayStack shared;
+	// The threads taking part in the marking, and those out of work.
+	int markers;
+	int idle;
+	bool done;
+	int helpers_done;
+};
+
+// Hands the bottom half of [stack] over to the idle threads. Those objects
+// were grayed first, so they tend to lead to the most work.
+static void share_work(GCHelpers* helpers, GrayStack* stack)
+{
+	int half = stack->count / 2;
+
+	pthread_mutex_lock(&helpers->lock);
+	for (int i = 0; i < half; i++) {
+		push_gray(&helpers->shared, stack->objects[i]);
+	}
+	pthread_cond_broadcast(&helpers->work);
+	pthread_mutex_unlock(&helpers->lock);
+
+	stack->count -= half;
+	memmove(stack->objects, stack->objects + half, sizeof(Obj*) * stack->count);
+}
+
+// Refills the empty [stack] from the shared objects, waiting for some if there
+// are none. Returns false once every thread is out of work, which ends the
+// marking.
+static bool take_work(GCHelpers* helpers, GrayStack* stack)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&helpers->lock);
+	for (;;)
 	{
-		if (object->is_marked)
+		if (helpers->shared.count > 0)
 		{
-			//> unmark
-			object->is_marked = false;
-			//< unmark
-			previous = object;
-			object = object->next;
+			for (int i = 0; i < SHARE_BATCH && helpers->shared.count > 0; i++) {
+				push_gray(stack, helpers->shared.objects[--helpers->shared.count]);
+			}
+			found = true;
+			break;
+		}
+		if (helpers->done) {
+			break;
 		}
-		else
+
+		if (__atomic_add_fetch(&helpers->idle, 1, __ATOMIC_SEQ_CST) == helpers->markers)
 		{
-			Obj* unreached = object;
+			helpers->done = true;
+			pthread_cond_broadcast(&helpers->work);
+			break;
+		}
+		pthread_cond_wait(&helpers->work, &helpers->lock);
+		__atomic_sub_fetch(&helpers->idle, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&helpers->lock);
+
+	return found;
+}
 
-			object = object->next;
-			if (previous != NULL) {
-				previous->next = object;
+// Traces from [stack] until no thread has anything left to trace, sharing
+// with whichever threads run out first.
+static void mark_along(GCHelpers* helpers, GrayStack* stack)
+{
+	do
+	{
+		int work = 0;
+		while (stack->count > 0)
+		{
+			blacken_object(stack->objects[--stack->count]);
+			if (++work % SHARE_INTERVAL == 0 && stack->count > 1 &&
+				__atomic_load_n(&helpers->idle, __ATOMIC_RELAXED) > 0) {
+				share_work(helpers, stack);
 			}
-			else {
-				vm.objects = object;
+		}
+	} while (take_work(helpers, stack));
+}
+
+static void* helper_main(void* arg)
+{
+	GCHelpers* helpers = (GCHelpers*)arg;
+	current_vm = helpers->owner;
+
+	GrayStack stack = { 0, 0, NULL };
+	helper_gray = &stack;
+
+	unsigned int seen = 0;
+	pthread_mutex_lock(&helpers->lock);
+	for (;;)
+	{
+		while (helpers->marking == seen && !helpers->stopping) {
+			pthread_cond_wait(&helpers->start, &helpers->lock);
+		}
+		if (helpers->stopping) {
+			break;
+		}
+		seen = helpers->marking;
+		pthread_mutex_unlock(&helpers->lock);
+
+		mark_along(helpers, &stack);
+
+		pthread_mutex_lock(&helpers->lock);
+		helpers->helpers_done++;
+		pthread_cond_signal(&helpers->finished);
+	}
+	pthread_mutex_unlock(&helpers->lock);
+
+	reallocate_untracked(stack.objects, 0);
+	return NULL;
+}
+
+static GCHelpers* start_helpers(int count)
+{
+	GCHelpers* helpers = (GCHelpers*)reallocate_untracked(NULL, sizeof(GCHelpers));
+	if (helpers == NULL) {
+		exit(1);
+	}
+	memset(helpers, 0, sizeof(GCHelpers));
+	helpers->threads = (pthread_t*)reallocate_untracked(NULL, sizeof(pthread_t) * count);
+	if (helpers->threads == NULL) {
+		exit(1);
+	}
+
+	helpers->owner = current_vm;
+	helpers->requested = count;
+	pthread_mutex_init(&helpers->lock, NULL);
+	pthread_cond_init(&helpers->start, NULL);
+	pthread_cond_init(&helpers->work, NULL);
+	pthread_cond_init(&helpers->finished, NULL);
+
+	// Any that fail to start are simply done without.
+	for (int i = 0; i < count; i++)
+	{
+		if (pthread_create(&helpers->threads[helpers->count], NULL, helper_main, helpers) == 0) {
+			helpers->count++;
+		}
+	}
+	return helpers;
+}
+
+static void stop_helpers()
+{
+	GCHelpers* helpers = vm.gc_helpers;
+	if (helpers == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&helpers->lock);
+	helpers->stopping = true;
+	pthread_cond_broadcast(&helpers->start);
+	pthread_mutex_unlock(&helpers->lock);
+
+	for (int i = 0; i < helpers->count; i++) {
+		pthread_join(helpers->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&helpers->lock);
+	pthread_cond_destroy(&helpers->start);
+	pthread_cond_destroy(&helpers->work);
+	pthread_cond_destroy(&helpers->finished);
+	reallocate_untracked(helpers->shared.objects, 0);
+	reallocate_untracked(helpers->threads, 0);
+	reallocate_untracked(helpers, 0);
+	vm.gc_helpers = NULL;
+}
+
+// Traces from the gray objects on the helper threads as well as this one. The
+// mutator is stopped meanwhile, so only the mark bits and the shared objects
+// are contended.
+static void trace_in_parallel()
+{
+	if (vm.gc_helpers != NULL && vm.gc_helpers->requested != vm.config.gc_threads) {
+		stop_helpers();
+	}
+	if (vm.gc_helpers == NULL) {
+		vm.gc_helpers = start_helpers(vm.config.gc_threads);
+	}
+	GCHelpers* helpers = vm.gc_helpers;
+
+	pthread_mutex_lock(&helpers->lock);
+	helpers->markers = helpers->count + 1;
+	helpers->idle = 0;
+	helpers->done = false;
+	helpers->helpers_done = 0;
+	vm.parallel_marking = true;
+	helpers->marking++;
+	pthread_cond_broadcast(&helpers->start);
+	pthread_mutex_unlock(&helpers->lock);
+
+	mark_along(helpers, &vm.gray);
+
+	pthread_mutex_lock(&helpers->lock);
+	while (helpers->helpers_done < helpers->count) {
+		pthread_cond_wait(&helpers->finished, &helpers->lock);
+	}
+	vm.parallel_marking = false;
+	pthread_mutex_unlock(&helpers->lock);
+}
+
+#endif
+
+// Traces everything reachable from the gray objects in one go, on the helper
+// threads too if there are any.
+static void trace_heap()
+{
+#if VES_PARALLEL_GC
+	if (vm.config.gc_threads > 0) {
+		trace_in_parallel();
+		return;
+	}
+	stop_helpers();
+#endif
+	trace_references();
+}
+
+static void free_list(Obj* object)
+{
+	while (object != NULL) {
+		Obj* next = object->next;
+		free_object(object);
+		object = next;
+	}
+}
+
+static void finalize_list(Obj* object)
+{
+	for (; object != NULL; object = object->next) {
+		ObjForeign* foreign = (ObjForeign*)object;
+		foreign->finalize(foreign->data);
+	}
+}
+
+// Frees a dead [object], unless it is a foreign one with a finalizer to run
+// first. That one is queued for the next batch, keeping its memory until then.
+// Nothing else refers to it, so Obj.next is free to link the queue.
+static void discard_object(Obj* object)
+{
+	if (object->type == OBJ_FOREIGN && ((ObjForeign*)object)->finalize != NULL)
+	{
+		object->next = vm.finalize_queue;
+		vm.finalize_queue = object;
+		return;
+	}
+	free_object(object);
+}
+
+void run_finalizers()
+{
+	Obj* queue = vm.finalize_queue;
+	vm.finalize_queue = NULL;
+	finalize_list(queue);
+	free_list(queue);
+}
+
+#if VES_PARALLEL_GC
+
+struct FinalizerThread
+{
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	// Objects handed over to be finalized, and those finalized since, which
+	// the VM's thread frees.
+	Obj* pending;
+	Obj* done;
+	bool stopping;
+};
+
+// Prepends the whole of [list] to [*to].
+static void splice_list(Obj** to, Obj* list)
+{
+	if (list == NULL) {
+		return;
+	}
+	Obj* last = list;
+	while (last->next != NULL) {
+		last = last->next;
+	}
+	last->next = *to;
+	*to = list;
+}
+
+static void* finalizer_main(void* arg)
+{
+	FinalizerThread* finalizer = (FinalizerThread*)arg;
+
+	pthread_mutex_lock(&finalizer->lock);
+	for (;;)
+	{
+		while (finalizer->pending == NULL && !finalizer->stopping) {
+			pthread_cond_wait(&finalizer->work, &finalizer->lock);
+		}
+		// Whatever is pending is finalized before stopping.
+		if (finalizer->pending == NULL) {
+			break;
+		}
+		Obj* batch = finalizer->pending;
+		finalizer->pending = NULL;
+		pthread_mutex_unlock(&finalizer->lock);
+
+		finalize_list(batch);
+
+		pthread_mutex_lock(&finalizer->lock);
+		Obj* done = finalizer->done;
+		splice_list(&done, batch);
+		__atomic_store_n(&finalizer->done, done, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&finalizer->lock);
+	return NULL;
+}
+
+static FinalizerThread* start_finalizer()
+{
+	FinalizerThread* finalizer = (FinalizerThread*)reallocate_untracked(NULL, sizeof(FinalizerThread));
+	if (finalizer == NULL) {
+		exit(1);
+	}
+	memset(finalizer, 0, sizeof(FinalizerThread));
+	pthread_mutex_init(&finalizer->lock, NULL);
+	pthread_cond_init(&finalizer->work, NULL);
+
+	if (pthread_create(&finalizer->thread, NULL, finalizer_main, finalizer) != 0)
+	{
+		pthread_mutex_destroy(&finalizer->lock);
+		pthread_cond_destroy(&finalizer->work);
+		reallocate_untracked(finalizer, 0);
+		return NULL;
+	}
+	return finalizer;
+}
+
+// Stops the finalizer thread once it has finalized what it was given, and
+// frees all of that.
+static void stop_finalizer()
+{
+	FinalizerThread* finalizer = vm.finalizer;
+	if (finalizer == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&finalizer->lock);
+	finalizer->stopping = true;
+	pthread_cond_signal(&finalizer->work);
+	pthread_mutex_unlock(&finalizer->lock);
+	pthread_join(finalizer->thread, NULL);
+
+	free_list(finalizer->done);
+	pthread_mutex_destroy(&finalizer->lock);
+	pthread_cond_destroy(&finalizer->work);
+	reallocate_untracked(finalizer, 0);
+	vm.finalizer = NULL;
+}
+
+// Hands the queue to the finalizer thread, and frees what it has finalized.
+static void finalize_on_thread()
+{
+	if (vm.finalizer == NULL)
+	{
+		vm.finalizer = start_finalizer();
+		if (vm.finalizer == NULL) {
+			run_finalizers();
+			return;
+		}
+	}
+	FinalizerThread* finalizer = vm.finalizer;
+
+	if (vm.finalize_queue == NULL && __atomic_load_n(&finalizer->done, __ATOMIC_ACQUIRE) == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&finalizer->lock);
+	if (vm.finalize_queue != NULL)
+	{
+		splice_list(&finalizer->pending, vm.finalize_queue);
+		vm.finalize_queue = NULL;
+		pthread_cond_signal(&finalizer->work);
+	}
+	Obj* done = finalizer->done;
+	finalizer->done = NULL;
+	pthread_mutex_unlock(&finalizer->lock);
+
+	free_list(done);
+}
+
+#endif
+
+// Finalizes the queued objects as configured, once the collection work that
+// queued them is done.
+static void settle_finalizers()
+{
+	if (vm.finalize_queue == NULL && vm.finalizer == NULL) {
+		return;
+	}
+
+#if VES_PARALLEL_GC
+	if (vm.config.finalize_mode == VES_FINALIZE_ON_THREAD) {
+		finalize_on_thread();
+		return;
+	}
+	stop_finalizer();
+#endif
+	if (vm.config.finalize_mode != VES_FINALIZE_ON_REQUEST) {
+		run_finalizers();
+	}
+}
+
+// Frees the unmarked objects in [list]. A young collection also unlinks the
+// dead strings from vm.strings, since only a full collection clears the whole
+// table.
+static void sweep(Obj** list, bool young)
+{
+	Obj** link = list;
+	while (*link != NULL)
+	{
+		Obj* object = *link;
+		if (object->is_marked)
+		{
+			link = &object->next;
+			continue;
+		}
+
+		*link = object->next;
+		if (young && object->type == OBJ_STRING) {
+			table_delete(&vm.strings, (ObjString*)object);
+		}
+		discard_object(object);
+	}
+}
+
+// Frees the objects in [page] that are not marked, going by its bitmaps alone,
+// so the survivors are never touched. The page may be released once it is
+// empty.
+static void sweep_page(PoolPage* page, bool young)
+{
+	pool_begin_sweep(&vm.pool, page);
+
+	// Marks left from before the last collection do not count, so nothing in a
+	// page it did not mark at all survived it.
+	bool stale = page->mark_epoch != vm.pool.mark_epoch;
+	for (int i = 0; i < POOL_BITMAP_WORDS; i++)
+	{
+		uint64_t dead = page->objects[i] & (stale ? ~(uint64_t)0 : ~page->marks[i]);
+		page->objects[i] &= ~dead;
+
+		for (int bit = 0; dead != 0; bit++, dead >>= 1)
+		{
+			if ((dead & 1) == 0) {
+				continue;
 			}
 
-			free_object(unreached);
+			Obj* object = (Obj*)((char*)page + (i * 64 + bit) * POOL_GRANULE);
+			if (young && object->type == OBJ_STRING) {
+				table_delete(&vm.strings, (ObjString*)object);
+			}
+			discard_object(object);
 		}
 	}
+
+	if (stale)
+	{
+		memset(page->marks, 0, sizeof(page->marks));
+		page->mark_epoch = vm.pool.mark_epoch;
+	}
+
+	pool_end_sweep(&vm.pool, page);
 }
 
-void collect_garbage()
+// Sets the heap size the next full collection starts at, kept between the
+// initial heap size and the limit.
+static void set_next_gc(size_t next_gc)
+{
+	if (next_gc < vm.config.gc_initial_heap) {
+		next_gc = vm.config.gc_initial_heap;
+	}
+	if (vm.config.gc_heap_limit != 0 && next_gc > vm.config.gc_heap_limit) {
+		next_gc = vm.config.gc_heap_limit;
+	}
+	vm.next_gc = next_gc;
+}
+
+// Sweeps a page the last full collection left unswept. What it frees was still
+// counted in the heap that collection paced the next one by, so the pace comes
+// down with it.
+static void sweep_unswept(PoolPage* page)
+{
+	size_t before = vm.bytes_allocated;
+	sweep_page(page, false);
+
+	size_t freed = (size_t)((before - vm.bytes_allocated) * vm.gc_growth);
+	set_next_gc(vm.next_gc > freed ? vm.next_gc - freed : 0);
+}
+
+static void forget_remembered()
+{
+	for (int i = 0; i < vm.remembered_count; i++) {
+		vm.remembered[i]->is_remembered = false;
+	}
+	vm.remembered_count = 0;
+}
+
+// Forgets which pages hold young objects, once they are young no longer.
+static void forget_young_pages()
+{
+	for (int i = 0; i < vm.young_page_count; i++) {
+		vm.young_pages[i]->young = false;
+	}
+	vm.young_page_count = 0;
+}
+
+static uint64_t now_us()
+{
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// Bracket collection work the program waits for. Work done within another
+// pause only adds to it.
+static void begin_pause(bool full)
+{
+	if (vm.gc_pause_depth++ > 0) {
+		return;
+	}
+	if (vm.config.gc_event_fn != NULL) {
+		vm.config.gc_event_fn(VES_GC_START, full);
+	}
+	vm.gc_pause_start = now_us();
+}
+
+static void end_pause(bool full)
+{
+	if (--vm.gc_pause_depth > 0) {
+		return;
+	}
+
+	uint64_t pause = now_us() - vm.gc_pause_start;
+	vm.gc_stats.pauses++;
+	vm.gc_stats.pause_total_us += pause;
+	if (pause > vm.gc_stats.pause_max_us) {
+		vm.gc_stats.pause_max_us = pause;
+	}
+
+	if (vm.config.gc_event_fn != NULL) {
+		vm.config.gc_event_fn(VES_GC_END, full);
+	}
+}
+
+// Collects only the objects allocated since the last collection. The old ones
+// are still marked, so marking stops at them, and those that were handed young
+// references are traced from the remembered set instead. Only the pages young
+// objects went to need sweeping.
+static void collect_young()
 {
 #ifdef DEBUG_LOG_GC
-	printf("-- gc begin\n");
+	printf("-- young gc begin\n");
 	size_t before = vm.bytes_allocated;
 #endif
+	begin_pause(false);
 
 	mark_gray_compiler();
 	mark_roots();
+	for (int i = 0; i < vm.remembered_count; i++) {
+		blacken_object(vm.remembered[i]);
+	}
 	trace_references();
+
+	for (int i = 0; i < vm.young_page_count; i++)
+	{
+		PoolPage* page = vm.young_pages[i];
+		page->young = false;
+		sweep_page(page, true);
+	}
+	vm.young_page_count = 0;
+	sweep(&vm.large_objects, true);
+	forget_remembered();
+
+	vm.nursery_bytes = 0;
+	vm.gc_stats.young_collections++;
+	end_pause(false);
+
+#ifdef DEBUG_LOG_GC
+	printf("-- young gc end\n");
+	printf("   collected %ld bytes (from %ld to %ld) next at %ld\n",
+		before - vm.bytes_allocated, before, vm.bytes_allocated,
+		vm.next_gc);
+#endif
+}
+
+// Moves the pool to the next epoch, which unmarks every page at once.
+static void next_epoch()
+{
+	vm.pool.mark_epoch++;
+	if (vm.pool.mark_epoch == EPOCH_CLEARING) {
+		vm.pool.mark_epoch = 0;
+	}
+}
+
+// Returns true once an incremental slice with [deadline] has used up its time,
+// checking the clock only every so often. A zero deadline never runs out.
+static inline bool out_of_time(int work, clock_t deadline)
+{
+	return deadline != 0 && work % GC_CLOCK_INTERVAL == 0 && clock() > deadline;
+}
+
+// Unmarks every object, the pooled ones all at once by moving the pool to the
+// next epoch and the few large ones one by one, and marks the roots. The
+// remembered set only matters to young collections, which are held off until
+// the marking is done.
+static void start_marking()
+{
+	ASSERT(vm.gc_state == GC_SWEEPING, "The last collection must be swept first.");
+
+	next_epoch();
+	for (Obj* object = vm.large_objects; object != NULL; object = object->next) {
+		object->is_marked = false;
+	}
+
+	forget_remembered();
+	mark_gray_compiler();
+	mark_roots();
+	vm.gc_state = GC_MARKING;
+}
+
+// Moves the growth factor within its range, so that collections take about the
+// share of the time the configuration asks for: up while the pauses since the
+// last full collection took more than that, down while they took less than
+// half of it.
+static void adapt_growth()
+{
+	uint64_t now = now_us();
+	// The pause this is part of counts toward the next cycle from here on.
+	uint64_t pause_so_far = vm.gc_pause_depth > 0 ? now - vm.gc_pause_start : 0;
+	uint64_t paused = vm.gc_stats.pause_total_us + pause_so_far - vm.gc_cycle_pause;
+	uint64_t elapsed = now - vm.gc_cycle_start;
+	bool measured = vm.gc_cycle_start != 0 && elapsed > 0;
+	vm.gc_cycle_start = now;
+	vm.gc_cycle_pause = vm.gc_stats.pause_total_us + pause_so_far;
+
+	double target = vm.config.gc_target_time_fraction;
+	if (target <= 0)
+	{
+		vm.gc_growth = vm.config.gc_min_growth;
+		return;
+	}
+	if (!measured) {
+		return;
+	}
+
+	double fraction = (double)paused / (double)elapsed;
+	if (fraction > target) {
+		vm.gc_growth *= GC_GROWTH_STEP;
+	} else if (fraction < target / 2) {
+		vm.gc_growth /= GC_GROWTH_STEP;
+	}
+
+	if (vm.gc_growth > vm.config.gc_max_growth) {
+		vm.gc_growth = vm.config.gc_max_growth;
+	} else if (vm.gc_growth < vm.config.gc_min_growth) {
+		vm.gc_growth = vm.config.gc_min_growth;
+	}
+}
+
+// Marking ends with the roots, which have no barriers, traced again in one
+// go. Everything still unmarked after that is garbage. The pages are left for
+// the allocator to sweep as it needs them, so until then the heap still counts
+// their dead objects.
+static void finish_marking()
+{
+	mark_gray_compiler();
+	mark_roots();
+	trace_heap();
 	table_remove_white(&vm.strings);
-	sweep();
 
-	vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+	sweep(&vm.large_objects, false);
+	forget_young_pages();
+	pool_unsweep_all(&vm.pool);
+
+	adapt_growth();
+	set_next_gc((size_t)(vm.bytes_allocated * vm.gc_growth));
+	vm.nursery_bytes = 0;
+	vm.gc_state = GC_IDLE;
+	vm.gc_stats.full_collections++;
+}
+
+static bool mark_step(clock_t deadline)
+{
+	if (deadline == 0) {
+		trace_heap();
+		return true;
+	}
+
+	int work = 0;
+	while (vm.gray.count > 0)
+	{
+		blacken_object(vm.gray.objects[--vm.gray.count]);
+		if (out_of_time(++work, deadline)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Sweeps whatever pages the allocator has not got to yet, one at a time.
+static bool sweep_step(clock_t deadline)
+{
+	for (int i = 0; i < POOL_NUM_CLASSES; i++)
+	{
+		while (vm.pool.unswept[i] != NULL)
+		{
+			sweep_unswept(vm.pool.unswept[i]);
+			if (deadline != 0 && clock() > deadline) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Advances the collection as far as it gets before [deadline].
+static void gc_step(clock_t deadline)
+{
+#ifdef DEBUG_LOG_GC
+	printf("-- gc slice in phase %d\n", vm.gc_state);
+#endif
+	begin_pause(true);
+
+	if (vm.gc_state == GC_SWEEPING && sweep_step(deadline))
+	{
+		// Sweeping alone may have brought the heap back under the limit.
+		if (vm.bytes_allocated > vm.next_gc) {
+			start_marking();
+		} else {
+			vm.gc_state = GC_IDLE;
+		}
+	}
+	if (vm.gc_state == GC_MARKING && mark_step(deadline)) {
+		finish_marking();
+	}
+	end_pause(true);
+}
+
+void collect_garbage()
+{
+#ifdef DEBUG_LOG_GC
+	printf("-- gc begin\n");
+	size_t before = vm.bytes_allocated;
+#endif
+
+	begin_pause(true);
+	// A collection already marking is simply finished.
+	if (vm.gc_state != GC_MARKING)
+	{
+		vm.gc_state = GC_SWEEPING;
+		sweep_step(0);
+		start_marking();
+	}
+	gc_step(0);
+	end_pause(true);
+	settle_finalizers();
 
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
@@ -373,14 +1520,45 @@ void collect_garbage()
 #endif
 }
 
+// Frees all the garbage there is right away, for when memory runs short. A
+// marking under way keeps what was allocated since it started, so it is
+// finished before a fresh one, and every page is swept at once.
+static void collect_everything()
+{
+	if (vm.gc_state == GC_MARKING) {
+		collect_garbage();
+	}
+	collect_garbage();
+	sweep_step(0);
+}
+
 void free_objects()
 {
-	Obj* object = vm.objects;
-	while (object != NULL) {
+	for (Obj* object = vm.large_objects; object != NULL; ) {
 		Obj* next = object->next;
-		free_object(object);
+		discard_object(object);
 		object = next;
 	}
+	vm.large_objects = NULL;
+
+	// In the next epoch nothing is marked, so sweeping every page frees all
+	// that is left in it.
+	next_epoch();
+	pool_unsweep_all(&vm.pool);
+	for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+		while (vm.pool.unswept[i] != NULL) {
+			sweep_page(vm.pool.unswept[i], false);
+		}
+	}
 
-	free(vm.gray_stack);
-}
\ No newline at end of file
+	// Every finalizer still due runs now, however they were configured.
+#if VES_PARALLEL_GC
+	stop_finalizer();
+	stop_helpers();
+#endif
+	run_finalizers();
+
+	reallocate_untracked(vm.gray.objects, 0);
+	reallocate_untracked(vm.remembered, 0);
+	reallocate_untracked(vm.young_pages, 0);
+}
@@ -2,7 +2,9 @@
 #define vessel_memory_h
 
 #include "common.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #include <stdint.h>
 
@@ -18,9 +20,62 @@
     reallocate(pointer, sizeof(type) * (old_count), 0)
 
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+
+// Hands the newly allocated [object] of [size] bytes over to the collector.
+void register_object(Obj* object, size_t size);
+
+// Pooled objects keep their mark bits to the side, in a bitmap of their page,
+// so neither marking nor sweeping has to write to them. Only large objects
+// have no page to keep the bit in.
+static inline bool is_marked(Obj* object)
+{
+	if (object->is_large) {
+		return object->is_marked;
+	}
+
+	PoolPage* page = pool_page_of(object);
+	return page->mark_epoch == vm.pool.mark_epoch &&
+		pool_bit(page->marks, pool_granule_of(page, object));
+}
+
 void mark_object(Obj* object);
 void mark_value(Value value);
 void collect_garbage();
 void free_objects();
 
+// Memory the collector does not count, such as its own stacks and the VM's,
+// from VesselConfiguration.reallocate_fn. A [new_size] of 0 frees [pointer].
+static inline void* reallocate_untracked(void* pointer, size_t new_size)
+{
+	return vm.config.reallocate_fn(pointer, new_size, vm.config.reallocate_user_data);
+}
+
+// Finalizes and frees the dead foreign objects queued so far.
+void run_finalizers();
+
+// The slow path of the write barriers, for a store into a marked [object] of
+// the unmarked [value], or of anything if [value] is NULL.
+void write_barrier_slow(Obj* object, Obj* value);
+
+// Objects that survived a collection stay marked until the next full one, and
+// a young collection only traces what is unmarked. An incremental collection
+// likewise never goes back to an object it already traced. So every store of
+// a reference into an object that may be marked must be followed by a barrier,
+// or the value could be freed while the object still refers to it.
+static inline void write_barrier(Obj* object, Value value)
+{
+	if (IS_OBJ(value) && is_marked(object) && !is_marked(AS_OBJ(value))) {
+		write_barrier_slow(object, AS_OBJ(value));
+	}
+}
+
+// The barrier for changes too many or too indirect to check one value at a
+// time, like a fiber's stack being switched out.
+static inline void write_barrier_object(Obj* object)
+{
+	if (is_marked(object)) {
+		write_barrier_slow(object, NULL);
+	}
+}
+
 #endif // vessel_memory_h
@@ -7,6 +7,9 @@
 #endif // STATISTICS
 
 #include <stdio.h>
+#include <stdlib.h>
+
+DEFINE_BUFFER(Method, ObjMethod*);
 
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocate_object(sizeof(type), objectType)
@@ -19,9 +22,9 @@ static Obj* allocate_object(size_t size, ObjType type)
 	Obj* object = (Obj*)reallocate(NULL, 0, size);
 	object->type = type;
 	object->is_marked = false;
+	object->is_remembered = false;
 	object->class_obj = NULL;
-	object->next = vm.objects;
-	vm.objects = object;
+	register_object(object, size);
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %ld for %d\n", (void*)object, size, type);
@@ -79,7 +82,8 @@ ObjClass* new_single_class(int num_fields, ObjString* name, ObjModule* module)
 	klass->module = module;
 	klass->name = name;
 	klass->num_fields = num_fields;
-	init_table(&klass->methods);
+	klass->finalize = NULL;
+	MethodBufferInit(&klass->methods);
 	return klass;
 }
 
@@ -118,9 +122,14 @@ ObjFunction* new_function(ObjModule* module)
 
 	function->arity = 0;
 	function->upvalue_count = 0;
+	function->max_slots = 0;
 	function->name = NULL;
 	init_chunk(&function->chunk);
 	function->module = module;
+	function->lazy_source = NULL;
+	function->lazy_offset = 0;
+	function->lazy_line = 0;
+	function->lazy_type = 0;
 
 #ifdef STATISTICS
 	function->call_times = 0;
@@ -135,18 +144,171 @@ ObjForeign* new_foreign(size_t size, ObjClass* klass)
 {
 	ObjForeign* foreign = ALLOCATE_FLEX(ObjForeign, OBJ_FOREIGN, uint8_t, size);
 	foreign->obj.class_obj = klass;
+	foreign->size = size;
+	foreign->finalize = klass->finalize;
 	memset(foreign->data, 0, size);
 	return foreign;
 }
 
 ObjInstance* new_instance(ObjClass* klass)
 {
-	ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+	int num_inline = klass->num_fields > 0 ? klass->num_fields : 0;
+	ObjInstance* instance = ALLOCATE_FLEX(ObjInstance, OBJ_INSTANCE, Value, num_inline);
 	instance->klass = klass;
-	init_table(&instance->fields);
+	instance->shape = vm.empty_shape;
+	instance->overflow = NULL;
+	instance->overflow_capacity = 0;
+	instance->num_inline = num_inline;
+	instance->dictionary = NULL;
 	return instance;
 }
 
+ObjShape* new_shape(ObjShape* parent, ObjString* name)
+{
+	int num_fields = parent != NULL ? parent->num_fields + 1 : 0;
+	ObjString** names = ALLOCATE(ObjString*, num_fields);
+	for (int i = 0; i < num_fields - 1; i++) {
+		names[i] = parent->names[i];
+	}
+	if (num_fields > 0) {
+		names[num_fields - 1] = name;
+	}
+
+	ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+	shape->parent = parent;
+	shape->names = names;
+	shape->num_fields = num_fields;
+	init_table(&shape->transitions);
+	return shape;
+}
+
+ObjShape* shape_add_field(ObjShape* shape, ObjString* name)
+{
+	Value transition;
+	if (table_get(&shape->transitions, name, &transition)) {
+		return AS_SHAPE(transition);
+	}
+	if (shape->num_fields == MAX_SHAPE_FIELDS ||
+		shape->transitions.count == MAX_SHAPE_TRANSITIONS) {
+		return NULL;
+	}
+
+	push_root((Obj*)name);
+	ObjShape* child = new_shape(shape, name);
+	push_root((Obj*)child);
+	table_set(&shape->transitions, name, OBJ_VAL(child));
+	write_barrier((Obj*)shape, OBJ_VAL(name));
+	write_barrier((Obj*)shape, OBJ_VAL(child));
+	pop_root();
+	pop_root();
+
+	return child;
+}
+
+// Moves the fields of [instance] out of its slots into a table of its own.
+static void make_dictionary(ObjInstance* instance)
+{
+	Table* dictionary = ALLOCATE(Table, 1);
+	init_table(dictionary);
+	instance->dictionary = dictionary;
+
+	// The shape keeps describing the slots until they are all copied, since
+	// growing the table may collect.
+	ObjShape* shape = instance->shape;
+	for (int i = 0; i < shape->num_fields; i++)
+	{
+		Value value = *instance_field(instance, i);
+		table_set(dictionary, shape->names[i], value);
+		write_barrier((Obj*)instance, OBJ_VAL(shape->names[i]));
+		write_barrier((Obj*)instance, value);
+	}
+
+	FREE_ARRAY(Value, instance->overflow, instance->overflow_capacity);
+	instance->overflow = NULL;
+	instance->overflow_capacity = 0;
+	instance->shape = vm.empty_shape;
+}
+
+bool instance_get_field(ObjInstance* instance, ObjString* name, Value* value)
+{
+	if (instance->dictionary != NULL) {
+		return table_get(instance->dictionary, name, value);
+	}
+
+	int slot = shape_find_field(instance->shape, name);
+	if (slot == -1) {
+		return false;
+	}
+
+	*value = *instance_field(instance, slot);
+	return true;
+}
+
+bool instance_set_field(ObjInstance* instance, ObjString* name, Value value)
+{
+	int slot = -1;
+	if (instance->dictionary == NULL) {
+		slot = shape_find_field(instance->shape, name);
+	}
+	if (slot != -1) {
+		*instance_field(instance, slot) = value;
+		write_barrier((Obj*)instance, value);
+		return false;
+	}
+
+	push_root((Obj*)instance);
+	push_root((Obj*)name);
+	if (IS_OBJ(value)) {
+		push_root(AS_OBJ(value));
+	}
+
+	ObjShape* shape = NULL;
+	if (instance->dictionary == NULL) {
+		shape = shape_add_field(instance->shape, name);
+		if (shape == NULL) {
+			make_dictionary(instance);
+		}
+	}
+
+	if (instance->dictionary != NULL)
+	{
+		bool added = table_set(instance->dictionary, name, value);
+		write_barrier((Obj*)instance, OBJ_VAL(name));
+		write_barrier((Obj*)instance, value);
+
+		if (IS_OBJ(value)) {
+			pop_root();
+		}
+		pop_root();
+		pop_root();
+		return added;
+	}
+
+	slot = shape->num_fields - 1;
+
+	int index = slot - instance->num_inline;
+	if (index >= instance->overflow_capacity)
+	{
+		int capacity = GROW_CAPACITY(instance->overflow_capacity);
+		instance->overflow = GROW_ARRAY(Value, instance->overflow,
+			instance->overflow_capacity, capacity);
+		instance->overflow_capacity = capacity;
+	}
+
+	instance->shape = shape;
+	*instance_field(instance, slot) = value;
+	write_barrier((Obj*)instance, OBJ_VAL(shape));
+	write_barrier((Obj*)instance, value);
+
+	if (IS_OBJ(value)) {
+		pop_root();
+	}
+	pop_root();
+	pop_root();
+
+	return true;
+}
+
 ObjNative* new_native(NativeFn function)
 {
 	ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
@@ -160,6 +322,7 @@ ObjModule* new_module(ObjString* name)
 	init_value_array(&module->variables);
 	init_value_array(&module->variable_names);
 	module->name = name;
+	module->core_shadows = 0;
 	return module;
 }
 
@@ -254,6 +417,7 @@ ObjUpvalue* new_upvalue(Value* slot)
 	upvalue->closed = NIL_VAL;
 	upvalue->location = slot;
 	upvalue->next = NULL;
+	upvalue->fiber = vm.fiber;
 	return upvalue;
 }
 
@@ -266,11 +430,42 @@ ObjRange* new_range()
 	return range;
 }
 
+ObjFiber* new_fiber(ObjClosure* closure)
+{
+	// The stacks are untracked memory like the VM's own, since they move
+	// between the VM and the fiber on every switch.
+	CallFrame* frames = (CallFrame*)reallocate_untracked(NULL, sizeof(CallFrame) * INITIAL_FRAMES);
+	Value* stack = (Value*)reallocate_untracked(NULL, sizeof(Value) * INITIAL_STACK);
+	if (frames == NULL || stack == NULL) {
+		exit(1);
+	}
+
+	ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+	fiber->obj.class_obj = vm.fiber_class;
+	fiber->state = closure != NULL ? FIBER_NEW : FIBER_ACTIVE;
+	fiber->closure = closure;
+	fiber->caller = NULL;
+
+	fiber->frames = frames;
+	fiber->frame_count = 0;
+	fiber->frame_capacity = INITIAL_FRAMES;
+	fiber->frame_count_begin = 0;
+
+	fiber->stack = stack;
+	fiber->stack_top = stack;
+	fiber->stack_capacity = INITIAL_STACK;
+
+	fiber->open_upvalues = NULL;
+	fiber->api_stack = NULL;
+	return fiber;
+}
+
 void bind_superclass(ObjClass* subclass, ObjClass* superclass)
 {
 	ASSERT(superclass != NULL, "Must have superclass.");
 
 	subclass->superclass = superclass;
+	write_barrier((Obj*)subclass, OBJ_VAL(superclass));
 
 	if (subclass->num_fields != -1) {
 		subclass->num_fields += superclass->num_fields;
@@ -278,7 +473,30 @@ void bind_superclass(ObjClass* subclass, ObjClass* superclass)
 		ASSERT(superclass->num_fields <= 0, "A foreign class cannot inherit from a class with fields.");
 	}
 
-	table_add_all(&superclass->methods, &subclass->methods);
+	for (int i = 0; i < superclass->methods.count; i++) {
+		if (superclass->methods.data[i] != NULL) {
+			bind_method(subclass, i, superclass->methods.data[i]);
+		}
+	}
+	vm.method_epoch++;
+}
+
+void bind_method(ObjClass* klass, int symbol, ObjMethod* method)
+{
+	// Make sure the buffer is big enough to contain the symbol's index.
+	if (symbol >= klass->methods.count)
+	{
+		push_root((Obj*)method);
+		MethodBufferFill(&klass->methods, NULL, symbol - klass->methods.count + 1);
+		pop_root();
+	}
+
+	klass->methods.data[symbol] = method;
+	write_barrier((Obj*)klass, OBJ_VAL(method));
+	if (symbol == vm.finalize_symbol && method->type == METHOD_FOREIGN) {
+		klass->finalize = (VesselFinalizerFn)method->as.foreign;
+	}
+	vm.method_epoch++;
 }
 
 ObjClass* get_class(Value value)
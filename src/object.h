@@ -2,8 +2,10 @@
 #define vessel_object_h
 
 #include "common.h"
+#include "buffer.h"
 #include "chunk.h"
 #include "table.h"
+#include "vessel.h"
 
 #include <stdbool.h>
 
@@ -24,6 +26,8 @@
 #define IS_MAP(value)          is_obj_type(value, OBJ_MAP)
 #define IS_SET(value)          is_obj_type(value, OBJ_SET)
 #define IS_RANGE(value)        is_obj_type(value, OBJ_RANGE)
+#define IS_SHAPE(value)        is_obj_type(value, OBJ_SHAPE)
+#define IS_FIBER(value)        is_obj_type(value, OBJ_FIBER)
 
 #define AS_METHOD(value)       ((ObjMethod*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
@@ -40,6 +44,8 @@
 #define AS_MAP(value)          ((ObjMap*)AS_OBJ(value))
 #define AS_SET(value)          ((ObjSet*)AS_OBJ(value))
 #define AS_RANGE(value)        ((ObjRange*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
 
 typedef enum
 {
@@ -58,6 +64,9 @@ typedef enum
 	OBJ_MAP,
 	OBJ_SET,
 	OBJ_RANGE,
+	OBJ_SHAPE,
+	OBJ_FIBER,
+	// Keep VES_GC_OBJECT_TYPES and ves_gc_type_name() in step.
 } ObjType;
 
 typedef struct ObjClass ObjClass;
@@ -65,11 +74,20 @@ typedef struct ObjClass ObjClass;
 struct Obj
 {
 	ObjType type;
+	// Set while a collection traces the object, and kept once it survives one
+	// until the next full collection, which is what tells old from young.
+	// Only large objects keep it here, see is_marked().
 	bool is_marked;
+	// Whether the object was too large for the pool and is in
+	// vm.large_objects instead.
+	bool is_large;
+	// Whether the object is in vm.remembered.
+	bool is_remembered;
 
 	// The object's class.
 	ObjClass* class_obj;
 
+	// The next object in vm.large_objects, if this is one of them.
 	struct Obj* next;
 };
 
@@ -80,9 +98,20 @@ typedef struct
 	Obj obj;
 	int arity;
 	int upvalue_count;
+	// The most stack slots the body uses at once, counting from the slot of
+	// the function itself.
+	int max_slots;
 	Chunk chunk;
 	ObjString* name;
 	ObjModule* module;
+
+	// Set while the body has only been skimmed, to the module source it is
+	// compiled from on the first call. [lazy_offset] and [lazy_line] locate its
+	// parameter list, and [lazy_type] is the compiler's FunctionType for it.
+	ObjString* lazy_source;
+	int lazy_offset;
+	int lazy_line;
+	uint8_t lazy_type;
 #ifdef STATISTICS
 	uint64_t call_times;
 	double   run_time;
@@ -111,6 +140,8 @@ typedef struct ObjUpvalue
 	Value* location;
 	Value closed;
 	struct ObjUpvalue* next;
+	// The fiber whose stack [location] points into while the upvalue is open.
+	struct ObjFiber* fiber;
 } ObjUpvalue;
 
 typedef struct
@@ -133,7 +164,7 @@ typedef enum
 typedef bool (*Primitive)(Value* args);
 typedef void (*VesselForeignMethodFn)();
 
-typedef struct
+typedef struct ObjMethod
 {
 	Obj obj;
 	MethodType type;
@@ -149,6 +180,8 @@ typedef struct
 #endif // STATISTICS
 } ObjMethod;
 
+DECLARE_BUFFER(Method, ObjMethod*);
+
 struct ObjClass
 {
 	Obj obj;
@@ -156,20 +189,55 @@ struct ObjClass
 	ObjModule* module;
 	ObjString* name;
 	int num_fields;
-	Table methods;
+	// The foreign finalizer bound to the class or inherited, if any, so making
+	// a foreign object need not look it up.
+	VesselFinalizerFn finalize;
+
+	// Indexed by method symbol (see vm.method_names). Slots for symbols the
+	// class does not implement are NULL.
+	MethodBuffer methods;
 };
 
 typedef struct
 {
 	Obj obj;
+	// Bytes of [data].
+	size_t size;
+	// The class's finalizer, copied when the object is made, since the class
+	// may be freed first once both are garbage.
+	VesselFinalizerFn finalize;
 	uint8_t data[FLEXIBLE_ARRAY];
 } ObjForeign;
 
+// Describes the field layout shared by every instance that had the same fields
+// added in the same order. Adding a field moves an instance to the child shape
+// found through [transitions], so the slot of a field never changes while an
+// instance keeps its shape.
+typedef struct ObjShape
+{
+	Obj obj;
+	struct ObjShape* parent;
+	// Field names indexed by slot. Slot [num_fields - 1] is the field this shape
+	// added to its parent.
+	ObjString** names;
+	int num_fields;
+	// Maps a field name to the shape reached by adding it.
+	Table transitions;
+} ObjShape;
+
 typedef struct
 {
 	Obj obj;
 	ObjClass* klass;
-	Table fields;
+	ObjShape* shape;
+	// Fields past the [num_inline] slots allocated with the instance.
+	Value* overflow;
+	int overflow_capacity;
+	int num_inline;
+	// Every field, once the instance has outgrown the shape tree. Its shape is
+	// then the empty shape.
+	Table* dictionary;
+	Value fields[FLEXIBLE_ARRAY];
 } ObjInstance;
 
 typedef struct
@@ -185,6 +253,10 @@ struct ObjModule
 	ValueArray variables;
 	ValueArray variable_names;
 	ObjString* name;
+	// The number of its variables named like one of Core's. Code compiled
+	// before the module declared one still addresses Core's slot, so
+	// OP_LOAD_CORE_VAR looks past Core while this is nonzero.
+	int core_shadows;
 };
 
 typedef struct
@@ -213,6 +285,50 @@ typedef struct
 	bool is_inclusive;
 } ObjRange;
 
+typedef struct
+{
+	ObjClosure* closure;
+	uint8_t* ip;
+	Value* slots;
+} CallFrame;
+
+typedef enum
+{
+	// Created but never run.
+	FIBER_NEW,
+	// Yielded, transferred away from or parked for the host.
+	FIBER_SUSPENDED,
+	// Running, or waiting for a fiber it called to yield or return.
+	FIBER_ACTIVE,
+	// Returned from its function or aborted by a runtime error.
+	FIBER_DONE
+} FiberState;
+
+// A coroutine with its own value stack and call frames. The running fiber's
+// stacks are loaded into the VM itself, where the interpreter reaches them
+// directly, so these fields are only current while the fiber is switched out.
+typedef struct ObjFiber
+{
+	Obj obj;
+	FiberState state;
+	// The function the fiber runs, or NULL for the main fiber.
+	ObjClosure* closure;
+	// The fiber to resume when this one yields or returns, set by call().
+	struct ObjFiber* caller;
+
+	CallFrame* frames;
+	int frame_count;
+	int frame_capacity;
+	int frame_count_begin;
+
+	Value* stack;
+	Value* stack_top;
+	int stack_capacity;
+
+	ObjUpvalue* open_upvalues;
+	Value* api_stack;
+} ObjFiber;
+
 ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method);
 ObjClass* new_class(ObjClass* superclass, int num_fields, ObjString* name, ObjModule* module);
 ObjClass* new_single_class(int num_fields, ObjString* name, ObjModule* module);
@@ -232,11 +348,51 @@ ObjString* take_string(char* chars, int length);
 ObjString* copy_string(const char* chars, int length);
 ObjUpvalue* new_upvalue(Value* slot);
 ObjRange* new_range();
+ObjFiber* new_fiber(ObjClosure* closure);
 
 void bind_superclass(ObjClass* subclass, ObjClass* superclass);
+void bind_method(ObjClass* klass, int symbol, ObjMethod* method);
+
+static inline ObjMethod* find_method(ObjClass* klass, int symbol)
+{
+	if (symbol < 0 || symbol >= klass->methods.count) {
+		return NULL;
+	}
+	return klass->methods.data[symbol];
+}
 
 ObjClass* get_class(Value value);
 
+ObjShape* new_shape(ObjShape* parent, ObjString* name);
+
+// Returns the shape [shape] transitions to when the field [name] is added, or
+// NULL if that would take the shape tree past its limits.
+ObjShape* shape_add_field(ObjShape* shape, ObjString* name);
+
+static inline int shape_find_field(ObjShape* shape, ObjString* name)
+{
+	for (int i = 0; i < shape->num_fields; i++) {
+		if (shape->names[i] == name) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static inline Value* instance_field(ObjInstance* instance, int slot)
+{
+	if (slot < instance->num_inline) {
+		return &instance->fields[slot];
+	}
+	return &instance->overflow[slot - instance->num_inline];
+}
+
+bool instance_get_field(ObjInstance* instance, ObjString* name, Value* value);
+
+// Sets the field [name] of [instance], adding it if needed. Returns true if the
+// field is new.
+bool instance_set_field(ObjInstance* instance, ObjString* name, Value value);
+
 static inline bool is_obj_type(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
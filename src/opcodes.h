@@ -1,62 +1,88 @@
-OPCODE(CONSTANT)
-OPCODE(NIL)
-OPCODE(TRUE)
-OPCODE(FALSE)
-OPCODE(POP)
-OPCODE(GET_LOCAL)
-OPCODE(SET_LOCAL)
-OPCODE(GET_GLOBAL)
-OPCODE(DEFINE_GLOBAL)
-OPCODE(SET_GLOBAL)
-OPCODE(GET_UPVALUE)
-OPCODE(SET_UPVALUE)
-OPCODE(GET_PROPERTY)
-OPCODE(SET_PROPERTY)
-OPCODE(GET_SUPER)
-OPCODE(EQUAL)
-OPCODE(GREATER)
-OPCODE(LESS)
-OPCODE(ADD)
-OPCODE(SUBTRACT)
-OPCODE(MULTIPLY)
-OPCODE(DIVIDE)
-OPCODE(NOT)
-OPCODE(NEGATE)
-OPCODE(JUMP)
-OPCODE(JUMP_IF_FALSE)
-OPCODE(LOOP)
-OPCODE(CALL)
-OPCODE(INVOKE)
-OPCODE(SUPER_INVOKE)
-OPCODE(CLOSURE)
-OPCODE(CLOSE_UPVALUE)
-OPCODE(RETURN)
-OPCODE(CLASS)
-OPCODE(FOREIGN_CLASS)
-OPCODE(INHERIT)
-OPCODE(METHOD)
-OPCODE(METHOD_STATIC)
-OPCODE(LOAD_MODULE_VAR)
-OPCODE(STORE_MODULE_VAR)
-OPCODE(CALL_0)
-OPCODE(CALL_1)
-OPCODE(CALL_2)
-OPCODE(CALL_3)
-OPCODE(CALL_4)
-OPCODE(CALL_5)
-OPCODE(CALL_6)
-OPCODE(CALL_7)
-OPCODE(CALL_8)
-OPCODE(CALL_9)
-OPCODE(CALL_10)
-OPCODE(CALL_11)
-OPCODE(CALL_12)
-OPCODE(CALL_13)
-OPCODE(CALL_14)
-OPCODE(CALL_15)
-OPCODE(CALL_16)
-OPCODE(IMPORT_MODULE)
-OPCODE(IMPORT_VARIABLE)
-OPCODE(FOREIGN_CONSTRUCT)
-OPCODE(CONSTRUCT)
-OPCODE(END_MODULE)
\ No newline at end of file
+// Each opcode and its effect on the stack: the values it pushes less those it
+// pops. CALL, INVOKE and SUPER_INVOKE also pop the arguments their operand
+// counts, which the compiler accounts for itself.
+
+OPCODE(CONSTANT, 1)
+OPCODE(NIL, 1)
+OPCODE(TRUE, 1)
+OPCODE(FALSE, 1)
+OPCODE(POP, -1)
+OPCODE(GET_LOCAL, 1)
+OPCODE(SET_LOCAL, 0)
+OPCODE(GET_GLOBAL, 1)
+OPCODE(DEFINE_GLOBAL, -1)
+OPCODE(SET_GLOBAL, 0)
+OPCODE(GET_UPVALUE, 1)
+OPCODE(SET_UPVALUE, 0)
+OPCODE(GET_PROPERTY, 0)
+OPCODE(SET_PROPERTY, -1)
+OPCODE(GET_SUPER, -1)
+OPCODE(EQUAL, -1)
+OPCODE(GREATER, -1)
+OPCODE(LESS, -1)
+OPCODE(ADD, -1)
+OPCODE(SUBTRACT, -1)
+OPCODE(MULTIPLY, -1)
+OPCODE(DIVIDE, -1)
+OPCODE(NOT, 0)
+OPCODE(NEGATE, 0)
+OPCODE(JUMP, 0)
+OPCODE(JUMP_IF_FALSE, 0)
+OPCODE(LOOP, 0)
+OPCODE(CALL, 0)
+OPCODE(INVOKE, 0)
+OPCODE(SUPER_INVOKE, -1)
+OPCODE(CLOSURE, 1)
+OPCODE(CLOSE_UPVALUE, -1)
+OPCODE(RETURN, -1)
+OPCODE(CLASS, 1)
+OPCODE(FOREIGN_CLASS, 1)
+OPCODE(INHERIT, -1)
+OPCODE(METHOD, -2)
+OPCODE(METHOD_STATIC, -2)
+OPCODE(LOAD_MODULE_VAR, 1)
+OPCODE(STORE_MODULE_VAR, 0)
+OPCODE(LOAD_CORE_VAR, 1)
+OPCODE(CALL_0, 0)
+OPCODE(CALL_1, -1)
+OPCODE(CALL_2, -2)
+OPCODE(CALL_3, -3)
+OPCODE(CALL_4, -4)
+OPCODE(CALL_5, -5)
+OPCODE(CALL_6, -6)
+OPCODE(CALL_7, -7)
+OPCODE(CALL_8, -8)
+OPCODE(CALL_9, -9)
+OPCODE(CALL_10, -10)
+OPCODE(CALL_11, -11)
+OPCODE(CALL_12, -12)
+OPCODE(CALL_13, -13)
+OPCODE(CALL_14, -14)
+OPCODE(CALL_15, -15)
+OPCODE(CALL_16, -16)
+OPCODE(IMPORT_MODULE, 1)
+OPCODE(IMPORT_VARIABLE, 1)
+OPCODE(FOREIGN_CONSTRUCT, 0)
+OPCODE(CONSTRUCT, 0)
+OPCODE(END_MODULE, 0)
+
+// Superinstructions the compiler's peephole pass fuses common sequences into.
+OPCODE(NOT_EQUAL, -1)
+OPCODE(LESS_EQUAL, -1)
+OPCODE(GREATER_EQUAL, -1)
+OPCODE(GET_LOCAL_2, 2)
+OPCODE(ADD_LOCAL_CONST, 1)
+OPCODE(INCREMENT_LOCAL, 0)
+OPCODE(POP_JUMP_IF_FALSE, -1)
+OPCODE(LESS_JUMP_IF_FALSE, -2)
+OPCODE(LESS_EQUAL_JUMP_IF_FALSE, -2)
+OPCODE(GREATER_JUMP_IF_FALSE, -2)
+OPCODE(GREATER_EQUAL_JUMP_IF_FALSE, -2)
+
+// Specialized forms that run() rewrites the generic opcodes above into after
+// observing their operands. Each one checks its assumption and rewrites itself
+// back to the generic form when it fails.
+OPCODE(ADD_NUM, -1)
+OPCODE(ADD_STR, -1)
+OPCODE(GET_FIELD_CACHED, 0)
+OPCODE(SET_FIELD_CACHED, -1)
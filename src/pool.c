@@ -0,0 +1,307 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The first block starts after the header, aligned like the blocks themselves.
+#define PAGE_HEADER_SIZE \
+	((sizeof(PoolPage) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE)
+
+static void link_chunk(Pool* pool, PoolChunk* chunk)
+{
+	chunk->prev = NULL;
+	chunk->next = pool->chunks;
+	if (pool->chunks != NULL) {
+		pool->chunks->prev = chunk;
+	}
+	pool->chunks = chunk;
+}
+
+static void unlink_chunk(Pool* pool, PoolChunk* chunk)
+{
+	if (chunk->prev != NULL) {
+		chunk->prev->next = chunk->next;
+	} else {
+		pool->chunks = chunk->next;
+	}
+	if (chunk->next != NULL) {
+		chunk->next->prev = chunk->prev;
+	}
+}
+
+static bool chunk_has_room(PoolChunk* chunk)
+{
+	return chunk->free_pages != NULL || chunk->carved < POOL_CHUNK_PAGES;
+}
+
+static PoolChunk* new_chunk(Pool* pool)
+{
+	PoolChunk* chunk = (PoolChunk*)pool->reallocate_fn(NULL, sizeof(PoolChunk), pool->user_data);
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	chunk->memory = pool->reallocate_fn(NULL, (POOL_CHUNK_PAGES + 1) * POOL_PAGE_SIZE, pool->user_data);
+	if (chunk->memory == NULL)
+	{
+		pool->reallocate_fn(chunk, 0, pool->user_data);
+		return NULL;
+	}
+
+	uintptr_t first = ((uintptr_t)chunk->memory + POOL_PAGE_SIZE - 1) & ~(uintptr_t)(POOL_PAGE_SIZE - 1);
+	chunk->first = (char*)first;
+	chunk->used = 0;
+	chunk->carved = 0;
+	chunk->free_pages = NULL;
+	link_chunk(pool, chunk);
+	return chunk;
+}
+
+static PoolPage* allocate_page(Pool* pool)
+{
+	PoolChunk* chunk = pool->chunks;
+	if (chunk == NULL)
+	{
+		chunk = new_chunk(pool);
+		if (chunk == NULL) {
+			return NULL;
+		}
+	}
+
+	PoolPage* page;
+	if (chunk->free_pages != NULL) {
+		page = chunk->free_pages;
+		chunk->free_pages = page->next;
+	} else {
+		page = (PoolPage*)(chunk->first + (size_t)chunk->carved * POOL_PAGE_SIZE);
+		chunk->carved++;
+	}
+	chunk->used++;
+
+	if (!chunk_has_room(chunk)) {
+		unlink_chunk(pool, chunk);
+	}
+
+	page->chunk = chunk;
+	return page;
+}
+
+// Gives [page] back to its chunk, and the chunk back to the allocator once
+// none of its pages is in use.
+static void release_page(Pool* pool, PoolPage* page)
+{
+	PoolChunk* chunk = page->chunk;
+	if (!chunk_has_room(chunk)) {
+		link_chunk(pool, chunk);
+	}
+
+	page->next = chunk->free_pages;
+	chunk->free_pages = page;
+	chunk->used--;
+
+	if (chunk->used == 0)
+	{
+		unlink_chunk(pool, chunk);
+		pool->reallocate_fn(chunk->memory, 0, pool->user_data);
+		pool->reallocate_fn(chunk, 0, pool->user_data);
+	}
+}
+
+static void link_page(PoolPage** list, PoolPage* page)
+{
+	page->prev = NULL;
+	page->next = *list;
+	if (*list != NULL) {
+		(*list)->prev = page;
+	}
+	*list = page;
+}
+
+static void unlink_page(PoolPage** list, PoolPage* page)
+{
+	if (page->prev != NULL) {
+		page->prev->next = page->next;
+	} else {
+		*list = page->next;
+	}
+	if (page->next != NULL) {
+		page->next->prev = page->prev;
+	}
+}
+
+// The list [page] is kept in, given its state.
+static PoolPage** page_list(Pool* pool, PoolPage* page)
+{
+	switch (page->state)
+	{
+	case PAGE_AVAILABLE:
+		return &pool->available[page->size_class];
+	case PAGE_FULL:
+		return &pool->full;
+	case PAGE_UNSWEPT:
+		return &pool->unswept[page->size_class];
+	default:
+		return NULL;
+	}
+}
+
+static void move_page(Pool* pool, PoolPage* page, PageState state)
+{
+	PoolPage** list = page_list(pool, page);
+	if (list != NULL) {
+		unlink_page(list, page);
+	}
+	page->state = state;
+	list = page_list(pool, page);
+	if (list != NULL) {
+		link_page(list, page);
+	}
+}
+
+static bool page_has_room(PoolPage* page)
+{
+	return page->free != NULL || page->bump + page->block_size <= page->end;
+}
+
+static void free_page_list(Pool* pool, PoolPage* page)
+{
+	while (page != NULL) {
+		PoolPage* next = page->next;
+		release_page(pool, page);
+		page = next;
+	}
+}
+
+void init_pool(Pool* pool, VesselReallocateFn reallocate_fn, void* user_data)
+{
+	for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+		pool->available[i] = NULL;
+		pool->unswept[i] = NULL;
+	}
+	pool->full = NULL;
+	pool->mark_epoch = 0;
+	pool->chunks = NULL;
+	pool->reallocate_fn = reallocate_fn;
+	pool->user_data = user_data;
+}
+
+void free_pool(Pool* pool)
+{
+	for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+		free_page_list(pool, pool->available[i]);
+		free_page_list(pool, pool->unswept[i]);
+	}
+	free_page_list(pool, pool->full);
+	ASSERT(pool->chunks == NULL, "Every chunk should be released with its pages.");
+	init_pool(pool, pool->reallocate_fn, pool->user_data);
+}
+
+// A new page hands its blocks out in address order straight from [bump], so
+// none of them is touched before it is needed.
+static PoolPage* new_page(Pool* pool, int size_class)
+{
+	PoolPage* page = allocate_page(pool);
+	if (page == NULL) {
+		return NULL;
+	}
+
+	page->size_class = size_class;
+	page->block_size = (size_class + 1) * POOL_GRANULE;
+	page->live = 0;
+	page->free = NULL;
+	page->bump = (char*)page + PAGE_HEADER_SIZE;
+	page->end = (char*)page + POOL_PAGE_SIZE;
+	page->young = false;
+	page->mark_epoch = pool->mark_epoch;
+	memset(page->objects, 0, sizeof(page->objects));
+	memset(page->marks, 0, sizeof(page->marks));
+
+	page->state = PAGE_AVAILABLE;
+	link_page(&pool->available[size_class], page);
+	return page;
+}
+
+void* pool_alloc(Pool* pool, size_t size)
+{
+	int size_class = pool_size_class(size);
+	PoolPage* page = pool->available[size_class];
+	if (page == NULL)
+	{
+		page = new_page(pool, size_class);
+		if (page == NULL) {
+			return NULL;
+		}
+	}
+
+	void* block;
+	if (page->free != NULL) {
+		block = page->free;
+		page->free = page->free->next;
+	} else {
+		block = page->bump;
+		page->bump += page->block_size;
+	}
+	page->live++;
+
+	if (!page_has_room(page)) {
+		move_page(pool, page, PAGE_FULL);
+	}
+
+	return block;
+}
+
+// Keeps the last page of a size class around, so a size that is allocated and
+// freed in turn does not map and unmap a page each time.
+static bool can_release(Pool* pool, PoolPage* page)
+{
+	PoolPage* first = pool->available[page->size_class];
+	return first != NULL && (first != page || page->next != NULL);
+}
+
+void pool_free(Pool* pool, void* pointer, size_t size)
+{
+	PoolPage* page = pool_page_of(pointer);
+	ASSERT(page->size_class == pool_size_class(size), "Block freed with the wrong size.");
+
+	PoolBlock* block = (PoolBlock*)pointer;
+	block->next = page->free;
+	page->free = block;
+	page->live--;
+
+	// Pages waiting for or in a sweep are settled once it is done.
+	if (page->state == PAGE_FULL)
+	{
+		move_page(pool, page, PAGE_AVAILABLE);
+	}
+	else if (page->state == PAGE_AVAILABLE && page->live == 0 && can_release(pool, page))
+	{
+		unlink_page(&pool->available[page->size_class], page);
+		release_page(pool, page);
+	}
+}
+
+void pool_unsweep_all(Pool* pool)
+{
+	for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+		while (pool->available[i] != NULL) {
+			move_page(pool, pool->available[i], PAGE_UNSWEPT);
+		}
+	}
+	while (pool->full != NULL) {
+		move_page(pool, pool->full, PAGE_UNSWEPT);
+	}
+}
+
+void pool_begin_sweep(Pool* pool, PoolPage* page)
+{
+	move_page(pool, page, PAGE_SWEEPING);
+}
+
+void pool_end_sweep(Pool* pool, PoolPage* page)
+{
+	if (page->live == 0 && can_release(pool, page)) {
+		release_page(pool, page);
+		return;
+	}
+	move_page(pool, page, page_has_room(page) ? PAGE_AVAILABLE : PAGE_FULL);
+}
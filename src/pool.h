@@ -0,0 +1,155 @@
+#ifndef vessel_pool_h
+#define vessel_pool_h
+
+#include "common.h"
+#include "vessel.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Objects and payloads up to POOL_MAX_SIZE bytes are carved out of pages that
+// each hold blocks of a single size class, so they cost neither an allocator
+// call each nor the allocator's per-block header. Anything larger goes
+// straight to the allocator.
+#define POOL_PAGE_SIZE (64 * 1024)
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_NUM_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+
+// Every block starts on a granule, so a page's bitmaps have a bit for each.
+#define POOL_BITMAP_WORDS (POOL_PAGE_SIZE / POOL_GRANULE / 64)
+
+// Pages are carved out of chunks of this many.
+#define POOL_CHUNK_PAGES 16
+
+typedef struct PoolBlock
+{
+	struct PoolBlock* next;
+} PoolBlock;
+
+// The allocator makes no promise of alignment, so each chunk is asked for
+// with a page to spare, and its pages start at the first page boundary in it.
+typedef struct PoolChunk
+{
+	// Neighbours among the chunks with pages to spare.
+	struct PoolChunk* prev;
+	struct PoolChunk* next;
+
+	// The memory as the allocator handed it out, and its first page.
+	void* memory;
+	char* first;
+	// Pages in use, and those ever handed out, which come in address order.
+	int used;
+	int carved;
+	// Pages given back, linked through PoolPage.next.
+	struct PoolPage* free_pages;
+} PoolChunk;
+
+typedef enum
+{
+	// In the size class's list of pages with free blocks.
+	PAGE_AVAILABLE,
+	// In the list of pages without any.
+	PAGE_FULL,
+	// Holding objects a collection found dead, waiting to be swept.
+	PAGE_UNSWEPT,
+	// Taken out of every list while its objects are freed.
+	PAGE_SWEEPING
+} PageState;
+
+// The header at the start of every page. Pages are aligned to their size, so
+// the page of any block is found by masking its address.
+typedef struct PoolPage
+{
+	// Neighbours in the list the state puts the page in.
+	struct PoolPage* prev;
+	struct PoolPage* next;
+	PageState state;
+	PoolChunk* chunk;
+
+	int size_class;
+	int block_size;
+	// Blocks handed out and not yet returned.
+	int live;
+
+	// Blocks returned to the page, and the part of it never handed out yet.
+	PoolBlock* free;
+	char* bump;
+	char* end;
+
+	// Whether objects were allocated here since the last young collection.
+	bool young;
+	// The collection [marks] belongs to. Those of any earlier one all count as
+	// clear, which unmarks every page at once when a new collection starts.
+	uint32_t mark_epoch;
+	// Which blocks hold objects rather than payloads, and which of those the
+	// collector marked.
+	uint64_t objects[POOL_BITMAP_WORDS];
+	uint64_t marks[POOL_BITMAP_WORDS];
+} PoolPage;
+
+typedef struct
+{
+	// The pages with free blocks of each size class. Allocation takes from the
+	// first, which is where returned blocks send their page.
+	PoolPage* available[POOL_NUM_CLASSES];
+	PoolPage* full;
+	PoolPage* unswept[POOL_NUM_CLASSES];
+	uint32_t mark_epoch;
+
+	// The chunks with pages to spare, and where chunks come from.
+	PoolChunk* chunks;
+	VesselReallocateFn reallocate_fn;
+	void* user_data;
+} Pool;
+
+void init_pool(Pool* pool, VesselReallocateFn reallocate_fn, void* user_data);
+void free_pool(Pool* pool);
+void* pool_alloc(Pool* pool, size_t size);
+void pool_free(Pool* pool, void* pointer, size_t size);
+
+// Moves every page to the unswept lists once a collection has marked them.
+void pool_unsweep_all(Pool* pool);
+
+// Takes [page] out of its list for sweeping. Blocks freed meanwhile stay with
+// it, and pool_end_sweep() puts it back where they leave it.
+void pool_begin_sweep(Pool* pool, PoolPage* page);
+void pool_end_sweep(Pool* pool, PoolPage* page);
+
+static inline bool pool_fits(size_t size)
+{
+	return size > 0 && size <= POOL_MAX_SIZE;
+}
+
+static inline int pool_size_class(size_t size)
+{
+	return (int)((size - 1) / POOL_GRANULE);
+}
+
+static inline PoolPage* pool_page_of(const void* pointer)
+{
+	return (PoolPage*)((uintptr_t)pointer & ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+}
+
+static inline int pool_granule_of(const PoolPage* page, const void* pointer)
+{
+	return (int)(((uintptr_t)pointer - (uintptr_t)page) / POOL_GRANULE);
+}
+
+static inline bool pool_bit(const uint64_t* bitmap, int index)
+{
+	return (bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+static inline void pool_set_bit(uint64_t* bitmap, int index)
+{
+	bitmap[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+static inline void pool_clear_bit(uint64_t* bitmap, int index)
+{
+	bitmap[index / 64] &= ~((uint64_t)1 << (index % 64));
+}
+
+#endif // vessel_pool_h
@@ -8,11 +8,11 @@
 #define PRIMITIVE(cls, name, function)                                         \
     do                                                                         \
     {                                                                          \
-        ObjString* key = copy_string(name, strlen(name));                      \
+        int symbol = method_symbol_ensure(name, (int)strlen(name));            \
         ObjMethod* val = new_method();                                         \
         val->type = METHOD_PRIMITIVE;                                          \
         val->as.primitive = prim_##function;                                   \
-        table_set(&cls->methods, key, OBJ_VAL(val));                           \
+        bind_method(cls, symbol, val);                                         \
     } while (false)
 
 #define DEF_PRIMITIVE(name)                                                    \
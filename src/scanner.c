@@ -5,27 +5,35 @@
 #include <stdbool.h>
 #include <string.h>
 
-#define MAX_INTERPOLATION_NESTING 8
+static VES_THREAD_LOCAL Scanner scanner;
 
-typedef struct
+void init_scanner(const char* source)
 {
-	const char* start;
-	const char* current;
-	int line;
-
-    int parens[MAX_INTERPOLATION_NESTING];
-    int num_parens;
-
-} Scanner;
-
-Scanner scanner;
+	init_scanner_at(source, 1);
+}
 
-void init_scanner(const char* source)
+void init_scanner_at(const char* source, int line)
 {
 	scanner.start = source;
 	scanner.current = source;
-	scanner.line = 1;
+	scanner.line = line;
     scanner.num_parens = 0;
+    scanner.skimming = false;
+}
+
+Scanner save_scanner()
+{
+    return scanner;
+}
+
+void restore_scanner(const Scanner* state)
+{
+    scanner = *state;
+}
+
+void skim_tokens(bool skimming)
+{
+    scanner.skimming = skimming;
 }
 
 static bool is_alpha(char c)
@@ -318,7 +326,13 @@ static Token string()
     }
     ByteBufferWrite(&string, '"');
 
+    if (scanner.skimming) {
+        ByteBufferClear(&string);
+        return make_token(type);
+    }
+
     ObjString* obj_str = copy_string(string.data, string.count);
+    ByteBufferClear(&string);
 
     Token token;
     token.type = type;
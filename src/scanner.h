@@ -45,7 +45,33 @@ typedef struct
     Value value;
 } Token;
 
+#define MAX_INTERPOLATION_NESTING 8
+
+typedef struct
+{
+	const char* start;
+	const char* current;
+	int line;
+
+    int parens[MAX_INTERPOLATION_NESTING];
+    int num_parens;
+
+    // When set, string tokens are scanned without creating their values.
+    bool skimming;
+} Scanner;
+
 void init_scanner(const char* source);
+
+// Starts scanning in the middle of a source, at [line].
+void init_scanner_at(const char* source, int line);
+
+// The scanner's position, to rewind to after looking ahead.
+Scanner save_scanner();
+void restore_scanner(const Scanner* state);
+
+// Skims over tokens whose values are not needed, see Scanner.skimming.
+void skim_tokens(bool skimming);
+
 Token scan_token();
 
 #endif // vessel_scanner_h
@@ -167,7 +167,7 @@ void table_remove_white(Table* table)
     for (int i = 0; i <= table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.is_marked) {
+        if (entry->key != NULL && !is_marked(&entry->key->obj)) {
             table_delete(table, entry->key);
         }
     }
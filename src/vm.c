@@ -8,6 +8,7 @@
 #include "utils.h"
 #include "primitive.h"
 #include "statistics.h"
+#include "artifact.h"
 #if OPT_RANDOM
 #include "opt_random.h"
 #endif // OPT_RANDOM
@@ -18,13 +19,14 @@
 #include "opt_io.h"
 #endif // OPT_IO
 
+#include <stdlib.h>
 #include <time.h>
 #include <stdarg.h>
 #include <stdio.h>
 
 #include <stdio.h>
 
-VM vm;
+VES_THREAD_LOCAL VM* current_vm = NULL;
 
 static Value clock_native(int arg_count, Value* args)
 {
@@ -39,6 +41,62 @@ static void reset_stack()
 	vm.open_upvalues = NULL;
 }
 
+// Stores the running fiber's stacks, which live in the VM while it runs, back
+// into [fiber].
+static void save_fiber(ObjFiber* fiber)
+{
+	fiber->frames = vm.frames;
+	fiber->frame_count = vm.frame_count;
+	fiber->frame_capacity = vm.frame_capacity;
+	fiber->frame_count_begin = vm.frame_count_begin;
+	fiber->stack = vm.stack;
+	fiber->stack_top = vm.stack_top;
+	fiber->stack_capacity = vm.stack_capacity;
+	fiber->open_upvalues = vm.open_upvalues;
+	fiber->api_stack = vm.api_stack;
+
+	// The stacks were roots while loaded and may hold anything young.
+	write_barrier_object((Obj*)fiber);
+}
+
+static void load_fiber(ObjFiber* fiber)
+{
+	vm.frames = fiber->frames;
+	vm.frame_count = fiber->frame_count;
+	vm.frame_capacity = fiber->frame_capacity;
+	vm.frame_count_begin = fiber->frame_count_begin;
+	vm.stack = fiber->stack;
+	vm.stack_top = fiber->stack_top;
+	vm.stack_capacity = fiber->stack_capacity;
+	vm.open_upvalues = fiber->open_upvalues;
+	vm.api_stack = fiber->api_stack;
+	vm.fiber = fiber;
+}
+
+// Ends every fiber in the failing call chain and goes back to the main fiber,
+// so that the error unwinds to the host like it does without fibers.
+static void abort_fibers()
+{
+	vm.fiber_switch = false;
+	vm.next_fiber = NULL;
+
+	if (vm.fiber == vm.main_fiber) {
+		return;
+	}
+
+	ObjFiber* fiber = vm.fiber;
+	while (fiber != NULL && fiber != vm.main_fiber)
+	{
+		ObjFiber* caller = fiber->caller;
+		fiber->state = FIBER_DONE;
+		fiber->caller = NULL;
+		fiber = caller;
+	}
+
+	save_fiber(vm.fiber);
+	load_fiber(vm.main_fiber);
+}
+
 void ves_traceback()
 {
 	for (int i = vm.frame_count - 1; i >= 0; i--)
@@ -68,36 +126,100 @@ static void runtime_error(const char* format, ...)
 
 	ves_traceback();
 
+	abort_fibers();
 	reset_stack();
 }
 
 static void define_native(const char* name, NativeFn function)
 {
-	Value module;
-	if (!table_get(&vm.modules, copy_string("Core", 4), &module)) {
+	if (vm.core_module == NULL) {
 		return;
 	}
 
 	push(OBJ_VAL(copy_string(name, (int)strlen(name))));
 	push(OBJ_VAL(new_native(function)));
-	DefineVariable(AS_MODULE(module), name, strlen(name), vm.stack[1], NULL);
+	DefineVariable(vm.core_module, name, strlen(name), vm.stack[1], NULL);
 	pop();
 	pop();
 }
 
-void init_configuration(VesselConfiguration* config)
+static void* default_reallocate(void* memory, size_t new_size, void* user_data)
 {
+	if (new_size == 0)
+	{
+		free(memory);
+		return NULL;
+	}
+	return realloc(memory, new_size);
+}
+
+void ves_init_configuration(VesselConfiguration* config)
+{
+	config->reallocate_fn = NULL;
+	config->reallocate_user_data = NULL;
 	config->load_module_fn = NULL;
 	config->expand_modules_fn = NULL;
 	config->bind_foreign_method_fn = NULL;
 	config->bind_foreign_class_fn = NULL;
 	config->write_fn = NULL;
+	config->max_frames = DEFAULT_MAX_FRAMES;
+	config->lazy_compile = false;
+	config->incremental_gc = false;
+	config->gc_slice_budget_us = DEFAULT_GC_SLICE_BUDGET_US;
+	config->gc_threads = 0;
+	config->finalize_mode = VES_FINALIZE_AFTER_GC;
+	config->gc_event_fn = NULL;
+	config->gc_initial_heap = DEFAULT_GC_INITIAL_HEAP;
+	config->gc_min_growth = DEFAULT_GC_MIN_GROWTH;
+	config->gc_max_growth = DEFAULT_GC_MAX_GROWTH;
+	config->gc_target_time_fraction = 0;
+	config->gc_heap_limit = 0;
 }
 
 void ves_set_config(VesselConfiguration* cfg)
 {
 	if (cfg) {
+		// Memory already handed out has to go back where it came from.
+		VesselReallocateFn reallocate_fn = vm.config.reallocate_fn;
+		void* reallocate_user_data = vm.config.reallocate_user_data;
 		memcpy(&vm.config, cfg, sizeof(VesselConfiguration));
+		vm.config.reallocate_fn = reallocate_fn;
+		vm.config.reallocate_user_data = reallocate_user_data;
+
+		// Embedders that predate the limit leave it zeroed.
+		if (vm.config.max_frames <= 0) {
+			vm.config.max_frames = DEFAULT_MAX_FRAMES;
+		}
+		if (vm.config.gc_slice_budget_us <= 0) {
+			vm.config.gc_slice_budget_us = DEFAULT_GC_SLICE_BUDGET_US;
+		}
+		if (vm.config.gc_threads < 0) {
+			vm.config.gc_threads = 0;
+		} else if (vm.config.gc_threads > MAX_GC_THREADS) {
+			vm.config.gc_threads = MAX_GC_THREADS;
+		}
+
+		if (vm.config.gc_initial_heap == 0) {
+			vm.config.gc_initial_heap = DEFAULT_GC_INITIAL_HEAP;
+		}
+		// The heap has to grow for collections to ever catch up with it.
+		if (vm.config.gc_min_growth <= 1.0) {
+			vm.config.gc_min_growth = DEFAULT_GC_MIN_GROWTH;
+		}
+		if (vm.config.gc_max_growth < vm.config.gc_min_growth) {
+			vm.config.gc_max_growth = vm.config.gc_min_growth;
+		}
+
+		if (vm.gc_growth < vm.config.gc_min_growth) {
+			vm.gc_growth = vm.config.gc_min_growth;
+		} else if (vm.gc_growth > vm.config.gc_max_growth) {
+			vm.gc_growth = vm.config.gc_max_growth;
+		}
+		// Until the first full collection paces the next, it starts at the
+		// initial heap size.
+		if (vm.gc_stats.full_collections == 0) {
+			vm.next_gc = vm.config.gc_initial_heap;
+		}
 	}
 }
 
@@ -106,52 +228,148 @@ void* ves_get_config()
 	return &vm.config;
 }
 
-void ves_init_vm()
+VesselVM* ves_init_vm()
 {
-	reset_stack();
+	return ves_init_vm_with_config(NULL);
+}
 
-	vm.objects = NULL;
+VesselVM* ves_init_vm_with_config(VesselConfiguration* cfg)
+{
+	VesselReallocateFn reallocate_fn = default_reallocate;
+	void* reallocate_user_data = NULL;
+	if (cfg != NULL && cfg->reallocate_fn != NULL)
+	{
+		reallocate_fn = cfg->reallocate_fn;
+		reallocate_user_data = cfg->reallocate_user_data;
+	}
 
-	vm.bytes_allocated = 0;
-	vm.next_gc = 1024 * 1024;
+	current_vm = (VM*)reallocate_fn(NULL, sizeof(VM), reallocate_user_data);
+	if (current_vm == NULL) {
+		exit(1);
+	}
+	memset(current_vm, 0, sizeof(VM));
 
-	vm.gray_count = 0;
-	vm.gray_capacity = 0;
-	vm.gray_stack = NULL;
+	ves_init_configuration(&vm.config);
+	vm.config.reallocate_fn = reallocate_fn;
+	vm.config.reallocate_user_data = reallocate_user_data;
+
+	init_pool(&vm.pool, reallocate_fn, reallocate_user_data);
+	vm.large_objects = NULL;
+	vm.young_page_count = 0;
+	vm.young_page_capacity = 0;
+	vm.young_pages = NULL;
+
+	vm.bytes_allocated = 0;
+	vm.next_gc = DEFAULT_GC_INITIAL_HEAP;
+	vm.gc_growth = DEFAULT_GC_MIN_GROWTH;
+	vm.gc_cycle_start = 0;
+	vm.gc_cycle_pause = 0;
+	vm.out_of_memory = false;
+	vm.nursery_bytes = 0;
+
+	vm.gc_state = GC_IDLE;
+	vm.gc_debt = 0;
+
+	vm.gray.count = 0;
+	vm.gray.capacity = 0;
+	vm.gray.objects = NULL;
+	vm.parallel_marking = false;
+	vm.gc_helpers = NULL;
+	vm.finalize_queue = NULL;
+	vm.finalizer = NULL;
+	memset(&vm.gc_stats, 0, sizeof(vm.gc_stats));
+	vm.gc_pause_depth = 0;
+
+	vm.remembered_count = 0;
+	vm.remembered_capacity = 0;
+	vm.remembered = NULL;
 
 	vm.num_temp_roots = 0;
 
+	// Applied before anything is allocated, so the heap is paced by it
+	// from the start.
+	ves_set_config(cfg);
+
+	// Calls from the host run on the main fiber, which starts out loaded.
+	vm.fiber = NULL;
+	vm.main_fiber = new_fiber(NULL);
+	load_fiber(vm.main_fiber);
+
+	vm.fiber_switch = false;
+	vm.next_fiber = NULL;
+	vm.fiber_value = NIL_VAL;
+	init_value_array(&vm.held_fibers);
+
 	init_table(&vm.strings);
 
 	vm.init_str = copy_string("init", 4);
 	vm.allocate_str = copy_string("<allocate>", 10);
 	vm.finalize_str = copy_string("<finalize>", 10);
 
-	init_table(&vm.modules);
+	vm.empty_shape = NULL;
+	vm.empty_shape = new_shape(NULL, NULL);
 
-	vm.api_stack = NULL;
+	init_value_array(&vm.method_names);
+	init_table(&vm.method_symbols);
+	vm.method_epoch = 1;
+
+	for (int i = 0; i <= MAX_PARAMETERS; i++)
+	{
+		Signature signature = { vm.init_str->chars, vm.init_str->length, SIG_METHOD, i };
+		char name[MAX_METHOD_SIGNATURE];
+		int length;
+		signature_to_string(&signature, name, &length);
+		vm.init_symbols[i] = method_symbol_ensure(name, length);
+	}
+	vm.allocate_symbol = method_symbol_ensure(vm.allocate_str->chars, vm.allocate_str->length);
+	vm.finalize_symbol = method_symbol_ensure(vm.finalize_str->chars, vm.finalize_str->length);
 
-	init_configuration(&vm.config);
+	init_table(&vm.modules);
 
-	init_value_array(&vm.method_names);
+	vm.api_stack = NULL;
 
 	initialize_core();
 
 	vm.last_module = NULL;
 
 	define_native("clock", clock_native);
+
+	return current_vm;
 }
 
 void ves_free_vm()
 {
+	// The running fiber's stacks are freed with it.
+	save_fiber(vm.fiber);
+
 	free_table(&vm.strings);
 	free_table(&vm.modules);
 	free_value_array(&vm.method_names);
+	free_table(&vm.method_symbols);
+	free_value_array(&vm.held_fibers);
 	free_objects();
 
 	vm.init_str = NULL;
 	vm.allocate_str = NULL;
 	vm.finalize_str = NULL;
+	vm.empty_shape = NULL;
+
+	free_pool(&vm.pool);
+
+	VesselReallocateFn reallocate_fn = vm.config.reallocate_fn;
+	void* reallocate_user_data = vm.config.reallocate_user_data;
+	reallocate_fn(current_vm, 0, reallocate_user_data);
+	current_vm = NULL;
+}
+
+void ves_set_vm(VesselVM* new_vm)
+{
+	current_vm = new_vm;
+}
+
+VesselVM* ves_get_vm()
+{
+	return current_vm;
 }
 
 void push(Value value)
@@ -238,10 +456,123 @@ static Value peek(int distance)
 	return vm.stack_top[-1 - distance];
 }
 
+static inline ObjMethod* inline_cache_find(InlineCache* cache, ObjClass* klass)
+{
+	if (cache->epoch != vm.method_epoch) {
+		return NULL;
+	}
+
+	for (int i = 0; i < cache->count; i++) {
+		if (cache->classes[i] == klass) {
+			return cache->methods[i];
+		}
+	}
+	return NULL;
+}
+
+static inline void inline_cache_add(InlineCache* cache, ObjClass* klass, ObjMethod* method)
+{
+	if (cache->epoch != vm.method_epoch) {
+		cache->epoch = vm.method_epoch;
+		cache->count = 0;
+	}
+
+	// Megamorphic sites keep the classes they saw first instead of thrashing.
+	if (cache->count < INLINE_CACHE_WAYS) {
+		cache->classes[cache->count] = klass;
+		cache->methods[cache->count] = method;
+		cache->count++;
+
+		// The cache is in the chunk of the function running the lookup.
+		ObjFunction* function = vm.frames[vm.frame_count - 1].closure->function;
+		write_barrier((Obj*)function, OBJ_VAL(klass));
+		write_barrier((Obj*)function, OBJ_VAL(method));
+	}
+}
+
+// Makes room for [needed] more values above the stack top. Growing moves the
+// stack, so every pointer into it (frame slots, open upvalues and the foreign
+// API window) is rebased onto the new allocation. Returns false if there is no
+// memory to grow into.
+static bool ensure_stack(int needed)
+{
+	int required = (int)(vm.stack_top - vm.stack) + needed;
+	if (required <= vm.stack_capacity) {
+		return true;
+	}
+
+	int capacity = vm.stack_capacity;
+	while (capacity < required) {
+		capacity *= 2;
+	}
+
+	Value* old_stack = vm.stack;
+	Value* new_stack = (Value*)reallocate_untracked(vm.stack, sizeof(Value) * capacity);
+	if (new_stack == NULL) {
+		return false;
+	}
+
+	vm.stack = new_stack;
+	vm.stack_capacity = capacity;
+	if (new_stack == old_stack) {
+		return true;
+	}
+
+	vm.stack_top = new_stack + (vm.stack_top - old_stack);
+	for (int i = 0; i < vm.frame_count; i++) {
+		vm.frames[i].slots = new_stack + (vm.frames[i].slots - old_stack);
+	}
+	for (ObjUpvalue* upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+		upvalue->location = new_stack + (upvalue->location - old_stack);
+	}
+	if (vm.api_stack != NULL) {
+		vm.api_stack = new_stack + (vm.api_stack - old_stack);
+	}
+	return true;
+}
+
 static bool call(ObjClosure* closure, int arg_count)
 {
-	if (vm.frame_count == FRAMES_MAX) {
-		runtime_error("Stack overflow.");
+	// Raised here and at loops, since every script that keeps allocating
+	// passes one or the other.
+	if (vm.out_of_memory)
+	{
+		vm.out_of_memory = false;
+		runtime_error("Out of memory.");
+		return false;
+	}
+
+	if (vm.frame_count == vm.frame_capacity)
+	{
+		if (vm.frame_count >= vm.config.max_frames) {
+			runtime_error("Stack overflow.");
+			return false;
+		}
+
+		int capacity = vm.frame_capacity * 2;
+		if (capacity > vm.config.max_frames) {
+			capacity = vm.config.max_frames;
+		}
+
+		CallFrame* frames = (CallFrame*)reallocate_untracked(vm.frames, sizeof(CallFrame) * capacity);
+		if (frames == NULL) {
+			runtime_error("Out of memory.");
+			return false;
+		}
+		vm.frames = frames;
+		vm.frame_capacity = capacity;
+	}
+
+	ObjFunction* function = closure->function;
+	if (function->lazy_source != NULL && !compile_lazy(function))
+	{
+		runtime_error("Could not compile '%s'.", function->name->chars);
+		return false;
+	}
+
+	// The callee and its arguments are on the stack already.
+	if (!ensure_stack(function->max_slots - arg_count - 1 + STACK_HEADROOM)) {
+		runtime_error("Out of memory.");
 		return false;
 	}
 
@@ -275,15 +606,9 @@ static bool call_value(Value callee, int arg_count)
 			ObjClass* klass = AS_CLASS(callee);
 			vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
 
-			Value initializer;
-
-			Signature signature = { vm.init_str->chars, vm.init_str->length, SIG_METHOD, arg_count };
-			char name[MAX_METHOD_SIGNATURE];
-			int length;
-			signature_to_string(&signature, name, &length);
-			if (table_get(&klass->methods, copy_string(name, length), &initializer)) {
-				ASSERT(IS_METHOD(initializer), "Error method type.");
-				ObjMethod* obj_method = AS_METHOD(initializer);
+			ObjMethod* obj_method = arg_count <= MAX_PARAMETERS ?
+				find_method(klass, vm.init_symbols[arg_count]) : NULL;
+			if (obj_method != NULL) {
 				ASSERT(obj_method->type == METHOD_BLOCK, "Method should be block.");
 				STAT_UP_TIMES(obj_method)
 				return call(obj_method->as.closure, arg_count);
@@ -319,7 +644,8 @@ static bool call_value(Value callee, int arg_count)
 			//	break;
 			case METHOD_FOREIGN:
 			{
-				Value* old_api_stack = vm.api_stack;
+				// Kept as an offset since the foreign method may grow the stack.
+				ptrdiff_t old_api_stack = vm.api_stack != NULL ? vm.api_stack - vm.stack : -1;
 
 				vm.api_stack = vm.stack_top - arg_count - 1;
 
@@ -331,7 +657,7 @@ static bool call_value(Value callee, int arg_count)
 				// for the result.
 				vm.stack_top = vm.api_stack + 1;
 
-				vm.api_stack = old_api_stack;
+				vm.api_stack = old_api_stack != -1 ? vm.stack + old_api_stack : NULL;
 
 				return true;
 			}
@@ -373,27 +699,8 @@ static bool call_value(Value callee, int arg_count)
 	return false;
 }
 
-static bool invoke_from_class(ObjClass* klass, ObjString* name, int arg_count)
+static bool invoke_method(ObjMethod* obj_method, int arg_count)
 {
-	Value method;
-
-	Signature signature;
-	signature.name = name->chars;
-	signature.length = name->length;
-	signature.arity = arg_count;
-	signature.type = SIG_METHOD;
-
-	char name_str[MAX_METHOD_SIGNATURE];
-	int length;
-	signature_to_string(&signature, name_str, &length);
-
-	if (!table_get(&klass->methods, copy_string(name_str, length), &method)) {
-		runtime_error("Undefined property '%s'.", name->chars);
-		return false;
-	}
-
-	ASSERT(IS_METHOD(method), "Error method type.");
-	ObjMethod* obj_method = AS_METHOD(method);
 	STAT_UP_TIMES(obj_method);
 
 	bool ret = false;
@@ -408,7 +715,7 @@ static bool invoke_from_class(ObjClass* klass, ObjString* name, int arg_count)
 		} else {
 			STAT_TIMER_END(obj_method)
 			runtime_error("Run primitive fail.");
-			return VES_INTERPRET_RUNTIME_ERROR;
+			return false;
 		}
 		break;
 	case METHOD_BLOCK:
@@ -434,77 +741,118 @@ static bool invoke_from_class(ObjClass* klass, ObjString* name, int arg_count)
 	return ret;
 }
 
-static bool invoke(ObjString* name, int arg_count)
+static bool invoke_from_class(ObjClass* klass, ObjString* name, int symbol, int arg_count)
+{
+	ObjMethod* method = find_method(klass, symbol);
+	if (method == NULL) {
+		runtime_error("Undefined property '%s'.", name->chars);
+		return false;
+	}
+
+	return invoke_method(method, arg_count);
+}
+
+static bool invoke(ObjString* name, int symbol, int arg_count, InlineCache* cache)
 {
 	Value receiver = peek(arg_count);
 
-	ObjClass* obj_class = NULL;
 	if (IS_INSTANCE(receiver))
 	{
 		ObjInstance* instance = AS_INSTANCE(receiver);
 
 		Value value;
-		if (table_get(&instance->fields, name, &value)) {
+		if (instance_get_field(instance, name, &value)) {
 			vm.stack_top[-arg_count - 1] = value;
 			return call_value(value, arg_count);
 		}
 
-		obj_class = instance->klass;
+		ObjMethod* method = inline_cache_find(cache, instance->klass);
+		if (method == NULL)
+		{
+			method = find_method(instance->klass, symbol);
+			if (method == NULL) {
+				runtime_error("Undefined property '%s'.", name->chars);
+				return false;
+			}
+			inline_cache_add(cache, instance->klass, method);
+		}
+		return invoke_method(method, arg_count);
 	}
-	else
+
+	ObjClass* obj_class = get_class(receiver);
+	if (obj_class == NULL) {
+		runtime_error("Unknown type, no class_obj.");
+		return false;
+	}
+
+	ObjMethod* method = inline_cache_find(cache, obj_class);
+	if (method == NULL)
 	{
-		obj_class = get_class(receiver);
-		if (obj_class == NULL) {
-			runtime_error("Unknown type, no class_obj.");
+		method = find_method(obj_class, symbol);
+		if (method == NULL) {
+			runtime_error("Undefined property '%s'.", name->chars);
 			return false;
 		}
+		inline_cache_add(cache, obj_class, method);
+	}
+	return call_value(OBJ_VAL(method), arg_count);
+}
 
-		char name_str[MAX_METHOD_SIGNATURE];
-		int length;
+int method_symbol_ensure(const char* name, int length)
+{
+	int symbol = method_symbol_find(name, length);
+	if (symbol != -1) {
+		return symbol;
+	}
 
-		Signature signature = { name->chars, name->length, SIG_METHOD, arg_count };
-		signature_to_string(&signature, name_str, &length);
+	ObjString* str = copy_string(name, length);
+	push_root((Obj*)str);
+	write_value_array(&vm.method_names, OBJ_VAL(str));
+	symbol = vm.method_names.count - 1;
+	table_set(&vm.method_symbols, str, NUMBER_VAL(symbol));
+	pop_root();
+
+	return symbol;
+}
 
-		ObjString* signed_name = copy_string(name_str, length);
+int method_symbol_find(const char* name, int length)
+{
+	// Every signature is interned, so a string that is not in the intern table
+	// cannot be a method symbol either.
+	ObjString* str = table_find_string(&vm.strings, name, length, hash_string(name, length));
+	if (str == NULL) {
+		return -1;
+	}
 
-		Value value;
-		if (table_get(&obj_class->methods, signed_name, &value)) {
-			return call_value(value, arg_count);
-		}
+	Value symbol;
+	if (!table_get(&vm.method_symbols, str, &symbol)) {
+		return -1;
 	}
-	return invoke_from_class(obj_class, name, arg_count);
+	return (int)AS_NUMBER(symbol);
 }
 
-static bool bind_method(ObjClass* klass, ObjString* name)
+// Looks up the method that `receiver.name` (without an argument list) binds
+// to: a getter first, then the method of the same name with any arity.
+static ObjMethod* find_bindable_method(ObjClass* klass, ObjString* name)
 {
-	Value method;
-	if (!table_get(&klass->methods, name, &method))
+	ObjMethod* method = find_method(klass, method_symbol_find(name->chars, name->length));
+	for (int i = 0; method == NULL && i <= MAX_PARAMETERS; ++i)
 	{
-		bool find = false;
-		for (int i = 0; i < 16; ++i)
-		{
-			Signature signature = { name->chars, name->length, SIG_METHOD, i };
-			char name[MAX_METHOD_SIGNATURE];
-			int length;
-			signature_to_string(&signature, name, &length);
-			if (table_get(&klass->methods, copy_string(name, length), &method)) {
-				find = true;
-				break;
-			}
-		}
-
-		if (!find) {
-			return false;
-		}
+		Signature signature = { name->chars, name->length, SIG_METHOD, i };
+		char str[MAX_METHOD_SIGNATURE];
+		int length;
+		signature_to_string(&signature, str, &length);
+		method = find_method(klass, method_symbol_find(str, length));
 	}
+	return method;
+}
 
-	ASSERT(IS_METHOD(method), "Error method type.");
-	ObjMethod* obj_method = AS_METHOD(method);
-	ASSERT(obj_method->type == METHOD_BLOCK, "Method should be block.");
-	ObjBoundMethod* bound = new_bound_method(peek(0), obj_method->as.closure);
+static void create_bound_method(ObjMethod* method)
+{
+	ASSERT(method->type == METHOD_BLOCK, "Method should be block.");
+	ObjBoundMethod* bound = new_bound_method(peek(0), method->as.closure);
 	pop();
 	push(OBJ_VAL(bound));
-	return true;
 }
 
 static ObjUpvalue* capture_upvalue(Value* local)
@@ -541,6 +889,7 @@ static void close_upvalues(Value* last)
 		ObjUpvalue* upvalue = vm.open_upvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
+		write_barrier((Obj*)upvalue, upvalue->closed);
 		vm.open_upvalues = upvalue->next;
 	}
 }
@@ -581,7 +930,7 @@ static VesselForeignMethodFn find_foreign_method(const char* moduleName, const c
 	return method;
 }
 
-static void define_method(ObjString* name, int method_type, ObjModule* module)
+static void define_method(int symbol, int method_type, ObjModule* module)
 {
 	Value class = peek(0);
 	ASSERT(IS_CLASS(class), "Should be a class.");
@@ -611,13 +960,14 @@ static void define_method(ObjString* name, int method_type, ObjModule* module)
 
 		method->type = METHOD_BLOCK;
 		method->as.closure = AS_CLOSURE(method_val);
+		write_barrier((Obj*)method, method_val);
 	}
 
 	if (method_type == OP_METHOD_STATIC) {
 		klass = klass->obj.class_obj;
 	}
 
-	table_set(&klass->methods, name, OBJ_VAL(method));
+	bind_method(klass, symbol, method);
 	pop_root();	// method
 	pop();
 	pop();
@@ -645,6 +995,16 @@ static void concatenate()
 	push(OBJ_VAL(result));
 }
 
+#if OPT_RANDOM
+static VesselArtifact* random_artifact = NULL;
+#endif
+#if OPT_MATH
+static VesselArtifact* math_artifact = NULL;
+#endif
+#if OPT_IO
+static VesselArtifact* io_artifact = NULL;
+#endif
+
 static Value import_module(Value name)
 {
 	if (!IS_STRING(name)) {
@@ -670,34 +1030,37 @@ static Value import_module(Value name)
 	}
 
 	// If the host didn't provide it, see if it's a built in optional module.
-	if (result.source == NULL)
+	// Those are compiled once per process and shared by every VM.
+	if (result.source == NULL && result.artifact == NULL)
 	{
 		result.on_complete = NULL;
 #if OPT_RANDOM
 		if (strncmp(name_str->chars, "random", name_str->length) == 0) {
-			result.source = RandomSource();
+			result.artifact = cached_artifact(&random_artifact, "random", RandomSource());
 		}
 #endif
 #if OPT_MATH
 		if (strncmp(name_str->chars, "math", name_str->length) == 0) {
-			result.source = MathSource();
+			result.artifact = cached_artifact(&math_artifact, "math", MathSource());
 		}
 #endif
 #if OPT_IO
 		if (strncmp(name_str->chars, "io", name_str->length) == 0) {
-			result.source = IOSource();
+			result.artifact = cached_artifact(&io_artifact, "io", IOSource());
 		}
 #endif
 	}
 
-	if (result.source == NULL)
+	if (result.source == NULL && result.artifact == NULL)
 	{
 		runtime_error("Could not load module %s.", name_str->chars);
 		pop(); // name.
 		return NIL_VAL;
 	}
 
-	ObjClosure* module_closure = compile(name_str->chars, result.source);
+	ObjClosure* module_closure = result.artifact != NULL
+		? thaw_module(result.artifact)
+		: compile(name_str->chars, result.source);
 
 	// Now that we're done, give the result back in case there's cleanup to do.
 	if (result.on_complete) {
@@ -747,7 +1110,7 @@ static void bind_foreign_class(ObjClass* class_obj, ObjModule* module)
 		ObjMethod* method = new_method();
 		method->type = METHOD_FOREIGN;
 		method->as.foreign = methods.allocate;
-		table_set(&class_obj->methods, vm.allocate_str, OBJ_VAL(method));
+		bind_method(class_obj, vm.allocate_symbol, method);
 	}
 
 	if (methods.finalize != NULL)
@@ -755,340 +1118,749 @@ static void bind_foreign_class(ObjClass* class_obj, ObjModule* module)
 		ObjMethod* method = new_method();
 		method->type = METHOD_FOREIGN;
 		method->as.foreign = (VesselForeignMethodFn)methods.finalize;
-		table_set(&class_obj->methods, vm.finalize_str, OBJ_VAL(method));
+		bind_method(class_obj, vm.finalize_symbol, method);
+	}
+}
+
+// Returns the variable [name] of [module], or of Core if the module does not
+// declare it. Returns UNDEFINED_VAL if neither defines it.
+static Value find_module_variable(ObjModule* module, const char* name, int length)
+{
+	int symbol = symbol_table_find(&module->variable_names, name, length);
+	if (symbol == -1 && module != vm.core_module)
+	{
+		module = vm.core_module;
+		symbol = symbol_table_find(&module->variable_names, name, length);
+	}
+	return symbol == -1 ? UNDEFINED_VAL : module->variables.values[symbol];
+}
+
+// Returns Core's slot for the variable [name] of [module], or -1 if it does
+// not shadow one of Core's.
+static int shadowed_core_variable(ObjModule* module, const char* name, int length)
+{
+	if (vm.core_module == NULL || module == vm.core_module) {
+		return -1;
+	}
+	return symbol_table_find(&vm.core_module->variable_names, name, length);
+}
+
+int add_module_variable(ObjModule* module, const char* name, int length)
+{
+	int symbol = symbol_table_add(&module->variable_names, name, length);
+	write_barrier((Obj*)module, module->variable_names.values[symbol]);
+
+	Value value = UNDEFINED_VAL;
+	int core_symbol = shadowed_core_variable(module, name, length);
+	if (core_symbol != -1)
+	{
+		value = vm.core_module->variables.values[core_symbol];
+		module->core_shadows++;
+	}
+	write_value_array(&module->variables, value);
+	write_barrier((Obj*)module, value);
+	return symbol;
+}
+
+void reset_module_variables(ObjModule* module)
+{
+	for (int i = 0; i < module->variables.count; i++)
+	{
+		ObjString* name = AS_STRING(module->variable_names.values[i]);
+		int core_symbol = shadowed_core_variable(module, name->chars, name->length);
+		Value value = core_symbol == -1 ? UNDEFINED_VAL : vm.core_module->variables.values[core_symbol];
+		module->variables.values[i] = value;
+		write_barrier((Obj*)module, value);
+	}
+}
+
+// Rewrites the by-name global access that ends just before [ip] into the
+// equivalent slot access, so later executions skip the name lookup. Both forms
+// are an opcode followed by a short operand.
+static inline void patch_module_var(uint8_t* ip, OpCode op, int symbol)
+{
+	ip[-3] = op;
+	ip[-2] = (symbol >> 8) & 0xff;
+	ip[-1] = symbol & 0xff;
+}
+
+bool can_switch_fiber()
+{
+	return vm.fiber == vm.main_fiber || vm.frame_count_begin == 0;
+}
+
+// Parks the running fiber for the host and returns to the main fiber. The
+// frames the current host call pushed on the main fiber are discarded, since
+// that call is about to return.
+static void park_fiber()
+{
+	ObjFiber* fiber = vm.fiber;
+	if (fiber->state != FIBER_DONE) {
+		write_value_array(&vm.held_fibers, OBJ_VAL(fiber));
+	}
+
+	// Nothing may return into the discarded frames later.
+	for (ObjFiber* waiting = fiber; waiting != NULL; waiting = waiting->caller)
+	{
+		if (waiting->caller == vm.main_fiber) {
+			waiting->caller = NULL;
+			break;
+		}
+	}
+
+	save_fiber(fiber);
+	load_fiber(vm.main_fiber);
+
+	if (vm.frame_count > vm.frame_count_begin)
+	{
+		Value* base = vm.frames[vm.frame_count_begin].slots;
+		close_upvalues(base);
+		vm.stack_top = base;
+		vm.frame_count = vm.frame_count_begin;
+	}
+}
+
+// Carries out the switch a fiber primitive or a finished fiber requested.
+// Returns VES_INTERPRET_SUSPENDED if the running fiber was parked for the host
+// instead, and VES_INTERPRET_RUNTIME_ERROR if the next fiber failed to start.
+static VesselInterpretResult switch_fiber()
+{
+	ObjFiber* next = vm.next_fiber;
+	Value value = vm.fiber_value;
+	vm.fiber_switch = false;
+	vm.next_fiber = NULL;
+	vm.fiber_value = NIL_VAL;
+
+	if (next == NULL) {
+		park_fiber();
+		return VES_INTERPRET_SUSPENDED;
 	}
+
+	save_fiber(vm.fiber);
+	load_fiber(next);
+
+	if (next->state == FIBER_NEW)
+	{
+		next->state = FIBER_ACTIVE;
+		ObjClosure* closure = next->closure;
+		push(OBJ_VAL(closure));
+		if (closure->function->arity == 1) {
+			push(value);
+		}
+		// Compiling a lazy body can fail, which has reported the error.
+		if (!call(closure, closure->function->arity)) {
+			return VES_INTERPRET_RUNTIME_ERROR;
+		}
+		return VES_INTERPRET_OK;
+	}
+
+	// The call that gave up control left a slot for its result on top.
+	next->state = FIBER_ACTIVE;
+	vm.stack_top[-1] = value;
+	return VES_INTERPRET_OK;
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_instruction(CallFrame* frame, uint8_t* ip)
+{
+	printf("          ");
+	for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+		printf("[ ");
+		dump_value(*slot, true);
+		printf(" ]");
+	}
+	printf("\n");
+
+	ObjFunction* function = frame->closure->function;
+	disassemble_instruction(&function->chunk, (int)(ip - function->chunk.code));
+}
+#endif // DEBUG_TRACE_EXECUTION
+
+#ifdef DEBUG_PRINT_OPCODE
+static void print_opcode(uint8_t instruction)
+{
+#define FUNCTION_NAME(name) #name
+	static const char* names[255] = {
+#define OPCODE(name, _) FUNCTION_NAME(OP_##name),
+#include "opcodes.h"
+#undef OPCODE
+	};
+#undef FUNCTION_NAME
+	printf("%s\n", names[instruction]);
+}
+#endif // DEBUG_PRINT_OPCODE
+
 static VesselInterpretResult run()
 {
 	STAT_TIMER_START
 
-	CallFrame* frame = &vm.frames[vm.frame_count - 1];
+	// Hot state of the current frame. It lives in locals so the compiler can
+	// keep it in registers, and is only written back to the CallFrame (see
+	// STORE_FRAME) before anything that may push a frame, run a nested
+	// interpreter or report an error.
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* slots;
+	Value* constants;
+	// Set when the frame runs code shared with other VMs, which must not be
+	// quickened or patched in place.
+	bool code_is_shared;
+	uint8_t instruction;
+
+#define STORE_FRAME() frame->ip = ip
+
+#define LOAD_FRAME()                                                   \
+    do {                                                               \
+        frame = &vm.frames[vm.frame_count - 1];                        \
+        ip = frame->ip;                                                \
+        slots = frame->slots;                                          \
+        constants = frame->closure->function->chunk.constants.values;  \
+        code_is_shared = frame->closure->function->chunk.artifact != NULL; \
+    } while (false)
+
+// Rewrites the opcode [offset] bytes before ip into [op], unless the code is
+// shared.
+#define QUICKEN(offset, op)                                            \
+    do {                                                               \
+        if (!code_is_shared) ip[offset] = op;                          \
+    } while (false)
+
+// Turns the quickened opcode [offset] bytes before ip back into the generic
+// [op] and runs that on the operands at ip. Shared code is never quickened,
+// but is run the same way without being written to, in case it came quickened.
+#define DEOPT(offset, op)                                              \
+    do {                                                               \
+        QUICKEN(offset, op);                                           \
+        DISPATCH_AS(op);                                               \
+    } while (false)
 
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 #define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define FUNC (frame->closure->function)
-#define READ_CONSTANT() \
-    (FUNC->chunk.constants.values[READ_SHORT()])
+#define READ_CONSTANT() (constants[READ_SHORT()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&FUNC->chunk.caches[READ_SHORT()])
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtime_error(__VA_ARGS__); \
+        return VES_INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+// Any call may have run a fiber primitive, which leaves the switch to us
+// since its arguments had to be popped off the old fiber's stack first.
+#define SWITCH_FIBER() \
+    do { \
+        if (vm.fiber_switch) { \
+            VesselInterpretResult switched = switch_fiber(); \
+            if (switched != VES_INTERPRET_OK) { \
+                return switched; \
+            } \
+        } \
+    } while (false)
+
+#define BINARY_OP(valueType, op) \
+    do { \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(valueType(a op b)); \
+    } while (false)
+
+// Pushes the negation of [a op b]. `<=` and `>=` negate the opposite
+// comparison, as they did when compiled to it followed by OP_NOT, so they
+// hold when an operand is NaN.
+#define NEGATED_COMPARE_OP(op) \
+    do { \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(BOOL_VAL(!(a op b))); \
+    } while (false)
 
-#define BINARY_OP(valueType, op) \
+// Compares the two operands [a] and [b] and jumps over [offset] bytes unless
+// [condition] holds. Both operands are popped either way.
+#define COMPARE_JUMP(condition) \
     do { \
+        uint16_t offset = READ_SHORT(); \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtime_error("Operands must be numbers."); \
-            return VES_INTERPRET_RUNTIME_ERROR; \
+            RUNTIME_ERROR("Operands must be numbers."); \
         } \
         double b = AS_NUMBER(pop()); \
         double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        if (!(condition)) ip += offset; \
     } while (false)
 
-	for (;;)
-	{
 #ifdef DEBUG_TRACE_EXECUTION
-		printf("          ");
-		for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-			printf("[ ");
-			dump_value(*slot, true);
-			printf(" ]");
-		}
-		printf("\n");
-
-		disassembleInstruction(&FUNC->chunk, (int)(frame->ip - FUNC->chunk.code));
-#endif
+#define DEBUG_TRACE_INSTRUCTIONS() trace_instruction(frame, ip)
+#else
+#define DEBUG_TRACE_INSTRUCTIONS() do { } while (false)
+#endif // DEBUG_TRACE_EXECUTION
 
-		uint8_t instruction = READ_BYTE();
 #ifdef DEBUG_PRINT_OPCODE
-#define FUNCTION_NAME(name) #name
-		const char* names[255] = {
-#define OPCODE(name) FUNCTION_NAME(OP_##name),
+#define DEBUG_PRINT_INSTRUCTION() print_opcode(instruction)
+#else
+#define DEBUG_PRINT_INSTRUCTION() do { } while (false)
+#endif // DEBUG_PRINT_OPCODE
+
+#if VES_COMPUTED_GOTO
+
+	static void* dispatch_table[] = {
+#define OPCODE(name, _) &&code_##name,
 #include "opcodes.h"
 #undef OPCODE
-		};
-#undef FUNCTION_NAME
-		printf("%s\n", names[instruction]);
-#endif // DEBUG_PRINT_OPCODE
-		switch (instruction)
-		{
-		case OP_CONSTANT: {
-			Value constant = READ_CONSTANT();
-			push(constant);
-			break;
-		}
-		case OP_NIL: push(NIL_VAL); break;
-		case OP_TRUE: push(BOOL_VAL(true)); break;
-		case OP_FALSE: push(BOOL_VAL(false)); break;
-		case OP_POP: pop(); break;
+	};
 
-		case OP_GET_LOCAL: {
-			uint16_t slot = READ_SHORT();
-			push(frame->slots[slot]);
-			break;
-		}
+#define INTERPRET_LOOP DISPATCH();
+#define CASE_CODE(name) code_##name
 
-		case OP_SET_LOCAL: {
-			uint16_t slot = READ_SHORT();
-			frame->slots[slot] = peek(0);
-			break;
-		}
+#define DISPATCH() \
+    do { \
+        DEBUG_TRACE_INSTRUCTIONS(); \
+        instruction = READ_BYTE(); \
+        DEBUG_PRINT_INSTRUCTION(); \
+        goto *dispatch_table[instruction]; \
+    } while (false)
+
+#define DISPATCH_AS(op) goto *dispatch_table[op]
+
+#else
+
+#define INTERPRET_LOOP \
+    loop: \
+        DEBUG_TRACE_INSTRUCTIONS(); \
+        instruction = READ_BYTE(); \
+        DEBUG_PRINT_INSTRUCTION(); \
+    dispatch: \
+        switch (instruction)
+
+#define CASE_CODE(name) case OP_##name
+#define DISPATCH() goto loop
+#define DISPATCH_AS(op) \
+    do { \
+        instruction = op; \
+        goto dispatch; \
+    } while (false)
+
+#endif // VES_COMPUTED_GOTO
+
+	LOAD_FRAME();
+
+	INTERPRET_LOOP
+	{
+		CASE_CODE(CONSTANT):
+			push(READ_CONSTANT());
+			DISPATCH();
+
+		CASE_CODE(NIL): push(NIL_VAL); DISPATCH();
+		CASE_CODE(TRUE): push(BOOL_VAL(true)); DISPATCH();
+		CASE_CODE(FALSE): push(BOOL_VAL(false)); DISPATCH();
+		CASE_CODE(POP): pop(); DISPATCH();
+
+		CASE_CODE(GET_LOCAL):
+			push(slots[READ_SHORT()]);
+			DISPATCH();
 
-		case OP_GET_GLOBAL: {
+		CASE_CODE(GET_LOCAL_2):
+			push(slots[READ_SHORT()]);
+			push(slots[READ_SHORT()]);
+			DISPATCH();
+
+		CASE_CODE(SET_LOCAL):
+			slots[READ_SHORT()] = peek(0);
+			DISPATCH();
+
+		CASE_CODE(GET_GLOBAL): {
 			ObjString* name = READ_STRING();
 #ifdef DEBUG_PRINT_OPCODE
 			printf("++ name %s\n", name->chars);
 #endif // DEBUG_PRINT_OPCODE
-			int symbol = symbol_table_find(&FUNC->module->variable_names, name->chars, name->length);
-			if (symbol == -1) {
-				runtime_error("Undefined variable '%s'.", name->chars);
-				return VES_INTERPRET_RUNTIME_ERROR;
+			ObjModule* module = FUNC->module;
+			OpCode op = OP_LOAD_MODULE_VAR;
+			int symbol = symbol_table_find(&module->variable_names, name->chars, name->length);
+			if (symbol == -1 && module != vm.core_module)
+			{
+				module = vm.core_module;
+				op = OP_LOAD_CORE_VAR;
+				symbol = symbol_table_find(&module->variable_names, name->chars, name->length);
 			}
-			push(FUNC->module->variables.values[symbol]);
-			break;
+			if (symbol == -1 || IS_UNDEFINED(module->variables.values[symbol])) {
+				RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+			}
+			if (!code_is_shared) {
+				patch_module_var(ip, op, symbol);
+			}
+			push(module->variables.values[symbol]);
+			DISPATCH();
 		}
 
-		case OP_DEFINE_GLOBAL: {
-			ObjString* name = READ_STRING();
-#ifdef DEBUG_PRINT_OPCODE
-			printf("++ name %s\n", name->chars);
-#endif // DEBUG_PRINT_OPCODE
-			int symbol = DefineVariable(FUNC->module, name->chars, name->length, peek(0), NULL);
-			if (symbol == -1) {
-				int symbol = symbol_table_find(&FUNC->module->variable_names, name->chars, name->length);
-				if (symbol == -1) {
-					runtime_error("Undefined variable '%s'.", name->chars);
-					return VES_INTERPRET_RUNTIME_ERROR;
-				}
-				FUNC->module->variables.values[symbol] = peek(0);
-			}
-			pop();
-			break;
+		CASE_CODE(DEFINE_GLOBAL): {
+			Value value = pop();
+			FUNC->module->variables.values[READ_SHORT()] = value;
+			write_barrier((Obj*)FUNC->module, value);
+			DISPATCH();
 		}
 
-		case OP_SET_GLOBAL: {
+		CASE_CODE(SET_GLOBAL): {
 			ObjString* name = READ_STRING();
 #ifdef DEBUG_PRINT_OPCODE
 			printf("++ name %s\n", name->chars);
 #endif // DEBUG_PRINT_OPCODE
 			int symbol = symbol_table_find(&FUNC->module->variable_names, name->chars, name->length);
-			if (symbol == -1) {
-				runtime_error("Undefined variable '%s'.", name->chars);
-				return VES_INTERPRET_RUNTIME_ERROR;
+			if (symbol == -1 || IS_UNDEFINED(FUNC->module->variables.values[symbol])) {
+				RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+			}
+			if (!code_is_shared) {
+				patch_module_var(ip, OP_STORE_MODULE_VAR, symbol);
 			}
 			FUNC->module->variables.values[symbol] = peek(0);
-			break;
+			write_barrier((Obj*)FUNC->module, peek(0));
+			DISPATCH();
 		}
 
-		case OP_GET_UPVALUE: {
-			uint16_t slot = READ_SHORT();
-			push(*frame->closure->upvalues[slot]->location);
-			break;
-		}
+		CASE_CODE(GET_UPVALUE):
+			push(*frame->closure->upvalues[READ_SHORT()]->location);
+			DISPATCH();
 
-		case OP_SET_UPVALUE: {
-			uint16_t slot = READ_SHORT();
-			*frame->closure->upvalues[slot]->location = peek(0);
-			break;
+		CASE_CODE(SET_UPVALUE): {
+			ObjUpvalue* upvalue = frame->closure->upvalues[READ_SHORT()];
+			*upvalue->location = peek(0);
+			write_barrier((Obj*)upvalue, peek(0));
+			DISPATCH();
 		}
 
-		case OP_GET_PROPERTY: {
+		CASE_CODE(GET_PROPERTY): {
 			Value receiver = peek(0);
+			ObjString* name = READ_STRING();
+			InlineCache* cache = READ_CACHE();
+			STORE_FRAME();
 			if (IS_INSTANCE(receiver))
 			{
 				ObjInstance* instance = AS_INSTANCE(receiver);
-				ObjString* name = READ_STRING();
+
+				int slot = shape_find_field(instance->shape, name);
+				if (slot != -1) {
+					if (cache->deopts < QUICKEN_MAX_DEOPTS) {
+						cache->shape = instance->shape;
+						cache->field_slot = (uint16_t)slot;
+						QUICKEN(-5, OP_GET_FIELD_CACHED);
+					}
+					vm.stack_top[-1] = *instance_field(instance, slot);
+					DISPATCH();
+				}
 
 				Value value;
-				if (table_get(&instance->fields, name, &value)) {
-					pop(); // Instance.
-					push(value);
-					break;
+				if (instance->dictionary != NULL && table_get(instance->dictionary, name, &value)) {
+					vm.stack_top[-1] = value;
+					DISPATCH();
 				}
-				if (!bind_method(instance->klass, name)) {
-					//push(NIL_VAL);
-					runtime_error("Unknown property %s.", name->chars);
+
+				ObjMethod* method = inline_cache_find(cache, instance->klass);
+				if (method == NULL)
+				{
+					method = find_bindable_method(instance->klass, name);
+					if (method == NULL) {
+						RUNTIME_ERROR("Unknown property %s.", name->chars);
+					}
+					inline_cache_add(cache, instance->klass, method);
 				}
+				create_bound_method(method);
 			}
 			else
 			{
 				ObjClass* class_obj = get_class(receiver);
 				if (class_obj == NULL) {
-					runtime_error("Unknown type, no class_obj.");
-					return VES_INTERPRET_RUNTIME_ERROR;
+					RUNTIME_ERROR("Unknown type, no class_obj.");
 				}
 
-				ObjString* name = READ_STRING();
-
-				Value value;
-				if (table_get(&class_obj->methods, name, &value))
+				ObjMethod* method = inline_cache_find(cache, class_obj);
+				if (method == NULL)
 				{
-					pop();
-					if (IS_METHOD(value))
-					{
-						ObjMethod* method = AS_METHOD(value);
-						switch (method->type)
-						{
-						case METHOD_PRIMITIVE:
-							STAT_UP_TIMES(method);
-							STAT_TIMER_START
-							if (method->as.primitive(vm.stack_top)) {
-								STAT_TIMER_END(method)
-								vm.stack_top += 1;
-							} else {
-								STAT_TIMER_END(method)
-								runtime_error("Run primitive fail.");
-								return VES_INTERPRET_RUNTIME_ERROR;
-							}
-							break;
-						//case METHOD_FUNCTION_CALL:
-						//	break;
-						//case METHOD_FOREIGN:
-						//	break;
-						//case METHOD_BLOCK:
-						//	break;
-						//case METHOD_NONE:
-						//	break;
-						default:
-							ASSERT(false, "Unknown method type.");
-						}
+					method = find_method(class_obj, method_symbol_find(name->chars, name->length));
+					if (method == NULL) {
+						DISPATCH();
 					}
-					else
-					{
-						push(value);
+					inline_cache_add(cache, class_obj, method);
+				}
+
+				pop();
+				switch (method->type)
+				{
+				case METHOD_PRIMITIVE:
+					STAT_UP_TIMES(method);
+					STAT_TIMER_START
+					if (method->as.primitive(vm.stack_top)) {
+						STAT_TIMER_END(method)
+						vm.stack_top += 1;
+					} else {
+						STAT_TIMER_END(method)
+						RUNTIME_ERROR("Run primitive fail.");
 					}
 					break;
+				//case METHOD_FUNCTION_CALL:
+				//	break;
+				//case METHOD_FOREIGN:
+				//	break;
+				//case METHOD_BLOCK:
+				//	break;
+				//case METHOD_NONE:
+				//	break;
+				default:
+					ASSERT(false, "Unknown method type.");
 				}
 			}
-			break;
+			DISPATCH();
 		}
 
-		case OP_SET_PROPERTY: {
+		CASE_CODE(SET_PROPERTY): {
+			ObjString* name = READ_STRING();
+			InlineCache* cache = READ_CACHE();
 			if (!IS_INSTANCE(peek(1))) {
-				runtime_error("Only instances have fields.");
-				return VES_INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Only instances have fields.");
 			}
 
 			ObjInstance* instance = AS_INSTANCE(peek(1));
-			table_set(&instance->fields, READ_STRING(), peek(0));
+			if (!instance_set_field(instance, name, peek(0)) &&
+				instance->dictionary == NULL && cache->deopts < QUICKEN_MAX_DEOPTS) {
+				// Only quicken stores to existing slots. Adding one changes
+				// the shape, so the cached shape would never match again.
+				cache->shape = instance->shape;
+				cache->field_slot = (uint16_t)shape_find_field(instance->shape, name);
+				QUICKEN(-5, OP_SET_FIELD_CACHED);
+			}
 
 			Value value = pop();
 			pop();
 			push(value);
-			break;
+			DISPATCH();
+		}
+
+		CASE_CODE(GET_FIELD_CACHED): {
+			ip += 2; // Name.
+			InlineCache* cache = READ_CACHE();
+			Value receiver = peek(0);
+			if (IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->shape == cache->shape) {
+				vm.stack_top[-1] = *instance_field(AS_INSTANCE(receiver), cache->field_slot);
+				DISPATCH();
+			}
+
+			cache->deopts++;
+			ip -= 4;
+			DEOPT(-1, OP_GET_PROPERTY);
+		}
+
+		CASE_CODE(SET_FIELD_CACHED): {
+			ip += 2; // Name.
+			InlineCache* cache = READ_CACHE();
+			Value receiver = peek(1);
+			if (IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->shape == cache->shape) {
+				*instance_field(AS_INSTANCE(receiver), cache->field_slot) = peek(0);
+				write_barrier(AS_OBJ(receiver), peek(0));
+				vm.stack_top[-2] = vm.stack_top[-1];
+				vm.stack_top--;
+				DISPATCH();
+			}
+
+			cache->deopts++;
+			ip -= 4;
+			DEOPT(-1, OP_SET_PROPERTY);
 		}
 
-		case OP_GET_SUPER: {
+		CASE_CODE(GET_SUPER): {
 			ObjString* name = READ_STRING();
 			ObjClass* superclass = AS_CLASS(pop());
-			if (!bind_method(superclass, name)) {
-				return VES_INTERPRET_RUNTIME_ERROR;
+			ObjMethod* method = find_bindable_method(superclass, name);
+			if (method == NULL) {
+				RUNTIME_ERROR("Undefined property '%s'.", name->chars);
 			}
-			break;
+			create_bound_method(method);
+			DISPATCH();
 		}
 
-		case OP_EQUAL: {
+		CASE_CODE(EQUAL): {
 			Value b = pop();
 			Value a = pop();
 			push(BOOL_VAL(values_equal(a, b)));
-			break;
+			DISPATCH();
 		}
 
-		case OP_GREATER:  BINARY_OP(BOOL_VAL, > ); break;
-		case OP_LESS:     BINARY_OP(BOOL_VAL, < ); break;
+		CASE_CODE(NOT_EQUAL): {
+			Value b = pop();
+			Value a = pop();
+			push(BOOL_VAL(!values_equal(a, b)));
+			DISPATCH();
+		}
+
+		CASE_CODE(GREATER):       BINARY_OP(BOOL_VAL, > ); DISPATCH();
+		CASE_CODE(GREATER_EQUAL): NEGATED_COMPARE_OP(< ); DISPATCH();
+		CASE_CODE(LESS):          BINARY_OP(BOOL_VAL, < ); DISPATCH();
+		CASE_CODE(LESS_EQUAL):    NEGATED_COMPARE_OP(> ); DISPATCH();
 
-		case OP_ADD: {
+		CASE_CODE(ADD): {
 			if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+				QUICKEN(-1, OP_ADD_STR);
+				STORE_FRAME();
 				concatenate();
 			} else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+				QUICKEN(-1, OP_ADD_NUM);
 				double b = AS_NUMBER(pop());
 				double a = AS_NUMBER(pop());
 				push(NUMBER_VAL(a + b));
 			} else {
-				runtime_error("Operands must be two numbers or two strings.");
-				return VES_INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
 			}
-			break;
+			DISPATCH();
+		}
+
+		CASE_CODE(ADD_NUM): {
+			Value b = peek(0);
+			Value a = peek(1);
+			if (IS_NUMBER(a) && IS_NUMBER(b)) {
+				vm.stack_top[-2] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+				vm.stack_top--;
+				DISPATCH();
+			}
+
+			DEOPT(-1, OP_ADD);
+		}
+
+		CASE_CODE(ADD_STR): {
+			if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+				STORE_FRAME();
+				concatenate();
+				DISPATCH();
+			}
+
+			DEOPT(-1, OP_ADD);
 		}
-		case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-		case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-		case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, / ); break;
-		case OP_NOT:
+		CASE_CODE(ADD_LOCAL_CONST): {
+			Value a = slots[READ_SHORT()];
+			Value b = READ_CONSTANT();
+			if (!IS_NUMBER(a)) {
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
+			}
+
+			push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+			DISPATCH();
+		}
+
+		CASE_CODE(INCREMENT_LOCAL): {
+			Value* local = &slots[READ_SHORT()];
+			Value amount = READ_CONSTANT();
+			if (!IS_NUMBER(*local)) {
+				RUNTIME_ERROR("Operands must be two numbers or two strings.");
+			}
+
+			*local = NUMBER_VAL(AS_NUMBER(*local) + AS_NUMBER(amount));
+			DISPATCH();
+		}
+
+		CASE_CODE(SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+		CASE_CODE(MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+		CASE_CODE(DIVIDE):   BINARY_OP(NUMBER_VAL, / ); DISPATCH();
+		CASE_CODE(NOT):
 			push(BOOL_VAL(is_falsey(pop())));
-			break;
-		case OP_NEGATE:
+			DISPATCH();
+		CASE_CODE(NEGATE):
 			if (!IS_NUMBER(peek(0))) {
-				runtime_error("Operand must be a number.");
-				return VES_INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Operand must be a number.");
 			}
 
 			push(NUMBER_VAL(-AS_NUMBER(pop())));
-			break;
+			DISPATCH();
 
-		case OP_JUMP: {
+		CASE_CODE(JUMP): {
 			uint16_t offset = READ_SHORT();
-			frame->ip += offset;
-			break;
+			ip += offset;
+			DISPATCH();
 		}
 
-		case OP_JUMP_IF_FALSE: {
+		CASE_CODE(JUMP_IF_FALSE): {
 			uint16_t offset = READ_SHORT();
-			if (is_falsey(peek(0))) frame->ip += offset;
-			break;
+			if (is_falsey(peek(0))) ip += offset;
+			DISPATCH();
 		}
 
-		case OP_LOOP: {
+		CASE_CODE(POP_JUMP_IF_FALSE): {
 			uint16_t offset = READ_SHORT();
-			frame->ip -= offset;
-			break;
+			if (is_falsey(pop())) ip += offset;
+			DISPATCH();
+		}
+
+		CASE_CODE(LESS_JUMP_IF_FALSE):          COMPARE_JUMP(a < b); DISPATCH();
+		CASE_CODE(LESS_EQUAL_JUMP_IF_FALSE):    COMPARE_JUMP(!(a > b)); DISPATCH();
+		CASE_CODE(GREATER_JUMP_IF_FALSE):       COMPARE_JUMP(a > b); DISPATCH();
+		CASE_CODE(GREATER_EQUAL_JUMP_IF_FALSE): COMPARE_JUMP(!(a < b)); DISPATCH();
+
+		CASE_CODE(LOOP): {
+			uint16_t offset = READ_SHORT();
+			ip -= offset;
+			if (vm.out_of_memory) {
+				vm.out_of_memory = false;
+				RUNTIME_ERROR("Out of memory.");
+			}
+			DISPATCH();
 		}
 
-		case OP_CALL: {
+		CASE_CODE(CALL): {
 			int arg_count = READ_BYTE();
+			STORE_FRAME();
 			if (!call_value(peek(arg_count), arg_count)) {
 				return VES_INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frame_count - 1];
-			break;
+			SWITCH_FIBER();
+			LOAD_FRAME();
+			DISPATCH();
 		}
 
-		case OP_CALL_0:
-		case OP_CALL_1:
-		case OP_CALL_2:
-		case OP_CALL_3:
-		case OP_CALL_4:
-		case OP_CALL_5:
-		case OP_CALL_6:
-		case OP_CALL_7:
-		case OP_CALL_8:
-		case OP_CALL_9:
-		case OP_CALL_10:
-		case OP_CALL_11:
-		case OP_CALL_12:
-		case OP_CALL_13:
-		case OP_CALL_14:
-		case OP_CALL_15:
-		case OP_CALL_16:
+		CASE_CODE(CALL_0):
+		CASE_CODE(CALL_1):
+		CASE_CODE(CALL_2):
+		CASE_CODE(CALL_3):
+		CASE_CODE(CALL_4):
+		CASE_CODE(CALL_5):
+		CASE_CODE(CALL_6):
+		CASE_CODE(CALL_7):
+		CASE_CODE(CALL_8):
+		CASE_CODE(CALL_9):
+		CASE_CODE(CALL_10):
+		CASE_CODE(CALL_11):
+		CASE_CODE(CALL_12):
+		CASE_CODE(CALL_13):
+		CASE_CODE(CALL_14):
+		CASE_CODE(CALL_15):
+		CASE_CODE(CALL_16):
 		{
 			// Add one for the implicit receiver argument.
 			int arg_count = instruction - OP_CALL_0 + 1;
-			ObjString* symbol = AS_STRING(vm.method_names.values[READ_SHORT()]);
+			int symbol = READ_SHORT();
+			InlineCache* cache = READ_CACHE();
+			STORE_FRAME();
 
 #ifdef DEBUG_PRINT_OPCODE
-			printf("++ name %s\n", symbol->chars);
+			printf("++ name %s\n", AS_CSTRING(vm.method_names.values[symbol]));
 #endif // DEBUG_PRINT_OPCODE
 
 			Value* args = vm.stack_top - arg_count;
 			ObjClass* class_obj = get_class(args[0]);
 			ASSERT(class_obj, "Should have class_obj.");
 
-			Value v_method;
-			if (!table_get(&class_obj->methods, symbol, &v_method)) {
-				runtime_error("Method %s does not implement.", symbol->chars);
-				return VES_INTERPRET_RUNTIME_ERROR;
+			ObjMethod* method = inline_cache_find(cache, class_obj);
+			if (method == NULL)
+			{
+				method = find_method(class_obj, symbol);
+				if (method == NULL) {
+					RUNTIME_ERROR("Method %s does not implement.", AS_CSTRING(vm.method_names.values[symbol]));
+				}
+				inline_cache_add(cache, class_obj, method);
 			}
-
-			ObjMethod* method = AS_METHOD(v_method);
 			STAT_UP_TIMES(method);
 			switch (method->type)
 			{
@@ -1100,8 +1872,7 @@ static VesselInterpretResult run()
 					vm.stack_top -= arg_count - 1;
 				} else {
 					STAT_TIMER_END(method)
-					runtime_error("Run primitive fail.");
-					return VES_INTERPRET_RUNTIME_ERROR;
+					RUNTIME_ERROR("Run primitive fail.");
 				}
 				break;
 			//case METHOD_FUNCTION_CALL:
@@ -1121,12 +1892,8 @@ static VesselInterpretResult run()
 			}
 				break;
 			case METHOD_BLOCK:
-				if (call(method->as.closure, arg_count - 1)) {
-					//// The result is now in the first arg slot. Discard the other stack slots.
-					//vm.stack_top -= arg_count - 1;
-					frame = &vm.frames[vm.frame_count - 1];
-				} else {
-					runtime_error("Run block fail.");
+				if (!call(method->as.closure, arg_count - 1)) {
+					return VES_INTERPRET_RUNTIME_ERROR;
 				}
 				break;
 			//case METHOD_NONE:
@@ -1134,31 +1901,42 @@ static VesselInterpretResult run()
 			default:
 				ASSERT(false, "Unknown method type.");
 			}
+			// Primitives and foreign methods may run a nested interpreter that
+			// grew the stack, so reload the frame after any call.
+			SWITCH_FIBER();
+			LOAD_FRAME();
+			DISPATCH();
 		}
-			break;
 
-		case OP_INVOKE: {
+		CASE_CODE(INVOKE): {
 			ObjString* method = READ_STRING();
 			int arg_count = READ_BYTE();
-			if (!invoke(method, arg_count)) {
+			int symbol = READ_SHORT();
+			InlineCache* cache = READ_CACHE();
+			STORE_FRAME();
+			if (!invoke(method, symbol, arg_count, cache)) {
 				return VES_INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frame_count - 1];
-			break;
+			SWITCH_FIBER();
+			LOAD_FRAME();
+			DISPATCH();
 		}
 
-		case OP_SUPER_INVOKE: {
+		CASE_CODE(SUPER_INVOKE): {
 			ObjString* method = READ_STRING();
 			int arg_count = READ_BYTE();
+			int symbol = READ_SHORT();
 			ObjClass* superclass = AS_CLASS(pop());
-			if (!invoke_from_class(superclass, method, arg_count)) {
+			STORE_FRAME();
+			if (!invoke_from_class(superclass, method, symbol, arg_count)) {
 				return VES_INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &vm.frames[vm.frame_count - 1];
-			break;
+			SWITCH_FIBER();
+			LOAD_FRAME();
+			DISPATCH();
 		}
 
-		case OP_CLOSURE: {
+		CASE_CODE(CLOSURE): {
 			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
 			ObjClosure* closure = new_closure(function);
 			push(OBJ_VAL(closure));
@@ -1166,83 +1944,148 @@ static VesselInterpretResult run()
 				uint8_t is_local = READ_BYTE();
 				uint16_t index = READ_SHORT();
 				if (is_local) {
-					closure->upvalues[i] = capture_upvalue(frame->slots + index);
+					closure->upvalues[i] = capture_upvalue(slots + index);
 				} else {
 					closure->upvalues[i] = frame->closure->upvalues[index];
 				}
+				// Capturing allocates, which may have promoted the closure.
+				write_barrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
 			}
-			break;
+			DISPATCH();
 		}
 
-		case OP_CLOSE_UPVALUE:
+		CASE_CODE(CLOSE_UPVALUE):
 			close_upvalues(vm.stack_top - 1);
 			pop();
-			break;
+			DISPATCH();
 
-		case OP_RETURN: {
+		CASE_CODE(RETURN): {
 			STAT_TIMER_END(frame->closure->function)
 
 			Value result = pop();
 
-			close_upvalues(frame->slots);
+			close_upvalues(slots);
 
 			vm.frame_count--;
-			if (vm.frame_count == vm.frame_count_begin) {
+			if (vm.frame_count == vm.frame_count_begin)
+			{
+				if (vm.frame_count == 0 && vm.fiber != vm.main_fiber)
+				{
+					// The fiber's function returned, so its caller (or the host,
+					// if there is none) resumes with the result.
+					vm.stack_top = vm.stack;
+					vm.fiber->state = FIBER_DONE;
+					vm.next_fiber = vm.fiber->caller;
+					vm.fiber_value = result;
+					vm.fiber->caller = NULL;
+					VesselInterpretResult switched = switch_fiber();
+					if (switched == VES_INTERPRET_SUSPENDED) {
+						return VES_INTERPRET_OK;
+					}
+					if (switched != VES_INTERPRET_OK) {
+						return switched;
+					}
+					LOAD_FRAME();
+					DISPATCH();
+				}
+
 				pop();
 				return VES_INTERPRET_OK;
 			}
 
-			vm.stack_top = frame->slots;
+			vm.stack_top = slots;
 			push(result);
 
-			frame = &vm.frames[vm.frame_count - 1];
-			break;
+			LOAD_FRAME();
+			DISPATCH();
 		}
 
-		case OP_CLASS:
-			push(OBJ_VAL(new_class(vm.object_class, 0, READ_STRING(), FUNC->module)));
-			break;
+		CASE_CODE(CLASS): {
+			ObjString* name = READ_STRING();
+			int num_fields = READ_BYTE();
+			push(OBJ_VAL(new_class(vm.object_class, num_fields, name, FUNC->module)));
+			DISPATCH();
+		}
 
-		case OP_FOREIGN_CLASS:
+		CASE_CODE(FOREIGN_CLASS):
 		{
 			ObjClass* class_obj = new_class(vm.object_class, -1, READ_STRING(), FUNC->module);
 			push(OBJ_VAL(class_obj));
+			STORE_FRAME();
 			bind_foreign_class(class_obj, FUNC->module);
+			DISPATCH();
 		}
-			break;
 
-		case OP_INHERIT: {
+		CASE_CODE(INHERIT): {
 			Value superclass = peek(1);
 			if (!IS_CLASS(superclass)) {
-				runtime_error("Superclass must be a class.");
-				return VES_INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Superclass must be a class.");
 			}
 
 			ObjClass* subclass = AS_CLASS(peek(0));
 			bind_superclass(subclass, AS_CLASS(superclass));
 			pop(); // Subclass.
-			break;
+			DISPATCH();
 		}
 
-		case OP_METHOD:
-		case OP_METHOD_STATIC:
-			define_method(READ_STRING(), instruction, FUNC->module);
-			break;
+		CASE_CODE(METHOD):
+		CASE_CODE(METHOD_STATIC):
+			define_method(READ_SHORT(), instruction, FUNC->module);
+			DISPATCH();
+
+		CASE_CODE(LOAD_MODULE_VAR): {
+			// A lazily compiled body addresses variables that are declared
+			// further down the module, whose definitions may not have run yet.
+			int symbol = READ_SHORT();
+			Value value = FUNC->module->variables.values[symbol];
+			if (IS_UNDEFINED(value)) {
+				RUNTIME_ERROR("Undefined variable '%s'.",
+					AS_CSTRING(FUNC->module->variable_names.values[symbol]));
+			}
+			push(value);
+			DISPATCH();
+		}
 
-		case OP_LOAD_MODULE_VAR:
-			push(FUNC->module->variables.values[READ_SHORT()]);
-			break;
+		CASE_CODE(STORE_MODULE_VAR): {
+			int symbol = READ_SHORT();
+			if (IS_UNDEFINED(FUNC->module->variables.values[symbol])) {
+				RUNTIME_ERROR("Undefined variable '%s'.",
+					AS_CSTRING(FUNC->module->variable_names.values[symbol]));
+			}
+			FUNC->module->variables.values[symbol] = peek(0);
+			write_barrier((Obj*)FUNC->module, peek(0));
+			DISPATCH();
+		}
 
-		case OP_STORE_MODULE_VAR:
-			FUNC->module->variables.values[READ_SHORT()] = peek(0);
-			break;
+		CASE_CODE(LOAD_CORE_VAR): {
+			int symbol = READ_SHORT();
+			ObjModule* module = FUNC->module;
+			if (module->core_shadows > 0)
+			{
+				// The module may have declared a variable of the same name
+				// since this was compiled, which shadows Core's from then on.
+				ObjString* name = AS_STRING(vm.core_module->variable_names.values[symbol]);
+				int shadow = symbol_table_find(&module->variable_names, name->chars, name->length);
+				if (shadow != -1)
+				{
+					if (!code_is_shared) {
+						patch_module_var(ip, OP_LOAD_MODULE_VAR, shadow);
+					}
+					push(module->variables.values[shadow]);
+					DISPATCH();
+				}
+			}
+			push(vm.core_module->variables.values[symbol]);
+			DISPATCH();
+		}
 
-		case OP_IMPORT_MODULE:
+		CASE_CODE(IMPORT_MODULE):
 		{
 			Value name = READ_CONSTANT();
 #ifdef DEBUG_PRINT_OPCODE
 			printf("++ name %s\n", AS_STRING(name)->chars);
 #endif // DEBUG_PRINT_OPCODE
+			STORE_FRAME();
 			push(import_module(name));
 			if (IS_CLOSURE(peek(0)))
 			{
@@ -1255,76 +2098,87 @@ static VesselInterpretResult run()
 				ASSERT(IS_MODULE(val), "Get module fail.");
 				vm.last_module = AS_MODULE(val);
 
-				//STORE_FRAME();
-				call(AS_CLOSURE(peek(0)), 0);
-				//LOAD_FRAME();
-
-				frame = &vm.frames[vm.frame_count - 1];
+				if (!call(AS_CLOSURE(peek(0)), 0)) {
+					return VES_INTERPRET_RUNTIME_ERROR;
+				}
+				LOAD_FRAME();
 			}
 			else
 			{
 				vm.last_module = AS_MODULE(peek(0));
 			}
+			DISPATCH();
 		}
-			break;
 
-		case OP_IMPORT_VARIABLE:
+		CASE_CODE(IMPORT_VARIABLE):
 		{
 			ObjString* variable = READ_STRING();
 #ifdef DEBUG_PRINT_OPCODE
 			printf("++ name %s\n", variable->chars);
 #endif // DEBUG_PRINT_OPCODE
 			ASSERT(vm.last_module != NULL, "Should have already imported module.");
-			int symbol = symbol_table_find(&vm.last_module->variable_names, variable->chars, variable->length);
-			if (symbol != -1) {
-				push(vm.last_module->variables.values[symbol]);
-			} else {
-				push(NIL_VAL);
-			}
+			Value value = find_module_variable(vm.last_module, variable->chars, variable->length);
+			push(IS_UNDEFINED(value) ? NIL_VAL : value);
+			DISPATCH();
 		}
-			break;
 
-		case OP_CONSTRUCT:
-			break;
+		CASE_CODE(CONSTRUCT):
+			DISPATCH();
 
-		case OP_FOREIGN_CONSTRUCT:
+		CASE_CODE(FOREIGN_CONSTRUCT):
 		{
-			ASSERT(IS_CLASS(frame->slots[0]), "'this' should be a class.");
+			ASSERT(IS_CLASS(slots[0]), "'this' should be a class.");
 
-			ObjClass* class_obj = AS_CLASS(frame->slots[0]);
+			ObjClass* class_obj = AS_CLASS(slots[0]);
 			ASSERT(class_obj->num_fields == -1, "Class must be a foreign class.");
 
-			Value value;
-			bool find = table_get(&class_obj->methods, vm.allocate_str, &value);
-			ASSERT(find, "Not find allocator.");
-
-			ObjMethod* method = AS_METHOD(value);
+			ObjMethod* method = find_method(class_obj, vm.allocate_symbol);
+			ASSERT(method != NULL, "Not find allocator.");
 			ASSERT(method->type == METHOD_FOREIGN, "Allocator should be foreign.");
 
 			// Pass the constructor arguments to the allocator as well.
 			ASSERT(vm.api_stack == NULL, "Cannot already be in foreign call.");
-			vm.api_stack = frame->slots;
+			vm.api_stack = slots;
 
+			STORE_FRAME();
 			STAT_UP_TIMES(method);
 			STAT_TIMER_START
 			method->as.foreign();
 			STAT_TIMER_END(method)
 
 			vm.api_stack = NULL;
+			LOAD_FRAME();
+			DISPATCH();
 		}
-			break;
 
-		case OP_END_MODULE:
+		CASE_CODE(END_MODULE):
 			vm.last_module = FUNC->module;
-			break;
-		}
+			DISPATCH();
 	}
 
+	// We should only exit this function from an explicit return or error.
+	UNREACHABLE();
+	return VES_INTERPRET_RUNTIME_ERROR;
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef QUICKEN
 #undef READ_BYTE
 #undef READ_SHORT
+#undef FUNC
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef RUNTIME_ERROR
+#undef SWITCH_FIBER
 #undef BINARY_OP
+#undef NEGATED_COMPARE_OP
+#undef COMPARE_JUMP
+#undef DEBUG_TRACE_INSTRUCTIONS
+#undef DEBUG_PRINT_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
 }
 
 int DefineVariable(ObjModule* module, const char* name, size_t length, Value value, int* line)
@@ -1340,8 +2194,9 @@ int DefineVariable(ObjModule* module, const char* name, size_t length, Value val
 	int symbol = symbol_table_find(&module->variable_names, name, length);
 	if (symbol == -1)
 	{
-		symbol = symbol_table_ensure(&module->variable_names, name, length);
-		write_value_array(&module->variables, value);
+		symbol = add_module_variable(module, name, (int)length);
+		module->variables.values[symbol] = value;
+		write_barrier((Obj*)module, value);
 	}
 	else
 	{
@@ -1355,26 +2210,6 @@ int DefineVariable(ObjModule* module, const char* name, size_t length, Value val
 	return symbol;
 }
 
-int FinalizeForeign(ObjForeign* foreign)
-{
-	ObjClass* class_obj = foreign->obj.class_obj;
-
-	Value value;
-	if (!table_get(&class_obj->methods, vm.finalize_str, &value)) {
-		return 0;
-	}
-
-	ObjMethod* method = AS_METHOD(value);
-	if (method->type == METHOD_NONE) {
-		return 0;
-	}
-
-	ASSERT(method->type == METHOD_FOREIGN, "Finalizer should be foreign.");
-
-	VesselFinalizerFn finalizer = (VesselFinalizerFn)method->as.foreign;
-	return finalizer(foreign->data);
-}
-
 VesselInterpretResult ves_interpret(const char* module, const char* source)
 {
 	int prev_begin = vm.frame_count_begin;
@@ -1397,8 +2232,14 @@ VesselInterpretResult ves_run(void* closure)
 
 	const int prev_top = ves_gettop();
 
+	if (!ensure_stack(1)) {
+		runtime_error("Out of memory.");
+		return VES_INTERPRET_RUNTIME_ERROR;
+	}
 	push(OBJ_VAL(closure));
-	call_value(OBJ_VAL(closure), 0);
+	if (!call_value(OBJ_VAL(closure), 0)) {
+		return VES_INTERPRET_RUNTIME_ERROR;
+	}
 
 	VesselInterpretResult ret = run();
 
@@ -1409,6 +2250,98 @@ VesselInterpretResult ves_run(void* closure)
 	return ret;
 }
 
+VesselFiber* ves_suspended_fiber()
+{
+	if (vm.held_fibers.count == 0) {
+		return NULL;
+	}
+	return (VesselFiber*)AS_FIBER(vm.held_fibers.values[vm.held_fibers.count - 1]);
+}
+
+void ves_run_finalizers()
+{
+	run_finalizers();
+}
+
+void ves_gc_stats(VesselGCStats* stats)
+{
+	*stats = vm.gc_stats;
+	stats->bytes_live = vm.bytes_allocated;
+	stats->next_gc = vm.next_gc;
+}
+
+const char* ves_gc_type_name(int type)
+{
+	// Indexed by ObjType.
+	static const char* names[VES_GC_OBJECT_TYPES] = {
+		"boundMethod", "class", "closure", "method", "function", "foreign",
+		"instance", "native", "string", "upvalue", "module", "list", "map",
+		"set", "range", "shape", "fiber"
+	};
+
+	if (type < 0 || type >= VES_GC_OBJECT_TYPES) {
+		return NULL;
+	}
+	return names[type];
+}
+
+void ves_release_fiber(VesselFiber* fiber)
+{
+	// Shift the rest down so the latest parked fiber stays last.
+	ValueArray* held = &vm.held_fibers;
+	for (int i = held->count - 1; i >= 0; i--)
+	{
+		if (AS_FIBER(held->values[i]) == (ObjFiber*)fiber)
+		{
+			memmove(&held->values[i], &held->values[i + 1], sizeof(Value) * (held->count - i - 1));
+			held->count--;
+			return;
+		}
+	}
+}
+
+VesselInterpretResult ves_resume_fiber(VesselFiber* handle)
+{
+	ObjFiber* fiber = (ObjFiber*)handle;
+	Value value = pop();
+	ves_release_fiber(handle);
+
+	if (vm.fiber != vm.main_fiber) {
+		runtime_error("Cannot resume a fiber from inside another fiber.");
+		return VES_INTERPRET_RUNTIME_ERROR;
+	}
+	if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+		runtime_error("Cannot resume a fiber that is running or finished.");
+		return VES_INTERPRET_RUNTIME_ERROR;
+	}
+
+	int prev_begin = vm.frame_count_begin;
+	vm.frame_count_begin = vm.frame_count;
+
+	vm.next_fiber = fiber;
+	vm.fiber_value = value;
+	VesselInterpretResult ret = switch_fiber();
+	if (ret == VES_INTERPRET_OK) {
+		ret = run();
+	}
+
+	vm.frame_count_begin = prev_begin;
+	return ret;
+}
+
+// Pushes on behalf of the embedding API. Unlike compiled code, callers of the
+// API have no stack reserved for them, so make room first. Like a failed heap
+// allocation, a stack that can't grow is left for the interpreter to raise, and
+// the value is dropped.
+static void api_push(Value value)
+{
+	if (!ensure_stack(1)) {
+		vm.out_of_memory = true;
+		return;
+	}
+	push(value);
+}
+
 static Value get_stack_value(int index)
 {
 	if (index >= 0)
@@ -1478,7 +2411,7 @@ void ves_geti(int index, int i)
 	uint32_t used_index = validate_index_value(elements->count, (double)i, "Index");
 	ASSERT(used_index != UINT32_MAX, "Index out of bounds.");
 
-	push(elements->values[used_index]);
+	api_push(elements->values[used_index]);
 }
 
 void ves_seti(int index, int i)
@@ -1492,6 +2425,7 @@ void ves_seti(int index, int i)
 	ASSERT(used_index != UINT32_MAX, "Index out of bounds.");
 
 	elements->values[used_index] = peek(0);
+	write_barrier(AS_OBJ(val), peek(0));
 }
 
 double ves_tonumber(int index)
@@ -1590,27 +2524,27 @@ const char* ves_optstring(int index, const char* d)
 
 void ves_pushnumber(double n)
 {
-	push(NUMBER_VAL(n));
+	api_push(NUMBER_VAL(n));
 }
 
 void ves_pushboolean(int b)
 {
-	push(BOOL_VAL(b != 0));
+	api_push(BOOL_VAL(b != 0));
 }
 
 void ves_pushstring(const char* s)
 {
-	push(OBJ_VAL(copy_string(s, strlen(s))));
+	api_push(OBJ_VAL(copy_string(s, strlen(s))));
 }
 
 void ves_pushlstring(const char* s, size_t len)
 {
-	push(OBJ_VAL(copy_string(s, len)));
+	api_push(OBJ_VAL(copy_string(s, len)));
 }
 
 void ves_pushnil()
 {
-	push(NIL_VAL);
+	api_push(NIL_VAL);
 }
 
 void ves_pop(int n)
@@ -1641,16 +2575,21 @@ void ves_setfield(int index, const char* k)
 {
 	Value val = get_stack_value(index);
 
+	ObjString* key = copy_string(k, strlen(k));
+	push_root((Obj*)key);
 	if (IS_MAP(val))
 	{
 		ObjMap* map = AS_MAP(val);
-		table_set(&map->entries, copy_string(k, strlen(k)), peek(0));
+		table_set(&map->entries, key, peek(0));
+		write_barrier((Obj*)map, OBJ_VAL(key));
+		write_barrier((Obj*)map, peek(0));
 	}
 	else if (IS_INSTANCE(val))
 	{
 		ObjInstance* inst = AS_INSTANCE(val);
-		table_set(&inst->fields, copy_string(k, strlen(k)), peek(0));
+		instance_set_field(inst, key, peek(0));
 	}
+	pop_root();
 }
 
 int ves_getfield(int index, const char* k)
@@ -1662,18 +2601,18 @@ int ves_getfield(int index, const char* k)
 		ObjMap* map = AS_MAP(val);
 		Value value = NIL_VAL;
 		table_get(&map->entries, copy_string(k, strlen(k)), &value);
-		push(value);
+		api_push(value);
 	}
 	else if (IS_INSTANCE(val))
 	{
 		ObjInstance* inst = AS_INSTANCE(val);
 		Value value = NIL_VAL;
-		table_get(&inst->fields, copy_string(k, strlen(k)), &value);
-		push(value);
+		instance_get_field(inst, copy_string(k, strlen(k)), &value);
+		api_push(value);
 	}
 	else
 	{
-		push(NIL_VAL);
+		api_push(NIL_VAL);
 	}
 
 	return ves_type(-1);
@@ -1683,13 +2622,12 @@ int ves_getglobal(const char* name)
 {
 	int ret = VES_TYPE_NULL;
 
-	int symbol = symbol_table_find(&vm.last_module->variable_names, name, strlen(name));
-	if (symbol != -1) {
-		Value val = vm.last_module->variables.values[symbol];
-		push(val);
+	Value val = find_module_variable(vm.last_module, name, strlen(name));
+	if (!IS_UNDEFINED(val)) {
+		api_push(val);
 		ret = ves_type(-1);
 	} else {
-		push(NIL_VAL);
+		api_push(NIL_VAL);
 	}
 
 	return ret;
@@ -1708,28 +2646,30 @@ VesselInterpretResult ves_call(int nargs, int nresults)
 	ObjClass* class_obj = get_class(args[0]);
 	ASSERT(class_obj, "Should have class_obj.");
 
-	Value v_method;
-	if (!table_get(&class_obj->methods, s_method, &v_method)) {
+	ObjMethod* method = find_method(class_obj, method_symbol_find(s_method->chars, s_method->length));
+	if (method == NULL) {
 		runtime_error("Method %s does not implement.", s_method->chars);
 		return VES_INTERPRET_RUNTIME_ERROR;
 	}
 
-	ObjMethod* method = AS_METHOD(v_method);
 	STAT_UP_TIMES(method);
 	switch (method->type)
 	{
 	case METHOD_BLOCK:
 		if (!call(method->as.closure, nargs)) {
-			runtime_error("Run block fail.");
+			vm.frame_count_begin = prev_begin;
+			return VES_INTERPRET_RUNTIME_ERROR;
 		}
 		break;
 	default:
 		runtime_error("Unknown method type.");
+		vm.frame_count_begin = prev_begin;
+		return VES_INTERPRET_RUNTIME_ERROR;
 	}
 
-	Value* stack_top = vm.stack_top - nargs;
+	int stack_top = ves_gettop() - nargs;
 	VesselInterpretResult ret = run();
-	vm.stack_top = stack_top;
+	vm.stack_top = vm.stack + stack_top;
 
 	vm.frame_count_begin = prev_begin;
 
@@ -1787,13 +2727,13 @@ void* ves_set_newforeign(int slot, int class_slot, size_t size)
 void ves_newlist(int num_elements)
 {
 	ObjList* list = new_list(num_elements);
-	push(OBJ_VAL(list));
+	api_push(OBJ_VAL(list));
 }
 
 void ves_newmap()
 {
 	ObjMap* map = new_map();
-	push(OBJ_VAL(map));
+	api_push(OBJ_VAL(map));
 }
 
 void ves_import_class(const char* module_name, const char* class_name)
@@ -1803,7 +2743,7 @@ void ves_import_class(const char* module_name, const char* class_name)
 	ObjModule* obj_module = (ObjModule*)(AS_OBJ(v_module));
 
 	int symbol = symbol_table_find(&obj_module->variable_names, class_name, strlen(class_name));
-	if (symbol != -1) {
+	if (symbol != -1 && !IS_UNDEFINED(obj_module->variables.values[symbol])) {
 		push(obj_module->variables.values[symbol]);
 	} else {
 		push(NIL_VAL);
@@ -4,42 +4,75 @@
 #include "common.h"
 #include "value.h"
 #include "object.h"
+#include "pool.h"
 #include "vessel.h"
 
-// Max depth of nested ves CLOSURE calls (call() errors "Stack overflow." at
-// this many frames). This is a VM-internal cap, NOT the native thread stack:
-// the interpreter dispatches calls through this fixed `frames` array, so the
-// process /STACK size is irrelevant to it. The default 256 is too shallow for
-// the editor's blueprint engine, which evaluates a graph by RECURSIVE pull
-// (Blueprint.calc_input_value -> node.calc_value -> calc_input_value -> ...):
-// eval depth tracks the longest data-dependency chain. A decompiled CAD history
-// (cadcvt RebuildHistory) of a real part is a long running-body spine -- e.g.
-// ZW3D R2900_50 is a 66-deep calc graph that, expanded into blueprint
-// fuse + Cache + pattern-Subgraph boundary nodes, needs ~350 frames and
-// overflowed at 256 on the first render (and on every re-eval after a param
-// edit). `vm` is a single global, so `frames` / `stack` live in BSS -- growing
-// them costs static address space only (the GC scans just the used prefix), so
-// 4096 simply lifts the ceiling for deep histories with ample headroom.
-#define FRAMES_MAX 4096
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Default for VesselConfiguration.max_frames, the max depth of nested ves
+// CLOSURE calls (call() errors "Stack overflow." past it). The editor's
+// blueprint engine evaluates a graph by RECURSIVE pull
+// (Blueprint.calc_input_value -> node.calc_value -> calc_input_value -> ...),
+// so eval depth tracks the longest data-dependency chain. A decompiled CAD
+// history (cadcvt RebuildHistory) of a real part is a long running-body spine --
+// e.g. ZW3D R2900_50 is a 66-deep calc graph that needs ~350 frames once
+// expanded into blueprint fuse + Cache + pattern-Subgraph boundary nodes -- so
+// 256 is too shallow. The frame array and value stack grow on demand, so a
+// high limit costs nothing until a script actually recurses that deep.
+#define DEFAULT_MAX_FRAMES 4096
+
+// Initial sizes of the frame array and the value stack.
+#define INITIAL_FRAMES 8
+#define INITIAL_STACK (UINT8_COUNT * 2)
+
+// Free stack slots kept above the deepest point of a frame, for the values the
+// VM pushes to keep alive while it allocates, such as new_class()'s.
+#define STACK_HEADROOM 16
 
 #define MAX_TEMP_ROOTS 8
 
+// Default for VesselConfiguration.gc_slice_budget_us.
+#define DEFAULT_GC_SLICE_BUDGET_US 500
+
+// Defaults for the VesselConfiguration fields that pace full collections.
+#define DEFAULT_GC_INITIAL_HEAP (1024 * 1024)
+#define DEFAULT_GC_MIN_GROWTH 2.0
+#define DEFAULT_GC_MAX_GROWTH 4.0
+
+// The most helper threads VesselConfiguration.gc_threads may ask for.
+#define MAX_GC_THREADS 64
+
 typedef enum
 {
-#define OPCODE(name) OP_##name,
+#define OPCODE(name, _) OP_##name,
 #include "opcodes.h"
 #undef OPCODE
 } OpCode;
 
-typedef struct
+// The phases of an incremental full collection, see gc_step().
+typedef enum
 {
-	ObjClosure* closure;
-	uint8_t* ip;
-	Value* slots;
-} CallFrame;
+	// No full collection is in progress.
+	GC_IDLE,
+	// Sweeping the pages the last collection left for the allocator, which has
+	// to be done before the marks can be reset.
+	GC_SWEEPING,
+	// Tracing from the roots, with the write barriers shading what the
+	// mutator stores into objects that were already traced.
+	GC_MARKING
+} GCState;
 
+// Objects that are marked but not traced yet. Each thread that marks has its
+// own.
 typedef struct
+{
+	int count;
+	int capacity;
+	Obj** objects;
+} GrayStack;
+
+typedef struct GCHelpers GCHelpers;
+typedef struct FinalizerThread FinalizerThread;
+
+typedef struct VesselVM
 {
 	ObjClass* bool_class;
 	ObjClass* class_class;
@@ -53,33 +86,107 @@ typedef struct
 	ObjClass* object_class;
 	ObjClass* system_class;
 	ObjClass* basic_class;
+	ObjClass* fiber_class;
 
 	ObjModule* last_module;
 
-	CallFrame frames[FRAMES_MAX];
+	// Every other module sees Core's variables through it instead of holding
+	// copies of its own.
+	ObjModule* core_module;
+
+	// The running fiber, whose stacks are the ones loaded below, and the fiber
+	// the host's calls start on.
+	ObjFiber* fiber;
+	ObjFiber* main_fiber;
+
+	// A fiber primitive can't switch stacks under the caller that still has to
+	// pop its arguments, so it only requests the switch: [next_fiber] (or NULL
+	// to park the running fiber and return to the host) resumes with
+	// [fiber_value] once the primitive returns.
+	bool fiber_switch;
+	ObjFiber* next_fiber;
+	Value fiber_value;
+
+	// Parked fibers the host has yet to resume or release.
+	ValueArray held_fibers;
+
+	// Both arrays grow on demand, which moves them. Code that may push a frame
+	// or run a nested interpreter must not hold pointers into them across it.
+	CallFrame* frames;
 	int frame_count;
+	int frame_capacity;
 	int frame_count_begin;
 
-	Value stack[STACK_MAX];
+	Value* stack;
 	Value* stack_top;
+	int stack_capacity;
 
 	Table strings;
 
 	ObjString* init_str;
 	ObjString* allocate_str;
 	ObjString* finalize_str;
+	// Method symbols of "init()", "init(_)", ... indexed by arity, so
+	// constructing an instance never has to build its initializer signature.
+	int init_symbols[MAX_PARAMETERS + 1];
+	int allocate_symbol;
+	int finalize_symbol;
 	ObjUpvalue* open_upvalues;
 
+	// Where objects and other small allocations come from, see reallocate().
+	Pool pool;
+
 	size_t bytes_allocated;
 	size_t next_gc;
+	// The factor the heap may grow by before the next full collection, and
+	// when the current run of the program between two of them started and
+	// how much of it had been paused by then. See adapt_growth().
+	double gc_growth;
+	uint64_t gc_cycle_start;
+	uint64_t gc_cycle_pause;
+	// Set when a collection could not bring the heap under
+	// VesselConfiguration.gc_heap_limit, until the interpreter reports it.
+	bool out_of_memory;
+	// Bytes allocated since the last collection, which paces the young ones.
+	size_t nursery_bytes;
+
+	GCState gc_state;
+	// Bytes allocated since the last incremental slice.
+	size_t gc_debt;
+
+	// What ves_gc_stats() reports, kept up to date as the heap changes. The
+	// current pause started at [gc_pause_start], unless the depth is 0.
+	VesselGCStats gc_stats;
+	int gc_pause_depth;
+	uint64_t gc_pause_start;
 
-	Obj* objects;
+	// Objects too large for the pool, young and old alike.
+	Obj* large_objects;
+
+	// Pages that objects were allocated in since the last young collection,
+	// which are all it has to sweep.
+	int young_page_count;
+	int young_page_capacity;
+	PoolPage** young_pages;
 
 	Table modules;
 
-	int gray_count;
-	int gray_capacity;
-	Obj** gray_stack;
+	GrayStack gray;
+	// Set while the helper threads mark along, so mark bits are set atomically.
+	bool parallel_marking;
+	// The helper threads, started the first time they are needed.
+	GCHelpers* gc_helpers;
+
+	// Dead foreign objects waiting for their finalizers, linked through
+	// Obj.next, and the thread that runs them for VES_FINALIZE_ON_THREAD.
+	Obj* finalize_queue;
+	FinalizerThread* finalizer;
+
+	// Old objects that were handed references to young ones since the last
+	// collection. See write_barrier().
+	int remembered_count;
+	int remembered_capacity;
+	Obj** remembered;
 
 	Obj* temp_roots[MAX_TEMP_ROOTS];
 	int num_temp_roots;
@@ -88,12 +195,26 @@ typedef struct
 
 	VesselConfiguration config;
 
+	// Every method signature ever used, indexed by method symbol, and the
+	// reverse mapping from signature to symbol (stored as a number).
 	ValueArray method_names;
+	Table method_symbols;
+
+	// The shape of an instance with no fields, where every transition starts.
+	ObjShape* empty_shape;
+
+	// Bumped whenever a method table changes so every InlineCache that was
+	// filled before the change misses on its next lookup.
+	uint32_t method_epoch;
 
 	Value error;
 } VM;
 
-extern VM vm;
+// The VM the calling thread is running, set by ves_init_vm() and
+// ves_set_vm(). Everything inside the interpreter works on it through `vm`,
+// so separate threads can each run their own VM at the same time.
+extern VES_THREAD_LOCAL VM* current_vm;
+#define vm (*current_vm)
 
 // Adds a new top-level variable named [name] to [module], and optionally
 // populates line with the line of the implicit first use (line can be NULL).
@@ -104,7 +225,27 @@ extern VM vm;
 // used before being defined.
 int DefineVariable(ObjModule* module, const char* name, size_t length, Value value, int* line);
 
-int FinalizeForeign(ObjForeign* foreign);
+// Adds a new top-level variable named [name] to [module] and returns its slot.
+// It holds UNDEFINED_VAL until its definition runs, or Core's value when it
+// shadows one of Core's variables, since the module saw Core's until then.
+int add_module_variable(ObjModule* module, const char* name, int length);
+
+// Returns every variable of [module] to the value it holds before its
+// definition runs. The slots stay, since code compiled against them earlier
+// may still run.
+void reset_module_variables(ObjModule* module);
+
+// Returns the method symbol for the signature [name], adding it if it is new.
+int method_symbol_ensure(const char* name, int length);
+
+// Returns the method symbol for the signature [name], or -1 if no method with
+// that signature has ever been declared. Never allocates.
+int method_symbol_find(const char* name, int length);
+
+// Returns true if the running fiber may give up control. A fiber running a
+// nested interpreter for a foreign call may not, since that call's C frames
+// would be left behind on the native stack.
+bool can_switch_fiber();
 
 void push(Value value);
 Value pop();
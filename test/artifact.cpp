@@ -0,0 +1,224 @@
+#include "utility.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <vessel.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+namespace
+{
+
+const char* ARTIFACT_PATH = "artifact_test.vesc";
+
+const char* ARTIFACT_SOURCE = R"(
+class Counter {
+  init(start) { this.count = start }
+  add(n) {
+    this.count = this.count + n
+    return this
+  }
+}
+
+fun adder(k) {
+  fun add(v) { return v + k }
+  return add
+}
+
+var total = 0
+for (var i = 0; i < 4; i = i + 1) {
+  if (i > 1) total = total + i
+}
+
+System.print(Counter(1).add(2).add(3).count) // expect: 6
+System.print(adder(10)(5)) // expect: 15
+System.print(total) // expect: 5
+System.print("do" + "ne") // expect: done
+)";
+
+const char* ARTIFACT_OUTPUT = R"(
+6
+15
+5
+done
+)" + 1;
+
+std::string read_file(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+void write_file(const char* path, const std::string& bytes)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(bytes.data(), bytes.size());
+}
+
+uint32_t read_u32(const std::string& bytes, size_t at)
+{
+    const unsigned char* data = (const unsigned char*)bytes.data() + at;
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+void write_u32(std::string& bytes, size_t at, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        bytes[at + i] = (char)((value >> (i * 8)) & 0xff);
+    }
+}
+
+size_t skip_string(const std::string& bytes, size_t at)
+{
+    return at + 4 + read_u32(bytes, at) + 1;
+}
+
+// Offsets into a compiled file, laid out as ves_save_compiled() writes it.
+struct CompiledLayout
+{
+    size_t symbol_count;
+    size_t body;
+    size_t body_constant_count;
+};
+
+CompiledLayout find_layout(const std::string& bytes)
+{
+    CompiledLayout layout;
+    size_t at = skip_string(bytes, 12);
+    uint32_t variables = read_u32(bytes, at);
+    at += 4;
+    for (uint32_t i = 0; i < variables; i++) {
+        at = skip_string(bytes, at);
+    }
+    at += 4;
+
+    layout.symbol_count = at;
+    uint32_t symbols = read_u32(bytes, at);
+    at += 4;
+    for (uint32_t i = 0; i < symbols; i++) {
+        at = skip_string(bytes, at + 4);
+    }
+
+    // The module body has no name, then come its arity, upvalue, stack slot
+    // and inline cache counts.
+    layout.body = at;
+    at += 4 + 4 * 4;
+    at += 4 + read_u32(bytes, at);
+    at += 4 + 8 * read_u32(bytes, at);
+    layout.body_constant_count = at;
+    return layout;
+}
+
+std::string save_test_artifact()
+{
+    VesselArtifact* artifact = ves_compile_artifact("test", ARTIFACT_SOURCE);
+    REQUIRE(artifact != NULL);
+    REQUIRE(ves_save_compiled(artifact, ARTIFACT_PATH));
+    ves_release_artifact(artifact);
+    return read_file(ARTIFACT_PATH);
+}
+
+bool loads(const std::string& bytes)
+{
+    write_file(ARTIFACT_PATH, bytes);
+    VesselArtifact* loaded = ves_load_compiled(ARTIFACT_PATH);
+    if (loaded == NULL) {
+        return false;
+    }
+    ves_release_artifact(loaded);
+    return true;
+}
+
+}
+
+TEST_CASE("artifact_round_trip")
+{
+    config_vm();
+    save_test_artifact();
+
+    // A fresh VM numbers its method symbols differently, so the loaded code
+    // has to be remapped to run there.
+    VesselConfiguration cfg;
+    init_test_config(&cfg);
+    VesselVM* saved = ves_get_vm();
+    ves_init_vm_with_config(&cfg);
+    ves_interpret("other", R"(
+class Unrelated {
+  first() {}
+  second(a, b) {}
+}
+)");
+    init_output_buf();
+
+    VesselArtifact* loaded = ves_load_compiled(ARTIFACT_PATH);
+    REQUIRE(loaded != NULL);
+    REQUIRE(ves_run_artifact(loaded) == VES_INTERPRET_OK);
+    ves_release_artifact(loaded);
+    REQUIRE(std::string(get_output_buf()) == ARTIFACT_OUTPUT);
+
+    ves_free_vm();
+    ves_set_vm(saved);
+    std::remove(ARTIFACT_PATH);
+}
+
+TEST_CASE("artifact_rejects_constant_out_of_range")
+{
+    config_vm();
+    const std::string bytes = save_test_artifact();
+    CompiledLayout layout = find_layout(bytes);
+    REQUIRE(read_u32(bytes, layout.body_constant_count) > 0);
+
+    // Drops the module body's constants, which its code still refers to.
+    std::string corrupted = bytes.substr(0, layout.body_constant_count + 4);
+    write_u32(corrupted, layout.body_constant_count, 0);
+    REQUIRE_FALSE(loads(corrupted));
+
+    std::remove(ARTIFACT_PATH);
+}
+
+TEST_CASE("artifact_rejects_unlisted_symbol")
+{
+    config_vm();
+    const std::string bytes = save_test_artifact();
+    CompiledLayout layout = find_layout(bytes);
+    REQUIRE(read_u32(bytes, layout.symbol_count) > 0);
+
+    // Drops the symbol table, which the code's calls still refer to.
+    std::string corrupted = bytes.substr(0, layout.symbol_count + 4) + bytes.substr(layout.body);
+    write_u32(corrupted, layout.symbol_count, 0);
+    REQUIRE_FALSE(loads(corrupted));
+
+    std::remove(ARTIFACT_PATH);
+}
+
+TEST_CASE("artifact_rejects_damaged_file")
+{
+    config_vm();
+    const std::string bytes = save_test_artifact();
+
+    for (size_t length = 0; length < bytes.size(); length++) {
+        REQUIRE_FALSE(loads(bytes.substr(0, length)));
+    }
+
+    // Setting a byte to all zeros or all ones throws counts, operands and
+    // opcodes out of range. Some such files are still valid, but the loader
+    // must tell them apart without reading out of bounds.
+    int rejected = 0;
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        for (char value : { '\x00', '\xff' })
+        {
+            std::string corrupted = bytes;
+            corrupted[i] = value;
+            if (corrupted != bytes && !loads(corrupted)) {
+                rejected++;
+            }
+        }
+    }
+    REQUIRE(rejected > 0);
+
+    std::remove(ARTIFACT_PATH);
+}
@@ -28,4 +28,34 @@ TEST_CASE("parse")
 (5 - (3 - 1)) + -1
 // expect: (+ (group (- 5.0 (group (- 3.0 1.0)))) (- 1.0))
 )");
-}
\ No newline at end of file
+}
+
+TEST_CASE("deep_nesting")
+{
+    std::string nested = "1";
+    for (int i = 0; i < 600; i++) {
+        nested = "1 + (" + nested + ")";
+    }
+
+    init_output_buf();
+
+    ves_interpret("test", (R"(
+var x = )" + nested + R"(
+System.print(x) // expect: 601
+
+fun f() {
+  return )" + nested + R"(
+}
+System.print(f()) // expect: 601
+
+fun g() {
+  System.print()" + nested + R"() // expect: 601
+}
+Fiber.new(g).call()
+)").c_str());
+    REQUIRE(std::string(get_output_buf()) == R"(
+601
+601
+601
+)" + 1);
+}
@@ -0,0 +1,175 @@
+#include "utility.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <vessel.h>
+
+TEST_CASE("fiber_call_and_yield")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+fun count(n) {
+  var i = 0
+  while (i < n) {
+    Fiber.yield(i)
+    i = i + 1
+  }
+  return "done"
+}
+
+var f = Fiber.new(count)
+System.print(f.call(2)) // expect: 0
+System.print(f.call())  // expect: 1
+System.print(f.isDone)  // expect: false
+System.print(f.call())  // expect: done
+System.print(f.isDone)  // expect: true
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+0
+1
+false
+done
+true
+)" + 1);
+}
+
+TEST_CASE("fiber_yield_returns_resume_value")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+fun echo(x) {
+  var y = Fiber.yield(x + 1)
+  return y * 2
+}
+
+var f = Fiber.new(echo)
+System.print(f.call(10)) // expect: 11
+System.print(f.call(5))  // expect: 10
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+11
+10
+)" + 1);
+}
+
+TEST_CASE("fiber_nested_calls")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+fun inner(v) {
+  while (true) {
+    v = Fiber.yield(v + 1)
+  }
+}
+
+fun outer() {
+  var total = 0
+  var f = Fiber.new(inner)
+  while (total < 3) {
+    total = total + f.call(total)
+  }
+  return total
+}
+
+System.print(Fiber.new(outer).call()) // expect: 3
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+3
+)" + 1);
+}
+
+TEST_CASE("fiber_closure_over_suspended_local")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+fun body() {
+  var local = "a"
+  fun get() { return local }
+  Fiber.yield(get)
+  local = "b"
+  Fiber.yield()
+}
+
+var f = Fiber.new(body)
+var get = f.call()
+System.print(get()) // expect: a
+f.call()
+System.print(get()) // expect: b
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+a
+b
+)" + 1);
+}
+
+TEST_CASE("fiber_suspend_and_resume_from_host")
+{
+    init_output_buf();
+
+    VesselInterpretResult result = ves_interpret("test", R"(
+fun work() {
+  var got = Fiber.suspend()
+  System.print(got)
+  got = Fiber.suspend()
+  System.print(got)
+}
+
+Fiber.new(work).call()
+System.print("unreachable")
+)");
+    REQUIRE(result == VES_INTERPRET_SUSPENDED);
+    REQUIRE(ves_gettop() == 0);
+
+    ves_pushnumber(1);
+    result = ves_resume_fiber(ves_suspended_fiber());
+    REQUIRE(result == VES_INTERPRET_SUSPENDED);
+
+    ves_pushstring("two");
+    result = ves_resume_fiber(ves_suspended_fiber());
+    REQUIRE(result == VES_INTERPRET_OK);
+    REQUIRE(ves_suspended_fiber() == NULL);
+    REQUIRE(ves_gettop() == 0);
+
+    REQUIRE(std::string(get_output_buf()) == R"(
+1
+two
+)" + 1);
+}
+
+TEST_CASE("fiber_resume_after_module_recompiled")
+{
+    init_output_buf();
+
+    VesselInterpretResult result = ves_interpret("test", R"(
+var a = 1
+var b = 2
+fun work() {
+  Fiber.suspend()
+  System.print(b)
+  System.print(a)
+}
+
+Fiber.new(work).call()
+)");
+    REQUIRE(result == VES_INTERPRET_SUSPENDED);
+    VesselFiber* fiber = ves_suspended_fiber();
+
+    // The module compiled again defines fewer variables, and not [a].
+    result = ves_interpret("test", R"(
+var b = 20
+System.print(b) // expect: 20
+)");
+    REQUIRE(result == VES_INTERPRET_OK);
+
+    ves_pushnumber(0);
+    result = ves_resume_fiber(fiber);
+    REQUIRE(result == VES_INTERPRET_RUNTIME_ERROR);
+    REQUIRE(std::string(get_output_buf()) == R"(
+20
+20
+)" + 1);
+}
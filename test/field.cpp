@@ -144,4 +144,119 @@ baz value
 bar value
 baz value
 )" + 1);
-}
\ No newline at end of file
+}
+
+TEST_CASE("cached_field_second_shape")
+{
+    init_output_buf();
+
+    // The field sites in getX() and setX() cache the shape of the first
+    // instance they see. B's instances have a different shape, with x in
+    // another slot.
+    ves_interpret("test", R"(
+class A {
+  init() {
+    this.x = 1
+    this.y = 2
+  }
+}
+
+class B {
+  init() {
+    this.y = 3
+    this.x = 4
+  }
+}
+
+fun getX(o) { return o.x }
+fun setX(o, v) { o.x = v }
+
+var a = A()
+var b = B()
+System.print(getX(a)) // expect: 1
+System.print(getX(a)) // expect: 1
+System.print(getX(b)) // expect: 4
+System.print(getX(a)) // expect: 1
+
+setX(a, 10)
+setX(a, 11)
+setX(b, 20)
+System.print(a.x) // expect: 11
+System.print(a.y) // expect: 2
+System.print(b.x) // expect: 20
+System.print(b.y) // expect: 3
+
+var sum = 0
+var o = b
+for (var i = 0; i < 10; i = i + 1) {
+  o = o == a ? b : a
+  setX(o, i)
+  sum = sum + getX(o)
+}
+System.print(sum) // expect: 45
+System.print(a.x) // expect: 8
+System.print(b.x) // expect: 9
+System.print(b.y) // expect: 3
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+1
+1
+4
+1
+11
+2
+20
+3
+45
+8
+9
+3
+)" + 1);
+}
+
+TEST_CASE("dynamic_fields")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+class Bag {
+  init() { this.first = "first" }
+  describe() { return this.first }
+}
+
+// More fields than a shape describes.
+var bag = Bag()
+for (var i = 0; i < 200; i = i + 1) {
+  bag["k" + i.toString()] = i
+}
+var sum = 0
+for (var i = 0; i < 200; i = i + 1) {
+  sum = sum + bag["k" + i.toString()]
+}
+System.print(sum) // expect: 19900
+System.print(bag.describe()) // expect: first
+bag.k7 = "seven"
+System.print(bag.k7) // expect: seven
+System.print(bag["k199"]) // expect: 199
+
+// More field names than one shape has transitions for.
+var bags = []
+for (var i = 0; i < 200; i = i + 1) {
+  var b = Bag()
+  b["only" + i.toString()] = i
+  bags.add(b)
+}
+System.print(bags[10]["only10"]) // expect: 10
+System.print(bags[150]["only150"]) // expect: 150
+System.print(bags[150].describe()) // expect: first
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+19900
+first
+seven
+199
+10
+150
+first
+)" + 1);
+}
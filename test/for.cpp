@@ -270,4 +270,77 @@ three
 one
 1
 )" + 1);
-}
\ No newline at end of file
+}
+TEST_CASE("fused_loop")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+fun sum(n) {
+  var total = 0
+  for (var i = 0; i < n; i = i + 1) total = total + i
+  return total
+}
+System.print(sum(100)) // expect: 4950
+
+var count = 0
+for (var i = 10; i >= 0; i = i - 2) count = count + 1
+System.print(count) // expect: 6
+
+for (var i = 0.5; i <= 2; i = i + 1) System.print(i)
+// expect: 0.5
+// expect: 1.5
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+4950
+6
+0.5
+1.5
+)" + 1);
+}
+
+TEST_CASE("fusion_stops_at_jump_target")
+{
+    init_output_buf();
+
+    // Each loop starts right after a local load that would otherwise fuse
+    // with the load of the loop variable, and each `or` leaves its jump
+    // target right after a local load.
+    ves_interpret("test", R"(
+fun add(x, y) { return x + y }
+
+{
+  var start = 1
+  for (var i = start; i < 3; i = i + 1) System.print(i)
+  // expect: 1
+  // expect: 2
+
+  var i = 0
+  var j = i
+  while (i < 2) {
+    System.print(i + j)
+    i = i + 1
+  }
+  // expect: 0
+  // expect: 1
+
+  var t = 2
+  var u = 5
+  System.print((t or u) + 1) // expect: 3
+  System.print(add(t or u, u)) // expect: 7
+  if ((t or u) < 3) System.print("less") // expect: less
+  t = t or u
+  System.print(t) // expect: 2
+}
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+1
+2
+0
+1
+3
+7
+less
+2
+)" + 1);
+}
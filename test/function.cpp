@@ -136,4 +136,29 @@ System.print(fib(8)) // expect: 21
     REQUIRE(std::string(get_output_buf()) == R"(
 21
 )" + 1);
-}
\ No newline at end of file
+}
+TEST_CASE("deep_recursion")
+{
+    init_output_buf();
+
+    // Far deeper than the initial stack, which has to grow and move while
+    // closures still capture locals from the frames on it.
+    ves_interpret("test", R"(
+fun sum(n) {
+  if (n == 0) return 0
+  var a = n
+  fun get() { return a }
+  var rest = sum(n - 1)
+  return get() + rest
+}
+
+System.print(sum(3000)) // expect: 4501500
+
+fun run() { System.print(sum(2000)) } // expect: 2001000
+Fiber.new(run).call()
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+4501500
+2001000
+)" + 1);
+}
@@ -0,0 +1,549 @@
+#include "utility.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <vessel.h>
+
+#include <cstring>
+
+TEST_CASE("gc_old_objects_keep_young_values")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+class Box {
+  init() { this.v = nil }
+}
+
+fun make_cell() {
+  var n = nil
+  fun get() { return n }
+  fun set(x) { n = x }
+  return [get, set]
+}
+
+// Survive a few collections so these are old by the time they are written.
+// Each is written one way only, so no other store remembers it.
+var list = [nil]
+var added = []
+var map = {}
+var box = Box()
+var cell = make_cell()
+var global = nil
+for (var i = 0; i < 20000; i = i + 1) {
+  var garbage = [i, [i]]
+}
+
+var ok = true
+for (var round = 0; round < 100; round = round + 1) {
+  var s = round.toString()
+  list[0] = [s]
+  added.add([s])
+  map[s] = [s]
+  box.v = [s]
+  cell[1]([s])
+  global = [s]
+
+  for (var i = 0; i < 500; i = i + 1) {
+    var garbage = [i.toString(), {}]
+  }
+
+  if (list[0][0] != s or added[round][0] != s or map[s][0] != s or
+      box.v[0] != s or cell[0]()[0] != s or global[0] != s) {
+    ok = false
+  }
+}
+System.print(ok)          // expect: true
+System.print(added.count) // expect: 100
+System.print(map.count)   // expect: 100
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+true
+100
+100
+)" + 1);
+}
+
+TEST_CASE("gc_incremental_keeps_values")
+{
+    config_vm(false, true);
+    init_output_buf();
+
+    ves_interpret("test", R"(
+class Node {
+  init(v) {
+    this.v = v
+    this.next = nil
+  }
+}
+
+// Keep a live heap large enough that full collections run in slices while
+// the old objects below are being rewritten.
+var keep = []
+var head = nil
+var map = {}
+for (var round = 0; round < 200; round = round + 1) {
+  var s = round.toString()
+  var node = Node([s])
+  node.next = head
+  head = node
+  map[s] = [s]
+  keep.add([s, {}])
+  for (var i = 0; i < 200; i = i + 1) {
+    var garbage = [i.toString(), [i]]
+  }
+}
+
+var ok = true
+var n = head
+for (var round = 199; round >= 0; round = round - 1) {
+  var s = round.toString()
+  if (n.v[0] != s or map[s][0] != s or keep[round][0] != s) {
+    ok = false
+  }
+  n = n.next
+}
+System.print(ok)         // expect: true
+System.print(map.count)  // expect: 200
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+true
+200
+)" + 1);
+
+    config_vm();
+}
+
+TEST_CASE("gc_blocks_keep_contents_across_size_classes")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+// Lists and strings that grow from pooled blocks into malloc() and back,
+// while collections free their neighbours.
+var ok = true
+for (var round = 0; round < 50; round = round + 1) {
+  var list = []
+  var s = ""
+  for (var i = 0; i < 100; i = i + 1) {
+    list.add(i)
+    s = s + "x"
+    var garbage = [i.toString(), s + "y"]
+  }
+  while (list.count > 3) {
+    list.removeAt(list.count - 1)
+  }
+  if (list[2] != 2 or s.count != 100) {
+    ok = false
+  }
+}
+System.print(ok) // expect: true
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+true
+)" + 1);
+}
+
+TEST_CASE("gc_large_objects_keep_values")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+// Too many fields for a pooled block, so these are kept apart from the rest.
+class Wide {
+  init(v) {
+    this.f0 = v this.f1 = v this.f2 = v this.f3 = v this.f4 = v
+    this.f5 = v this.f6 = v this.f7 = v this.f8 = v this.f9 = v
+    this.g0 = v this.g1 = v this.g2 = v this.g3 = v this.g4 = v
+    this.g5 = v this.g6 = v this.g7 = v this.g8 = v this.g9 = v
+    this.h0 = v this.h1 = v this.h2 = v this.h3 = v this.h4 = v
+    this.h5 = v this.h6 = v this.h7 = v this.h8 = v this.h9 = v
+  }
+}
+
+var keep = []
+for (var i = 0; i < 2000; i = i + 1) {
+  var wide = Wide([i])
+  if (i >= 1800) {
+    keep.add(wide)
+  }
+  var garbage = [i.toString(), {}]
+}
+
+var ok = true
+for (var i = 0; i < keep.count; i = i + 1) {
+  if (keep[i].h9[0] != 1800 + i) {
+    ok = false
+  }
+}
+System.print(ok)         // expect: true
+System.print(keep.count) // expect: 200
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+true
+200
+)" + 1);
+}
+
+TEST_CASE("gc_parallel_marking_keeps_values")
+{
+    config_vm(false, false, 4);
+    init_output_buf();
+
+    ves_interpret("test", R"(
+class Tree {
+  init(depth) {
+    this.name = depth.toString()
+    if (depth > 0) {
+      this.left = Tree(depth - 1)
+      this.right = Tree(depth - 1)
+    } else {
+      this.left = nil
+      this.right = nil
+    }
+  }
+  check() {
+    if (this.left == nil) return 1
+    return 1 + this.left.check() + this.right.check()
+  }
+}
+
+// A wide live graph for the helper threads to split up, traced again by
+// each full collection the garbage below sets off.
+var trees = []
+for (var i = 0; i < 8; i = i + 1) {
+  trees.add(Tree(10))
+}
+var map = {}
+for (var round = 0; round < 300; round = round + 1) {
+  map[round.toString()] = [round, Tree(2)]
+  for (var i = 0; i < 200; i = i + 1) {
+    var garbage = [i.toString(), {}]
+  }
+}
+
+var total = 0
+for (var i = 0; i < trees.count; i = i + 1) {
+  total = total + trees[i].check()
+}
+var ok = true
+for (var round = 0; round < 300; round = round + 1) {
+  var entry = map[round.toString()]
+  if (entry[0] != round or entry[1].check() != 7) {
+    ok = false
+  }
+}
+System.print(total) // expect: 16376
+System.print(ok)    // expect: true
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+16376
+true
+)" + 1);
+
+    config_vm();
+}
+
+namespace
+{
+
+int handles_finalized = 0;
+
+void handle_allocate()
+{
+    *(int*)ves_set_newforeign(0, 0, sizeof(int)) = 1;
+}
+
+int handle_finalize(void* data)
+{
+    if (*(int*)data == 1) {
+        handles_finalized++;
+    }
+    return sizeof(int);
+}
+
+VesselForeignClassMethods bind_handle(const char* module, const char* class_name)
+{
+    VesselForeignClassMethods methods = { NULL, NULL };
+    if (strcmp(class_name, "Handle") == 0) {
+        methods.allocate = handle_allocate;
+        methods.finalize = handle_finalize;
+    }
+    return methods;
+}
+
+}
+
+TEST_CASE("gc_finalizers_wait_for_request")
+{
+    VesselConfiguration cfg;
+    init_test_config(&cfg);
+    cfg.bind_foreign_class_fn = bind_handle;
+    cfg.finalize_mode = VES_FINALIZE_ON_REQUEST;
+    ves_set_config(&cfg);
+    init_output_buf();
+    handles_finalized = 0;
+
+    ves_interpret("test", R"(
+foreign class Handle {
+  init() {}
+}
+
+var keep = []
+for (var i = 0; i < 20000; i = i + 1) {
+  var handle = Handle.init()
+  if (i < 10) {
+    keep.add(handle)
+  }
+  var garbage = [i.toString(), {}]
+}
+System.print(keep.count) // expect: 10
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+10
+)" + 1);
+
+    // The collections found the dead handles, but left them for the host.
+    REQUIRE(handles_finalized == 0);
+    ves_run_finalizers();
+    REQUIRE(handles_finalized > 0);
+    REQUIRE(handles_finalized <= 20000 - 10);
+
+    config_vm();
+}
+
+namespace
+{
+
+int gc_starts = 0;
+int gc_ends = 0;
+
+void count_gc_events(VesselGCEvent event, bool full)
+{
+    if (event == VES_GC_START) {
+        gc_starts++;
+    } else {
+        gc_ends++;
+    }
+}
+
+}
+
+TEST_CASE("gc_stats_report_collections")
+{
+    VesselConfiguration cfg;
+    init_test_config(&cfg);
+    cfg.gc_event_fn = count_gc_events;
+    ves_set_config(&cfg);
+    init_output_buf();
+    gc_starts = 0;
+    gc_ends = 0;
+
+    VesselGCStats before;
+    ves_gc_stats(&before);
+
+    ves_interpret("test", R"(
+var first = System.gcStats()
+var keep = []
+for (var i = 0; i < 20000; i = i + 1) {
+  var garbage = [i.toString(), {}]
+  if (i < 100) {
+    keep.add([i])
+  }
+}
+var stats = System.gcStats()
+var collections = stats["youngCollections"] + stats["fullCollections"]
+System.print(collections > first["youngCollections"] + first["fullCollections"]) // expect: true
+System.print(stats["bytesFreed"] > first["bytesFreed"])            // expect: true
+System.print(stats["pauseMaxUs"] <= stats["pauseTotalUs"])         // expect: true
+System.print(stats["types"]["list"]["count"] >= 100)               // expect: true
+System.print(stats["nextGC"] > 0)                                  // expect: true
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+true
+true
+true
+true
+true
+)" + 1);
+
+    VesselGCStats after;
+    ves_gc_stats(&after);
+    REQUIRE(after.pauses > before.pauses);
+    REQUIRE(gc_starts == (int)(after.pauses - before.pauses));
+    REQUIRE(gc_ends == gc_starts);
+    REQUIRE(after.bytes_allocated - after.bytes_freed == after.bytes_live);
+    REQUIRE(std::string(ves_gc_type_name(8)) == "string");
+
+    config_vm();
+}
+
+TEST_CASE("gc_heap_limit_raises_runtime_error")
+{
+    VesselConfiguration cfg;
+    init_test_config(&cfg);
+    cfg.gc_heap_limit = 8 * 1024 * 1024;
+    ves_set_config(&cfg);
+    init_output_buf();
+
+    // Garbage alone never reaches the limit.
+    REQUIRE(ves_interpret("test", R"(
+for (var i = 0; i < 100000; i = i + 1) {
+  var garbage = [i.toString(), {}]
+}
+System.print("done") // expect: done
+)") == VES_INTERPRET_OK);
+
+    REQUIRE(ves_interpret("test", R"(
+var keep = []
+while (true) {
+  keep.add([keep.count.toString(), {}])
+}
+)") == VES_INTERPRET_RUNTIME_ERROR);
+
+    VesselGCStats stats;
+    ves_gc_stats(&stats);
+    REQUIRE(stats.next_gc <= cfg.gc_heap_limit);
+
+    config_vm();
+}
+
+TEST_CASE("gc_initial_heap_is_a_floor")
+{
+    VesselConfiguration cfg;
+    init_test_config(&cfg);
+    cfg.gc_initial_heap = 32 * 1024 * 1024;
+    cfg.gc_target_time_fraction = 0.05;
+    ves_set_config(&cfg);
+    init_output_buf();
+
+    ves_interpret("test", R"(
+for (var i = 0; i < 100000; i = i + 1) {
+  var garbage = [i.toString(), {}]
+}
+System.print(System.gcStats()["nextGC"] >= 32 * 1024 * 1024) // expect: true
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+true
+)" + 1);
+
+    config_vm();
+}
+
+struct TrackedHeap
+{
+    int live = 0;
+    int calls = 0;
+};
+
+static void* tracked_reallocate(void* memory, size_t new_size, void* user_data)
+{
+    TrackedHeap* heap = (TrackedHeap*)user_data;
+    heap->calls++;
+    if (new_size == 0)
+    {
+        if (memory != NULL) heap->live--;
+        free(memory);
+        return NULL;
+    }
+    if (memory == NULL) heap->live++;
+    return realloc(memory, new_size);
+}
+
+TEST_CASE("gc_reallocate_fn_sees_every_allocation")
+{
+    TrackedHeap heap;
+    VesselConfiguration cfg;
+    init_test_config(&cfg);
+    cfg.reallocate_fn = tracked_reallocate;
+    cfg.reallocate_user_data = &heap;
+
+    VesselVM* saved = ves_get_vm();
+    ves_init_vm_with_config(&cfg);
+    init_output_buf();
+
+    ves_interpret("test", R"(
+class Node {
+  init(next) { this.next = next }
+}
+var keep = nil
+for (var i = 0; i < 20000; i = i + 1) {
+  keep = Node(keep)
+  var garbage = [i.toString(), {}]
+  // Past the pool's largest block.
+  for (var j = 0; j < 40; j = j + 1) {
+    garbage.add(j)
+  }
+}
+fun greet() { System.print("fiber") }
+var f = Fiber.new(greet)
+f.call()
+System.print("done")
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+fiber
+done
+)" + 1);
+    REQUIRE(heap.calls > 0);
+
+    // A later ves_set_config() cannot swap the allocator under the VM.
+    VesselConfiguration plain;
+    init_test_config(&plain);
+    ves_set_config(&plain);
+    ves_interpret("test", "var more = [1, 2, 3]");
+
+    ves_free_vm();
+    REQUIRE(heap.live == 0);
+
+    ves_set_vm(saved);
+}
+
+// Refuses any single block past 2MB, as a system out of memory would.
+static void* capped_reallocate(void* memory, size_t new_size, void* user_data)
+{
+    if (new_size == 0)
+    {
+        free(memory);
+        return NULL;
+    }
+    if (new_size > 2 * 1024 * 1024) {
+        return NULL;
+    }
+    return realloc(memory, new_size);
+}
+
+TEST_CASE("gc_stack_growth_failure_raises_runtime_error")
+{
+    VesselConfiguration cfg;
+    init_test_config(&cfg);
+    cfg.reallocate_fn = capped_reallocate;
+    cfg.max_frames = 1000000;
+
+    VesselVM* saved = ves_get_vm();
+    ves_init_vm_with_config(&cfg);
+    init_output_buf();
+
+    // Lots of locals use up the stack long before the frames run out.
+    std::string locals;
+    for (int i = 0; i < 200; i++) {
+        locals += "  var a" + std::to_string(i) + " = n\n";
+    }
+    REQUIRE(ves_interpret("test", (R"(
+fun down(n) {
+)" + locals + R"(
+  return down(n + 1)
+}
+down(0)
+)").c_str()) == VES_INTERPRET_RUNTIME_ERROR);
+
+    // The VM is left fit to run more code.
+    REQUIRE(ves_interpret("test", R"(
+System.print("after") // expect: after
+)") == VES_INTERPRET_OK);
+    REQUIRE(std::string(get_output_buf()) == R"(
+after
+)" + 1);
+
+    ves_free_vm();
+    ves_set_vm(saved);
+}
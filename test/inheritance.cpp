@@ -56,6 +56,72 @@ bar
 )" + 1);
 }
 
+TEST_CASE("override_after_call_site_cached")
+{
+    init_output_buf();
+
+    // The call sites in describe() have cached Base's methods before the
+    // subclasses below inherit or override them.
+    ves_interpret("test", R"(
+class Base {
+  name() { return "base" }
+  greet() { return "hi " + this.name() }
+}
+
+fun describe(o) { return o.greet() }
+
+var base = Base()
+System.print(describe(base)) // expect: hi base
+System.print(describe(base)) // expect: hi base
+
+class Derived is Base {
+  name() { return "derived" }
+}
+
+class Plain is Base {}
+
+class Loud is Derived {
+  greet() { return "HI " + this.name() }
+}
+
+System.print(describe(Derived())) // expect: hi derived
+System.print(describe(Plain()))   // expect: hi base
+System.print(describe(Loud()))    // expect: HI derived
+System.print(describe(base))      // expect: hi base
+
+// Each pass declares a new class, which the sites have not seen.
+for (var i = 0; i < 6; i = i + 1) {
+  class Each is Base {
+    name() { return "each" }
+  }
+  System.print(describe(Each())) // expect: hi each
+}
+
+// Declaring Base again gives the name a new class with other methods.
+class Base {
+  greet() { return "hello" }
+}
+System.print(describe(Base())) // expect: hello
+System.print(describe(base))   // expect: hi base
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+hi base
+hi base
+hi derived
+hi base
+HI derived
+hi base
+hi each
+hi each
+hi each
+hi each
+hi each
+hi each
+hello
+hi base
+)" + 1);
+}
+
 TEST_CASE("set_fields_from_base_class")
 {
     init_output_buf();
@@ -0,0 +1,169 @@
+#include "utility.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <vessel.h>
+
+TEST_CASE("lazy_body_compiled_on_call")
+{
+    init_output_buf();
+    config_vm(true);
+
+    ves_interpret("test", R"(
+class Point {
+  init(x, y) {
+    this.x = x
+    this.y = y
+  }
+  sum() { return this.x + this.y }
+  scaled(k) {
+    fun scale(v) { return v * k }
+    return scale(this.sum())
+  }
+}
+
+class Point3 is Point {
+  init(x, y, z) {
+    super.init(x, y)
+    this.z = z
+  }
+  sum() { return super.sum() + this.z }
+}
+
+fun fib(n) {
+  if (n < 2) return n
+  return fib(n - 1) + fib(n - 2)
+}
+
+System.print(Point(1, 2).sum())       // expect: 3
+System.print(Point(1, 2).scaled(10))  // expect: 30
+System.print(Point3(1, 2, 3).sum())   // expect: 6
+System.print(fib(10))                 // expect: 55
+)");
+    config_vm();
+    REQUIRE(std::string(get_output_buf()) == R"(
+3
+30
+6
+55
+)" + 1);
+}
+
+TEST_CASE("lazy_captured_variable")
+{
+    init_output_buf();
+    config_vm(true);
+
+    ves_interpret("test", R"(
+{
+  var count = 0
+  fun increment() {
+    count = count + 1
+    return count
+  }
+  increment()
+  System.print(increment()) // expect: 2
+}
+)");
+    config_vm();
+    REQUIRE(std::string(get_output_buf()) == R"(
+2
+)" + 1);
+}
+
+TEST_CASE("lazy_uncalled_body_error")
+{
+    init_output_buf();
+    config_vm(true);
+
+    VesselInterpretResult result = ves_interpret("test", R"(
+fun broken() {
+  var = 1
+}
+
+System.print("loaded") // expect: loaded
+)");
+    config_vm();
+    REQUIRE(result == VES_INTERPRET_OK);
+    REQUIRE(std::string(get_output_buf()) == R"(
+loaded
+)" + 1);
+}
+
+TEST_CASE("lazy_fiber_body_error")
+{
+    init_output_buf();
+    config_vm(true);
+
+    VesselInterpretResult result = ves_interpret("test", R"(
+fun bad() {
+  var x = )
+}
+
+System.print("before") // expect: before
+Fiber.new(bad).call()
+System.print("after")
+)");
+    config_vm();
+    REQUIRE(result == VES_INTERPRET_RUNTIME_ERROR);
+    REQUIRE(std::string(get_output_buf()) == R"(
+before
+)" + 1);
+}
+
+TEST_CASE("lazy_undefined_module_variable")
+{
+    init_output_buf();
+    config_vm(true);
+
+    VesselInterpretResult result = ves_interpret("test", R"(
+fun f() { return helper }
+
+System.print("before") // expect: before
+System.print(f())
+var helper = 1
+)");
+    config_vm();
+    REQUIRE(result == VES_INTERPRET_RUNTIME_ERROR);
+    REQUIRE(std::string(get_output_buf()) == R"(
+before
+)" + 1);
+}
+
+TEST_CASE("lazy_assign_undefined_module_variable")
+{
+    init_output_buf();
+    config_vm(true);
+
+    VesselInterpretResult result = ves_interpret("test", R"(
+fun f() { helper = 2 }
+
+System.print("before") // expect: before
+f()
+var helper = 1
+System.print(helper)
+)");
+    config_vm();
+    REQUIRE(result == VES_INTERPRET_RUNTIME_ERROR);
+    REQUIRE(std::string(get_output_buf()) == R"(
+before
+)" + 1);
+}
+
+TEST_CASE("lazy_shadow_core_variable")
+{
+    init_output_buf();
+    config_vm(true);
+
+    ves_interpret("test", R"(
+fun f() { return List }
+System.print(f()) // expect: List
+var List = 1
+System.print(f()) // expect: 1
+)");
+    config_vm();
+    REQUIRE(std::string(get_output_buf()) == R"(
+List
+1
+)" + 1);
+}
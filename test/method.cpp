@@ -75,4 +75,62 @@ System.print(foo.method) // expect: <fn method>
     REQUIRE(std::string(get_output_buf()) == R"(
 <fn method>
 )" + 1);
-}
\ No newline at end of file
+}
+TEST_CASE("call_site_second_receiver_class")
+{
+    init_output_buf();
+
+    // The call sites in describe() see one class, then others, and then more
+    // classes than they cache.
+    ves_interpret("test", R"(
+class Circle {
+  name() { return "circle" }
+  sides() { return 0 }
+}
+
+class Square {
+  name() { return "square" }
+  sides() { return 4 }
+}
+
+fun describe(shape) { return shape.name() + " " + shape.sides().toString() }
+
+System.print(describe(Circle())) // expect: circle 0
+System.print(describe(Circle())) // expect: circle 0
+System.print(describe(Square())) // expect: square 4
+System.print(describe(Circle())) // expect: circle 0
+
+class A {
+  name() { return "a" }
+  sides() { return 1 }
+}
+
+class B {
+  name() { return "b" }
+  sides() { return 2 }
+}
+
+class C {
+  name() { return "c" }
+  sides() { return 3 }
+}
+
+class D {
+  name() { return "d" }
+  sides() { return 5 }
+}
+
+var out = ""
+for (var shape in [Circle(), Square(), A(), B(), C(), D(), Square(), Circle()]) {
+  out = out + describe(shape) + ","
+}
+System.print(out) // expect: circle 0,square 4,a 1,b 2,c 3,d 5,square 4,circle 0,
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+circle 0
+circle 0
+square 4
+circle 0
+circle 0,square 4,a 1,b 2,c 3,d 5,square 4,circle 0,
+)" + 1);
+}
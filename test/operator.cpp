@@ -18,6 +18,40 @@ string
 )" + 1);
 }
 
+TEST_CASE("add_deoptimizes")
+{
+    init_output_buf();
+
+    // The `+` in add() specializes to the operand types it sees first, and
+    // has to fall back when they change. After a few changes it stays
+    // generic.
+    VesselInterpretResult result = ves_interpret("test", R"(
+fun add(a, b) { return a + b }
+
+System.print(add(1, 2))     // expect: 3
+System.print(add(3, 4))     // expect: 7
+System.print(add("a", "b")) // expect: ab
+System.print(add(5, 6))     // expect: 11
+
+var out = ""
+for (var i = 0; i < 10; i = i + 1) {
+  out = add(out, add(i, i).toString())
+  out = add(out, "-")
+}
+System.print(out) // expect: 0-2-4-6-8-10-12-14-16-18-
+
+System.print(add(1, "b"))
+)");
+    REQUIRE(result == VES_INTERPRET_RUNTIME_ERROR);
+    REQUIRE(std::string(get_output_buf()) == R"(
+3
+7
+ab
+11
+0-2-4-6-8-10-12-14-16-18-
+)" + 1);
+}
+
 TEST_CASE("comparison")
 {
     init_output_buf();
@@ -73,6 +107,75 @@ true
 )" + 1);
 }
 
+TEST_CASE("comparison_nan")
+{
+    init_output_buf();
+
+    // `<=` and `>=` are the negation of `>` and `<`, so they hold for NaN.
+    // Conditions compile to fused compare-and-jump instructions, which must
+    // agree with the plain comparisons.
+    ves_interpret("test", R"(
+var nan = 0 / 0
+System.print(nan < 1)  // expect: false
+System.print(nan > 1)  // expect: false
+System.print(nan <= 1) // expect: true
+System.print(nan >= 1) // expect: true
+System.print(1 <= nan) // expect: true
+System.print(1 >= nan) // expect: true
+
+if (nan < 1) System.print("<")
+if (nan > 1) System.print(">")
+if (nan <= 1) System.print("<=") // expect: <=
+if (nan >= 1) System.print(">=") // expect: >=
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+false
+false
+true
+true
+true
+true
+<=
+>=
+)" + 1);
+}
+
+TEST_CASE("fused_local_operators")
+{
+    init_output_buf();
+
+    VesselInterpretResult result = ves_interpret("test", R"(
+{
+  var a = 3
+  var b = 4
+  System.print(a != b)  // expect: true
+  System.print(a != 3)  // expect: false
+  System.print(a + b)   // expect: 7
+  System.print(a + 10)  // expect: 13
+  System.print(a + -1)  // expect: 2
+  a = a + 2
+  System.print(a)       // expect: 5
+  b = a + 1
+  System.print(b)       // expect: 6
+  a = a + 0.5
+  System.print(a)       // expect: 5.5
+  var s = "x"
+  s = s + 1
+}
+)");
+    REQUIRE(result == VES_INTERPRET_RUNTIME_ERROR);
+    REQUIRE(std::string(get_output_buf()) == R"(
+true
+false
+7
+13
+2
+5
+6
+5.5
+)" + 1);
+}
+
 TEST_CASE("divide")
 {
     init_output_buf();
@@ -23,13 +23,19 @@ void write(const char* text)
 
 }
 
-void config_vm()
+void init_test_config(VesselConfiguration* cfg)
+{
+    ves_init_configuration(cfg);
+    cfg->write_fn = write;
+}
+
+void config_vm(bool lazy_compile, bool incremental_gc, int gc_threads)
 {
     VesselConfiguration cfg;
-    cfg.load_module_fn = nullptr;
-    cfg.bind_foreign_class_fn = nullptr;
-    cfg.bind_foreign_method_fn = nullptr;
-    cfg.write_fn = write;
+    init_test_config(&cfg);
+    cfg.lazy_compile = lazy_compile;
+    cfg.incremental_gc = incremental_gc;
+    cfg.gc_threads = gc_threads;
     ves_set_config(&cfg);
 }
 
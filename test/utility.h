@@ -1,6 +1,11 @@
 #pragma once
 
-void config_vm();
+#include <vessel.h>
+
+// The configuration every test starts from, writing to the output buffer.
+void init_test_config(VesselConfiguration* cfg);
+
+void config_vm(bool lazy_compile = false, bool incremental_gc = false, int gc_threads = 0);
 
 void init_output_buf();
 const char* get_output_buf();
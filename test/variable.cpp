@@ -235,4 +235,94 @@ System.print(a) // expect: value
     REQUIRE(std::string(get_output_buf()) == R"(
 value
 )" + 1);
-}
\ No newline at end of file
+}
+
+TEST_CASE("shadow_core_variable")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+System.print(List.new().count) // expect: 0
+var List = "shadowed"
+System.print(List) // expect: shadowed
+)");
+    ves_interpret("other", R"(
+System.print(List.new().count) // expect: 0
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+0
+shadowed
+0
+)" + 1);
+}
+
+TEST_CASE("shadow_core_variable_after_use")
+{
+    init_output_buf();
+
+    ves_interpret("test", R"(
+fun f() { return List }
+System.print(f()) // expect: List
+var List = 1
+System.print(f()) // expect: 1
+)");
+    ves_interpret("other", R"(
+fun g() { return Map }
+Map = 5
+System.print(g()) // expect: 5
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+List
+1
+5
+)" + 1);
+}
+
+TEST_CASE("forward_reference_from_function")
+{
+    init_output_buf();
+
+    // The first call resolves [later] by name and patches the access into
+    // the slot form, which the following calls use.
+    ves_interpret("test", R"(
+fun get() { return later }
+fun set(v) { later = v }
+
+var later = "first"
+System.print(get()) // expect: first
+set("second")
+System.print(get()) // expect: second
+later = "third"
+System.print(get()) // expect: third
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+first
+second
+third
+)" + 1);
+}
+
+TEST_CASE("read_before_definition")
+{
+    init_output_buf();
+
+    VesselInterpretResult result = ves_interpret("test", R"(
+fun get() { return later }
+
+System.print("before") // expect: before
+System.print(get())
+var later = 1
+)");
+    REQUIRE(result == VES_INTERPRET_RUNTIME_ERROR);
+    REQUIRE(std::string(get_output_buf()) == R"(
+before
+)" + 1);
+
+    init_output_buf();
+    result = ves_interpret("other", R"(
+System.print(later)
+var later = 1
+)");
+    REQUIRE(result == VES_INTERPRET_RUNTIME_ERROR);
+    REQUIRE(std::string(get_output_buf()) == "");
+}
@@ -0,0 +1,127 @@
+#include "utility.h"
+
+#include <catch2/catch_test_macros.hpp>
+
+#include <vessel.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// The shared output buffer isn't safe to write from several threads, so
+// each thread's VM writes to its own.
+thread_local std::string thread_output;
+
+void write_thread_output(const char* text)
+{
+    thread_output += text;
+}
+
+const char* CORE_SOURCE = R"(
+class Node {
+  init(value, next) {
+    this.value = value
+    this.next = next
+  }
+}
+
+fun fib(n) {
+  if (n < 2) return n
+  return fib(n - 1) + fib(n - 2)
+}
+
+var nodes = nil
+for (var i = 0; i < 20000; i = i + 1) {
+  nodes = Node(i, nodes)
+}
+var total = 0
+while (nodes != nil) {
+  total = total + nodes.value
+  nodes = nodes.next
+}
+System.print(total) // expect: 199990000
+
+var list = []
+for (var i = 0; i < 1000; i = i + 1) {
+  list.add(i.toString())
+}
+System.print(list.count) // expect: 1000
+System.print(list[999] + "!") // expect: 999!
+
+fun count() { System.print(fib(20)) } // expect: 6765
+Fiber.new(count).call()
+)";
+
+const char* CORE_OUTPUT = R"(
+199990000
+1000
+999!
+6765
+)" + 1;
+
+}
+
+TEST_CASE("vm_threads_interpret_concurrently")
+{
+    const int num_threads = 4;
+    std::string outputs[num_threads];
+    VesselInterpretResult results[num_threads];
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++)
+    {
+        threads.emplace_back([i, &outputs, &results]() {
+            VesselConfiguration cfg;
+            ves_init_configuration(&cfg);
+            cfg.write_fn = write_thread_output;
+            ves_init_vm_with_config(&cfg);
+
+            std::string source = "System.print(" + std::to_string(i) + ")\n" + CORE_SOURCE;
+            results[i] = ves_interpret("test", source.c_str());
+            outputs[i] = thread_output;
+
+            ves_free_vm();
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        REQUIRE(results[i] == VES_INTERPRET_OK);
+        REQUIRE(outputs[i] == std::to_string(i) + "\n" + CORE_OUTPUT);
+    }
+}
+
+TEST_CASE("vm_second_vm_reuses_core")
+{
+    VesselVM* saved = ves_get_vm();
+
+    // Core is compiled once per process, so every VM after the first runs it
+    // from the cached artifact.
+    for (int i = 0; i < 2; i++)
+    {
+        VesselConfiguration cfg;
+        init_test_config(&cfg);
+        ves_init_vm_with_config(&cfg);
+        init_output_buf();
+
+        REQUIRE(ves_interpret("test", CORE_SOURCE) == VES_INTERPRET_OK);
+        REQUIRE(std::string(get_output_buf()) == CORE_OUTPUT);
+
+        ves_free_vm();
+    }
+
+    ves_set_vm(saved);
+    init_output_buf();
+    ves_interpret("test", R"(
+System.print([1, 2].count) // expect: 2
+)");
+    REQUIRE(std::string(get_output_buf()) == R"(
+2
+)" + 1);
+}